@@ -0,0 +1,261 @@
+/*
+ * bench.c
+ *
+ * Copyright (c) 2012 - 2017 Thomas Buck <xythobuz@xythobuz.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/** \file bench.c
+ *  ISR cycle benchmark.
+ *  Includes the library source, so the interrupt vectors of UART 0 can be
+ *  called directly with a prepared buffer state. Timer 1 (TCC0 on XMega)
+ *  runs at the CPU clock and measures every call, from the call instruction
+ *  up to and including the reti. Add the interrupt response time and the
+ *  vector table jump of your device to get the full cost per byte.
+ *
+ *  Results are printed on UART 0, one line per path:
+ *
+ *      BENCH <mcu> <config> <path> <cycles>
+ *
+ *  Then the CPU sleeps with interrupts disabled, which ends a simavr run.
+ *  simavr can not run XMegas, so their image is meant for a real board.
+ *  It keeps the 2MHz internal oscillator of the reset state and prints on
+ *  USARTC0 (TXD0 on PC3) with 38400 baud.
+ */
+
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+
+#include "../serial.c"
+
+#ifndef BENCH_MCU
+#define BENCH_MCU "unknown"
+#endif
+
+#ifdef FLOWCONTROL
+#define BENCH_CONFIG "xonxoff"
+#else
+#define BENCH_CONFIG "plain"
+#endif
+
+#if __AVR_ARCH__ >= 100
+#define TIMER_INIT() TCC0.CTRLA = TC_CLKSEL_DIV1_gc
+#define TIMER TCC0.CNT
+#define INTERRUPTS USARTC0.CTRLA
+#define INTERRUPTS_TX 0x03
+#define OUTPUT_INIT() PORTC.DIRSET = PIN3_bm
+#elif defined(UCSR0B)
+#define TIMER_INIT() TCCR1A = 0; TCCR1B = _BV(CS10)
+#define TIMER TCNT1
+#define INTERRUPTS UCSR0B
+#define INTERRUPTS_TX _BV(UDRIE0)
+#define OUTPUT_INIT()
+#else
+#define TIMER_INIT() TCCR1A = 0; TCCR1B = _BV(CS10)
+#define TIMER TCNT1
+#define INTERRUPTS UCSRB
+#define INTERRUPTS_TX _BV(UDRIE)
+#define OUTPUT_INIT()
+#endif
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+// Call an interrupt vector. It saves everything it uses, so nothing is
+// clobbered. The cli right after its reti is always executed before a
+// pending interrupt could be served, so no real interrupt gets in.
+#define CALL(vector) __asm__ __volatile__ ( \
+    "%~call " XSTR(vector) "\n\t" \
+    "cli" \
+    ::: "memory")
+
+#define RX() CALL(SERIALRECIEVEINTERRUPT0)
+#define TX() CALL(SERIALTRANSMITINTERRUPT0)
+
+enum {
+    PATH_RX,
+    PATH_RX_WRAP,
+    PATH_RX_FULL,
+    PATH_TX,
+    PATH_TX_EMPTY,
+    PATH_TX_WRAP,
+    PATH_RX_XOFF,
+    PATH_TX_XOFF,
+    PATHS
+};
+
+static const char nameRx[] PROGMEM = "rx";
+static const char nameRxWrap[] PROGMEM = "rx_wrap";
+static const char nameRxFull[] PROGMEM = "rx_full";
+static const char nameTx[] PROGMEM = "tx";
+static const char nameTxEmpty[] PROGMEM = "tx_empty";
+static const char nameTxWrap[] PROGMEM = "tx_wrap";
+static const char nameRxXoff[] PROGMEM = "rx_xoff";
+static const char nameTxXoff[] PROGMEM = "tx_xoff";
+
+static PGM_P const names[PATHS] PROGMEM = {
+    nameRx, nameRxWrap, nameRxFull,
+    nameTx, nameTxEmpty, nameTxWrap,
+    nameRxXoff, nameTxXoff
+};
+
+static const char prefix[] PROGMEM = "BENCH " BENCH_MCU " " BENCH_CONFIG " ";
+
+static uint16_t cycles[PATHS];
+static uint16_t overhead = 0;
+
+#define MEASURE(path, call) do { \
+    uint16_t start = TIMER; \
+    call; \
+    uint16_t end = TIMER; \
+    cycles[path] = end - start - overhead; \
+} while (0)
+
+static void reset(void) {
+    cli();
+    serialInit(0, BAUD(38400, F_CPU));
+}
+
+static uint16_t fillRx(void) {
+    uint16_t count = 0;
+    while (!serialRxBufferFull(0)) {
+        RX();
+        count++;
+    }
+    return count;
+}
+
+static void drainRx(void) {
+    uint8_t buf[8];
+    while (serialReadBuffer(0, buf, sizeof(buf)) > 0);
+}
+
+static void drainTx(void) {
+    while (!serialTxBufferEmpty(0)) {
+        TX();
+    }
+    while (INTERRUPTS & INTERRUPTS_TX) {
+        TX();
+    }
+}
+
+static void benchReceive(void) {
+    reset();
+    MEASURE(PATH_RX, RX());
+
+    // Byte that wraps the write index
+    reset();
+    uint16_t size = fillRx();
+    drainRx();
+    for (uint16_t i = 0; i < (size - 1); i++) {
+        RX();
+    }
+    drainRx();
+    MEASURE(PATH_RX_WRAP, RX());
+
+    // Byte dropped because the buffer is full
+    reset();
+    fillRx();
+    MEASURE(PATH_RX_FULL, RX());
+}
+
+static void benchTransmit(void) {
+    reset();
+    serialWrite(0, 'x');
+    MEASURE(PATH_TX, TX());
+
+    // Nothing left, transmit interrupt gets disabled
+    drainTx();
+    INTERRUPTS |= INTERRUPTS_TX;
+    MEASURE(PATH_TX_EMPTY, TX());
+
+    // Byte that wraps the read index
+    reset();
+    uint16_t size = serialTxBufferFree(0);
+    for (uint16_t i = 0; i < (size - 1); i++) {
+        serialWrite(0, 'x');
+        drainTx();
+    }
+    serialWrite(0, 'x');
+    MEASURE(PATH_TX_WRAP, TX());
+}
+
+#ifdef FLOWCONTROL
+static void benchFlowControl(void) {
+    // Find the byte that makes the receive ISR send XOFF
+    reset();
+    while (!serialRxBufferFull(0)) {
+        MEASURE(PATH_RX_XOFF, RX());
+        if (INTERRUPTS & INTERRUPTS_TX) {
+            break;
+        }
+    }
+
+    MEASURE(PATH_TX_XOFF, TX());
+}
+#endif // FLOWCONTROL
+
+static void printP(PGM_P s) {
+    char c;
+    while ((c = pgm_read_byte(s++)) != '\0') {
+        serialWrite(0, c);
+    }
+}
+
+int main(void) {
+    TIMER_INIT();
+
+    MEASURE(PATH_RX, __asm__ __volatile__ ("cli" ::: "memory"));
+    overhead = cycles[PATH_RX];
+
+    benchReceive();
+    benchTransmit();
+#ifdef FLOWCONTROL
+    benchFlowControl();
+    uint8_t paths = PATHS;
+#else
+    uint8_t paths = PATH_RX_XOFF;
+#endif
+
+    reset();
+    OUTPUT_INIT();
+    sei();
+    for (uint8_t i = 0; i < paths; i++) {
+        printP(prefix);
+        printP((PGM_P)pgm_read_word(&names[i]));
+        serialWrite(0, ' ');
+        serialWriteInt16(0, cycles[i]);
+        serialWrite(0, '\n');
+    }
+    while (!serialTxBufferEmpty(0));
+
+    // Let the last byte leave the shift register, then stop
+    for (volatile uint16_t i = 0; i < 0xFFFF; i++);
+    cli();
+    sleep_enable();
+    sleep_cpu();
+    return 0;
+}
@@ -0,0 +1,24 @@
+# Compare ISR benchmark results against a baseline.
+# Usage: awk -v tolerance=N -f compare.awk baseline.txt results.txt
+# Fails if any path got more than tolerance cycles slower.
+
+NR == FNR {
+    base[$2 " " $3 " " $4] = $5
+    next
+}
+
+{
+    key = $2 " " $3 " " $4
+    if (!(key in base)) {
+        printf "%-32s %5d (new)\n", key, $5
+    } else if ($5 > base[key] + tolerance) {
+        printf "%-32s %5d (was %d) REGRESSION\n", key, $5, base[key]
+        failed = 1
+    } else {
+        printf "%-32s %5d (was %d)\n", key, $5, base[key]
+    }
+}
+
+END {
+    exit failed
+}
@@ -0,0 +1,233 @@
+/*
+ * io.h
+ *
+ * Copyright (c) 2012 - 2017 Thomas Buck <xythobuz@xythobuz.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _host_avr_io_h
+#define _host_avr_io_h
+
+/** \file host/avr/io.h
+ *  Simulated AVR I/O registers for host builds.
+ *  Only the registers and bits used by the UART library are provided.
+ *  They are plain memory, the simulator in host/sim.c gives them life.
+ */
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+#define RAMEND 0x21FF
+
+extern volatile uint8_t SREG;
+
+#define SREG_I 7
+
+// General purpose I/O, PINx, DDRx and PORTx in a row as on real parts
+extern volatile uint8_t simGpio[6];
+
+#define PINB    simGpio[0]
+#define DDRB    simGpio[1]
+#define PORTB   simGpio[2]
+#define PIND    simGpio[3]
+#define DDRD    simGpio[4]
+#define PORTD   simGpio[5]
+
+// Classic AVR USART
+typedef struct {
+    volatile uint8_t UDR;
+    volatile uint8_t UCSRA;
+    volatile uint8_t UCSRB;
+    volatile uint8_t UCSRC;
+    volatile uint16_t UBRR;
+} SimClassicUsart;
+
+extern SimClassicUsart simClassicUsart[4];
+
+#define UDR0    simClassicUsart[0].UDR
+#define UCSR0A  simClassicUsart[0].UCSRA
+#define UCSR0B  simClassicUsart[0].UCSRB
+#define UCSR0C  simClassicUsart[0].UCSRC
+#define UBRR0   simClassicUsart[0].UBRR
+#define UDR1    simClassicUsart[1].UDR
+#define UCSR1A  simClassicUsart[1].UCSRA
+#define UCSR1B  simClassicUsart[1].UCSRB
+#define UCSR1C  simClassicUsart[1].UCSRC
+#define UBRR1   simClassicUsart[1].UBRR
+#define UDR2    simClassicUsart[2].UDR
+#define UCSR2A  simClassicUsart[2].UCSRA
+#define UCSR2B  simClassicUsart[2].UCSRB
+#define UCSR2C  simClassicUsart[2].UCSRC
+#define UBRR2   simClassicUsart[2].UBRR
+#define UDR3    simClassicUsart[3].UDR
+#define UCSR3A  simClassicUsart[3].UCSRA
+#define UCSR3B  simClassicUsart[3].UCSRB
+#define UCSR3C  simClassicUsart[3].UCSRC
+#define UBRR3   simClassicUsart[3].UBRR
+
+// UCSRnA
+#define RXC     7
+#define TXC     6
+#define UDRE    5
+#define FE      4
+#define DOR     3
+#define UPE     2
+#define U2X     1
+#define MPCM    0
+
+// UCSRnB
+#define RXCIE   7
+#define TXCIE   6
+#define UDRIE   5
+#define RXEN    4
+#define TXEN    3
+#define UCSZ2   2
+#define RXB8    1
+#define TXB8    0
+
+// UCSRnC
+#define UMSEL1  7
+#define UMSEL0  6
+#define UPM1    5
+#define UPM0    4
+#define USBS    3
+#define UCSZ1   2
+#define UCSZ0   1
+#define UCPOL   0
+
+// XMega USART
+typedef struct {
+    volatile uint8_t DATA;
+    volatile uint8_t STATUS;
+    volatile uint8_t reserved_0x02;
+    volatile uint8_t CTRLA;
+    volatile uint8_t CTRLB;
+    volatile uint8_t CTRLC;
+    volatile uint8_t BAUDCTRLA;
+    volatile uint8_t BAUDCTRLB;
+} USART_t;
+
+extern USART_t simXmegaUsart[8];
+
+#define USARTC0 simXmegaUsart[0]
+#define USARTC1 simXmegaUsart[1]
+#define USARTD0 simXmegaUsart[2]
+#define USARTD1 simXmegaUsart[3]
+#define USARTE0 simXmegaUsart[4]
+#define USARTE1 simXmegaUsart[5]
+#define USARTF0 simXmegaUsart[6]
+#define USARTF1 simXmegaUsart[7]
+
+// STATUS
+#define USART_RXCIF_bm  0x80
+#define USART_TXCIF_bm  0x40
+#define USART_DREIF_bm  0x20
+#define USART_FERR_bm   0x10
+#define USART_BUFOVF_bm 0x08
+#define USART_PERR_bm   0x04
+#define USART_RXB8_bm   0x01
+
+// CTRLA
+#define USART_RXCINTLVL_gp 4
+#define USART_TXCINTLVL_gp 2
+#define USART_DREINTLVL_gp 0
+
+// CTRLB
+#define USART_RXEN_bm   0x10
+#define USART_TXEN_bm   0x08
+#define USART_CLK2X_bm  0x04
+#define USART_MPCM_bm   0x02
+#define USART_TXB8_bm   0x01
+
+// XMega DMA controller, addresses are host pointers
+typedef struct {
+    volatile uint8_t CTRLA;
+    volatile uint8_t CTRLB;
+    volatile uint8_t ADDRCTRL;
+    volatile uint8_t TRIGSRC;
+    volatile uint16_t TRFCNT;
+    volatile uint8_t REPCNT;
+    volatile uint8_t * volatile SRCADDR;
+    volatile uint8_t * volatile DESTADDR;
+} DMA_CH_t;
+
+typedef struct {
+    volatile uint8_t CTRL;
+    DMA_CH_t CH0;
+    DMA_CH_t CH1;
+    DMA_CH_t CH2;
+    DMA_CH_t CH3;
+} DMA_t;
+
+extern DMA_t simDma;
+
+#define DMA simDma
+
+#define DMA_CH0_vect simDmaVector0
+#define DMA_CH1_vect simDmaVector1
+#define DMA_CH2_vect simDmaVector2
+#define DMA_CH3_vect simDmaVector3
+
+// CTRL
+#define DMA_ENABLE_bm 0x80
+
+// CH.CTRLA
+#define DMA_CH_ENABLE_bm 0x80
+#define DMA_CH_RESET_bm 0x40
+#define DMA_CH_REPEAT_bm 0x20
+#define DMA_CH_TRFREQ_bm 0x10
+#define DMA_CH_SINGLE_bm 0x04
+#define DMA_CH_BURSTLEN_1BYTE_gc 0x00
+
+// CH.CTRLB
+#define DMA_CH_CHBUSY_bm 0x80
+#define DMA_CH_CHPEND_bm 0x40
+#define DMA_CH_ERRIF_bm 0x20
+#define DMA_CH_TRNIF_bm 0x10
+#define DMA_CH_ERRINTLVL_gp 2
+#define DMA_CH_TRNINTLVL_gp 0
+
+// CH.ADDRCTRL
+#define DMA_CH_SRCRELOAD_NONE_gc 0x00
+#define DMA_CH_SRCRELOAD_BLOCK_gc 0x40
+#define DMA_CH_SRCDIR_FIXED_gc 0x00
+#define DMA_CH_SRCDIR_INC_gc 0x10
+#define DMA_CH_DESTRELOAD_NONE_gc 0x00
+#define DMA_CH_DESTRELOAD_BLOCK_gc 0x04
+#define DMA_CH_DESTDIR_FIXED_gc 0x00
+#define DMA_CH_DESTDIR_INC_gc 0x01
+
+// CH.TRIGSRC, the DRE trigger of every USART follows its RXC trigger
+#define DMA_CH_TRIGSRC_USARTC0_RXC_gc 0x4B
+#define DMA_CH_TRIGSRC_USARTC1_RXC_gc 0x4E
+#define DMA_CH_TRIGSRC_USARTD0_RXC_gc 0x6B
+#define DMA_CH_TRIGSRC_USARTD1_RXC_gc 0x6E
+#define DMA_CH_TRIGSRC_USARTE0_RXC_gc 0x8B
+#define DMA_CH_TRIGSRC_USARTE1_RXC_gc 0x8E
+#define DMA_CH_TRIGSRC_USARTF0_RXC_gc 0xAB
+#define DMA_CH_TRIGSRC_USARTF1_RXC_gc 0xAE
+
+#endif // _host_avr_io_h
@@ -0,0 +1,708 @@
+/*
+ * sim.c
+ *
+ * Copyright (c) 2012 - 2017 Thomas Buck <xythobuz@xythobuz.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE // fopencookie()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "sim.h"
+
+/** \file sim.c
+ *  Host-side USART simulator implementation.
+ */
+
+volatile uint8_t SREG;
+volatile uint8_t simGpio[6];
+SimClassicUsart simClassicUsart[4];
+USART_t simXmegaUsart[8];
+DMA_t simDma;
+
+// Bit 8 of the queued frames is the 9th data bit
+#define SIM_ADDRESS 0x100
+
+typedef struct {
+    uint16_t rxQueue[SIM_QUEUE_SIZE];
+    uint16_t rxHead, rxTail;
+    uint32_t rxGap;
+    uint64_t rxNext;
+    uint8_t rxErrors;
+
+    uint8_t txLog[SIM_QUEUE_SIZE];
+    uint16_t txCount;
+    uint8_t holding, holdingFull, holdingBit8;
+    uint8_t shift, shifting, shiftBit8;
+    uint64_t shiftEnd;
+
+    uint32_t overruns, collisions, addresses;
+} SimPort;
+
+static SimPort ports[SIM_PORTS];
+static uint64_t now;
+static uint32_t interrupts;
+static uint64_t slept;
+
+static uint32_t timerCycles;
+static uint64_t timerNext;
+static void (*timerHandler)(void);
+
+// Interrupt vectors of the library. Weak, so unused ports may be missing.
+#define SIM_VECTORS(n) \
+    void simRxcVector ## n(void) __attribute__((weak)); \
+    void simDreVector ## n(void) __attribute__((weak)); \
+    void simTxcVector ## n(void) __attribute__((weak));
+
+SIM_VECTORS(0)
+SIM_VECTORS(1)
+SIM_VECTORS(2)
+SIM_VECTORS(3)
+SIM_VECTORS(4)
+SIM_VECTORS(5)
+SIM_VECTORS(6)
+SIM_VECTORS(7)
+
+static void (* const rxcVectors[8])(void) = {
+    simRxcVector0, simRxcVector1, simRxcVector2, simRxcVector3,
+    simRxcVector4, simRxcVector5, simRxcVector6, simRxcVector7
+};
+
+static void (* const dreVectors[8])(void) = {
+    simDreVector0, simDreVector1, simDreVector2, simDreVector3,
+    simDreVector4, simDreVector5, simDreVector6, simDreVector7
+};
+
+static void (* const txcVectors[8])(void) = {
+    simTxcVector0, simTxcVector1, simTxcVector2, simTxcVector3,
+    simTxcVector4, simTxcVector5, simTxcVector6, simTxcVector7
+};
+
+void simDmaVector0(void) __attribute__((weak));
+void simDmaVector1(void) __attribute__((weak));
+void simDmaVector2(void) __attribute__((weak));
+void simDmaVector3(void) __attribute__((weak));
+
+static void (* const dmaVectors[4])(void) = {
+    simDmaVector0, simDmaVector1, simDmaVector2, simDmaVector3
+};
+
+// ----------------------
+// |  Register models   |
+// ----------------------
+
+#ifndef SERIAL_HOST_SIM_XMEGA
+
+#define REG(uart) (simClassicUsart[uart])
+
+static uint8_t rxEnabled(uint8_t uart) { return REG(uart).UCSRB & _BV(RXEN); }
+static uint8_t txEnabled(uint8_t uart) { return REG(uart).UCSRB & _BV(TXEN); }
+static uint8_t rxcFlag(uint8_t uart) { return REG(uart).UCSRA & _BV(RXC); }
+static uint8_t dreFlag(uint8_t uart) { return REG(uart).UCSRA & _BV(UDRE); }
+static uint8_t txcFlag(uint8_t uart) { return REG(uart).UCSRA & _BV(TXC); }
+static uint8_t rxcEnabled(uint8_t uart) { return REG(uart).UCSRB & _BV(RXCIE); }
+static uint8_t dreEnabled(uint8_t uart) { return REG(uart).UCSRB & _BV(UDRIE); }
+static uint8_t txcEnabled(uint8_t uart) { return REG(uart).UCSRB & _BV(TXCIE); }
+
+static void setFlag(uint8_t uart, uint8_t flag, uint8_t on) {
+    uint8_t bit = (flag == 0) ? _BV(RXC) : ((flag == 1) ? _BV(UDRE) : _BV(TXC));
+    if (on) {
+        REG(uart).UCSRA |= bit;
+    } else {
+        REG(uart).UCSRA &= ~bit;
+    }
+}
+
+static void setOverrun(uint8_t uart) {
+    REG(uart).UCSRA |= _BV(DOR);
+}
+
+static void setErrors(uint8_t uart, uint8_t errors) {
+    if (errors & SIM_FRAME_ERROR) {
+        REG(uart).UCSRA |= _BV(FE);
+    }
+    if (errors & SIM_PARITY_ERROR) {
+        REG(uart).UCSRA |= _BV(UPE);
+    }
+}
+
+static void clearErrors(uint8_t uart) {
+    REG(uart).UCSRA &= ~(_BV(FE) | _BV(DOR) | _BV(UPE));
+}
+
+static uint8_t mpcmEnabled(uint8_t uart) { return REG(uart).UCSRA & _BV(MPCM); }
+static uint8_t txBit8(uint8_t uart) { return REG(uart).UCSRB & _BV(TXB8); }
+
+static void setRxBit8(uint8_t uart, uint8_t on) {
+    if (on) {
+        REG(uart).UCSRB |= _BV(RXB8);
+    } else {
+        REG(uart).UCSRB &= ~_BV(RXB8);
+    }
+}
+
+static double cyclesPerBit(uint8_t uart) {
+    double div = (REG(uart).UCSRA & _BV(U2X)) ? 8.0 : 16.0;
+    return div * ((REG(uart).UBRR & 0x0FFF) + 1);
+}
+
+static uint8_t frameBits(uint8_t uart) {
+    uint8_t size = (REG(uart).UCSRC >> UCSZ0) & 0x03;
+    if (REG(uart).UCSRB & _BV(UCSZ2)) {
+        size |= 0x04;
+    }
+    uint8_t bits = 1 + ((size == 0x07) ? 9 : (5 + (size & 0x03)));
+    if (REG(uart).UCSRC & _BV(UPM1)) {
+        bits++;
+    }
+    bits += (REG(uart).UCSRC & _BV(USBS)) ? 2 : 1;
+    return bits;
+}
+
+static uint8_t getData(uint8_t uart) { return REG(uart).UDR; }
+static void setData(uint8_t uart, uint8_t data) { REG(uart).UDR = data; }
+
+static void resetRegisters(void) {
+    memset(simClassicUsart, 0, sizeof(simClassicUsart));
+    for (uint8_t i = 0; i < SIM_PORTS; i++) {
+        REG(i).UCSRA = _BV(UDRE);
+        REG(i).UCSRC = _BV(UCSZ1) | _BV(UCSZ0);
+    }
+}
+
+#else // SERIAL_HOST_SIM_XMEGA
+
+#define REG(uart) (simXmegaUsart[uart])
+
+static uint8_t rxEnabled(uint8_t uart) { return REG(uart).CTRLB & USART_RXEN_bm; }
+static uint8_t txEnabled(uint8_t uart) { return REG(uart).CTRLB & USART_TXEN_bm; }
+static uint8_t rxcFlag(uint8_t uart) { return REG(uart).STATUS & USART_RXCIF_bm; }
+static uint8_t dreFlag(uint8_t uart) { return REG(uart).STATUS & USART_DREIF_bm; }
+static uint8_t txcFlag(uint8_t uart) { return REG(uart).STATUS & USART_TXCIF_bm; }
+static uint8_t rxcEnabled(uint8_t uart) { return (REG(uart).CTRLA >> USART_RXCINTLVL_gp) & 0x03; }
+static uint8_t dreEnabled(uint8_t uart) { return (REG(uart).CTRLA >> USART_DREINTLVL_gp) & 0x03; }
+static uint8_t txcEnabled(uint8_t uart) { return (REG(uart).CTRLA >> USART_TXCINTLVL_gp) & 0x03; }
+
+static void setFlag(uint8_t uart, uint8_t flag, uint8_t on) {
+    uint8_t bit = (flag == 0) ? USART_RXCIF_bm
+            : ((flag == 1) ? USART_DREIF_bm : USART_TXCIF_bm);
+    if (on) {
+        REG(uart).STATUS |= bit;
+    } else {
+        REG(uart).STATUS &= ~bit;
+    }
+}
+
+static void setOverrun(uint8_t uart) {
+    REG(uart).STATUS |= USART_BUFOVF_bm;
+}
+
+static void setErrors(uint8_t uart, uint8_t errors) {
+    if (errors & SIM_FRAME_ERROR) {
+        REG(uart).STATUS |= USART_FERR_bm;
+    }
+    if (errors & SIM_PARITY_ERROR) {
+        REG(uart).STATUS |= USART_PERR_bm;
+    }
+}
+
+static void clearErrors(uint8_t uart) {
+    REG(uart).STATUS &= ~(USART_FERR_bm | USART_BUFOVF_bm | USART_PERR_bm);
+}
+
+static uint8_t mpcmEnabled(uint8_t uart) { return REG(uart).CTRLB & USART_MPCM_bm; }
+static uint8_t txBit8(uint8_t uart) { return REG(uart).CTRLB & USART_TXB8_bm; }
+
+static void setRxBit8(uint8_t uart, uint8_t on) {
+    if (on) {
+        REG(uart).STATUS |= USART_RXB8_bm;
+    } else {
+        REG(uart).STATUS &= ~USART_RXB8_bm;
+    }
+}
+
+static double cyclesPerBit(uint8_t uart) {
+    uint16_t bsel = ((REG(uart).BAUDCTRLB & 0x0F) << 8) | REG(uart).BAUDCTRLA;
+    int8_t bscale = (int8_t)(REG(uart).BAUDCTRLB & 0xF0) >> 4;
+    double div = (REG(uart).CTRLB & USART_CLK2X_bm) ? 8.0 : 16.0;
+    if (bscale >= 0) {
+        return div * (1 << bscale) * (bsel + 1);
+    } else {
+        return div * ((bsel / (double)(1 << -bscale)) + 1);
+    }
+}
+
+static uint8_t frameBits(uint8_t uart) {
+    uint8_t size = REG(uart).CTRLC & 0x07;
+    uint8_t bits = 1 + ((size == 0x07) ? 9 : (5 + (size & 0x03)));
+    if (REG(uart).CTRLC & 0x20) {
+        bits++;
+    }
+    bits += (REG(uart).CTRLC & 0x08) ? 2 : 1;
+    return bits;
+}
+
+static uint8_t getData(uint8_t uart) { return REG(uart).DATA; }
+static void setData(uint8_t uart, uint8_t data) { REG(uart).DATA = data; }
+
+static void resetRegisters(void) {
+    memset(simXmegaUsart, 0, sizeof(simXmegaUsart));
+    for (uint8_t i = 0; i < SIM_PORTS; i++) {
+        REG(i).STATUS = USART_DREIF_bm;
+        REG(i).CTRLC = 0x03;
+    }
+}
+
+#endif // SERIAL_HOST_SIM_XMEGA
+
+#define FLAG_RXC 0
+#define FLAG_DRE 1
+#define FLAG_TXC 2
+
+// ----------------------
+// |     DMA model      |
+// ----------------------
+
+typedef struct {
+    uint8_t active;
+    uint16_t count;
+    volatile uint8_t *src, *dest;
+} SimDmaChannel;
+
+static DMA_CH_t * const channels[4] = {
+    &simDma.CH0, &simDma.CH1, &simDma.CH2, &simDma.CH3
+};
+
+static SimDmaChannel dma[4];
+
+// Interrupts taken in a row without the handler clearing the flag
+#define SIM_DMA_REPEATS 100
+static uint8_t dmaRepeats[4];
+
+#ifdef SERIAL_HOST_SIM_XMEGA
+
+static const uint8_t rxTriggers[8] = {
+    DMA_CH_TRIGSRC_USARTC0_RXC_gc, DMA_CH_TRIGSRC_USARTC1_RXC_gc,
+    DMA_CH_TRIGSRC_USARTD0_RXC_gc, DMA_CH_TRIGSRC_USARTD1_RXC_gc,
+    DMA_CH_TRIGSRC_USARTE0_RXC_gc, DMA_CH_TRIGSRC_USARTE1_RXC_gc,
+    DMA_CH_TRIGSRC_USARTF0_RXC_gc, DMA_CH_TRIGSRC_USARTF1_RXC_gc
+};
+
+// Single byte transfers, triggered by the USART flags
+static void dmaTransfer(uint8_t c) {
+    DMA_CH_t *ch = channels[c];
+    SimDmaChannel *d = &dma[c];
+
+    if (!(ch->CTRLA & DMA_CH_ENABLE_bm)) {
+        d->active = 0;
+        return;
+    }
+    if (!d->active) {
+        // Remember what has to be reloaded
+        d->active = 1;
+        d->count = ch->TRFCNT;
+        d->src = ch->SRCADDR;
+        d->dest = ch->DESTADDR;
+    }
+
+    uint8_t done = 0;
+    for (uint8_t i = 0; i < SIM_PORTS; i++) {
+        if ((ch->TRIGSRC == rxTriggers[i]) && rxcFlag(i)) {
+            *ch->DESTADDR = simGetData(i);
+            done = 1;
+        } else if ((ch->TRIGSRC == (rxTriggers[i] + 1)) && dreFlag(i) && txEnabled(i)) {
+            simPutData(i, *ch->SRCADDR);
+            done = 1;
+        }
+    }
+    if (!done) {
+        return;
+    }
+
+    if (ch->ADDRCTRL & DMA_CH_SRCDIR_INC_gc) {
+        ch->SRCADDR++;
+    }
+    if (ch->ADDRCTRL & DMA_CH_DESTDIR_INC_gc) {
+        ch->DESTADDR++;
+    }
+
+    if (--ch->TRFCNT == 0) {
+        ch->CTRLB |= DMA_CH_TRNIF_bm;
+        if (ch->CTRLA & DMA_CH_REPEAT_bm) {
+            ch->TRFCNT = d->count;
+            if (ch->ADDRCTRL & DMA_CH_SRCRELOAD_BLOCK_gc) {
+                ch->SRCADDR = d->src;
+            }
+            if (ch->ADDRCTRL & DMA_CH_DESTRELOAD_BLOCK_gc) {
+                ch->DESTADDR = d->dest;
+            }
+        } else {
+            ch->CTRLA &= ~DMA_CH_ENABLE_bm;
+            d->active = 0;
+        }
+    }
+}
+
+#endif // SERIAL_HOST_SIM_XMEGA
+
+// ----------------------
+// |     Simulation     |
+// ----------------------
+
+void simInit(void) {
+    memset(ports, 0, sizeof(ports));
+    memset(&simDma, 0, sizeof(simDma));
+    memset((uint8_t *)simGpio, 0, sizeof(simGpio));
+    memset(dma, 0, sizeof(dma));
+    memset(dmaRepeats, 0, sizeof(dmaRepeats));
+    now = 0;
+    interrupts = 0;
+    slept = 0;
+    timerCycles = 0;
+    SREG = 0;
+    resetRegisters();
+}
+
+uint64_t simTime(void) {
+    return now;
+}
+
+uint32_t simCharTime(uint8_t uart) {
+    return (uint32_t)(cyclesPerBit(uart) * frameBits(uart) + 0.5);
+}
+
+uint32_t simBaudrate(uint8_t uart) {
+    return (uint32_t)(F_CPU / cyclesPerBit(uart) + 0.5);
+}
+
+static void queueFrame(uint8_t uart, uint16_t frame) {
+    SimPort *p = &ports[uart];
+    if (p->rxHead == p->rxTail) {
+        p->rxNext = now + simCharTime(uart);
+    }
+    p->rxQueue[p->rxHead] = frame;
+    p->rxHead = (p->rxHead + 1) % SIM_QUEUE_SIZE;
+    if (p->rxHead == p->rxTail) {
+        fprintf(stderr, "sim: receive queue overflow on UART %d\n", uart);
+        exit(1);
+    }
+}
+
+void simReceive(uint8_t uart, const uint8_t *data, uint16_t length) {
+    while (length-- > 0) {
+        queueFrame(uart, *data++);
+    }
+}
+
+void simReceiveAddress(uint8_t uart, uint8_t address) {
+    queueFrame(uart, SIM_ADDRESS | address);
+}
+
+void simSetRxGap(uint8_t uart, uint32_t cycles) {
+    ports[uart].rxGap = cycles;
+}
+
+void simSetRxErrors(uint8_t uart, uint8_t errors) {
+    ports[uart].rxErrors = errors;
+}
+
+uint16_t simRxPending(uint8_t uart) {
+    SimPort *p = &ports[uart];
+    return (p->rxHead + SIM_QUEUE_SIZE - p->rxTail) % SIM_QUEUE_SIZE;
+}
+
+uint16_t simTransmitted(uint8_t uart, uint8_t *data, uint16_t length) {
+    SimPort *p = &ports[uart];
+    if (length > p->txCount) {
+        length = p->txCount;
+    }
+    memcpy(data, p->txLog, length);
+    memmove(p->txLog, p->txLog + length, p->txCount - length);
+    p->txCount -= length;
+    return length;
+}
+
+uint32_t simOverruns(uint8_t uart) {
+    return ports[uart].overruns;
+}
+
+uint32_t simCollisions(uint8_t uart) {
+    return ports[uart].collisions;
+}
+
+uint32_t simAddressFrames(uint8_t uart) {
+    return ports[uart].addresses;
+}
+
+uint32_t simInterruptCount(void) {
+    return interrupts;
+}
+
+static void startShift(uint8_t uart) {
+    SimPort *p = &ports[uart];
+    p->shift = p->holding;
+    p->shiftBit8 = p->holdingBit8;
+    p->holdingFull = 0;
+    p->shifting = 1;
+    p->shiftEnd = now + simCharTime(uart);
+    setFlag(uart, FLAG_DRE, 1);
+}
+
+void simPutData(uint8_t uart, uint8_t data) {
+    SimPort *p = &ports[uart];
+    if (!txEnabled(uart)) {
+        return;
+    }
+    if (p->holdingFull) {
+        p->collisions++;
+    }
+    p->holding = data;
+    p->holdingBit8 = txBit8(uart) ? 1 : 0;
+    p->holdingFull = 1;
+    setFlag(uart, FLAG_DRE, 0);
+    if (!p->shifting) {
+        startShift(uart);
+    }
+}
+
+uint8_t simGetData(uint8_t uart) {
+    // The error flags belong to the byte that is read now
+    setFlag(uart, FLAG_RXC, 0);
+    clearErrors(uart);
+    return getData(uart);
+}
+
+static void lineStep(uint8_t uart) {
+    SimPort *p = &ports[uart];
+
+    // The data register empty flag is read-only, undo plain register writes
+    setFlag(uart, FLAG_DRE, !p->holdingFull);
+
+    if ((p->rxHead != p->rxTail) && (now >= p->rxNext)) {
+        uint16_t frame = p->rxQueue[p->rxTail];
+        uint8_t c = frame;
+        p->rxTail = (p->rxTail + 1) % SIM_QUEUE_SIZE;
+        p->rxNext = now + simCharTime(uart) + p->rxGap;
+
+        // Multi-processor mode ignores data frames
+        if (rxEnabled(uart) && !(mpcmEnabled(uart) && !(frame & SIM_ADDRESS))) {
+            if (rxcFlag(uart)) {
+                p->overruns++;
+                setOverrun(uart);
+            } else {
+                setData(uart, c);
+                setRxBit8(uart, (frame & SIM_ADDRESS) ? 1 : 0);
+                setErrors(uart, p->rxErrors);
+                p->rxErrors = 0;
+                setFlag(uart, FLAG_RXC, 1);
+            }
+        }
+    }
+
+    if (p->shifting && (now >= p->shiftEnd)) {
+        if (p->txCount < SIM_QUEUE_SIZE) {
+            p->txLog[p->txCount++] = p->shift;
+        }
+        if (p->shiftBit8) {
+            p->addresses++;
+        }
+        p->shifting = 0;
+        if (p->holdingFull) {
+            startShift(uart);
+        } else {
+            setFlag(uart, FLAG_TXC, 1);
+        }
+    }
+}
+
+static void call(void (*vector)(void), uint8_t uart, const char *name) {
+    if (vector == 0) {
+        fprintf(stderr, "sim: %s %d has no handler\n", name, uart);
+        exit(1);
+    }
+    interrupts++;
+    SREG &= ~_BV(SREG_I);
+    vector();
+    SREG |= _BV(SREG_I);
+}
+
+static void interruptStep(uint8_t uart) {
+    if (!(SREG & _BV(SREG_I))) {
+        return;
+    }
+
+    if (rxcEnabled(uart) && rxcFlag(uart)) {
+        call(rxcVectors[uart], uart, "RXC interrupt of UART");
+    }
+
+    if (dreEnabled(uart) && dreFlag(uart)) {
+        call(dreVectors[uart], uart, "DRE interrupt of UART");
+    }
+
+    if (txcEnabled(uart) && txcFlag(uart)) {
+        // Cleared by hardware when the interrupt is executed
+        setFlag(uart, FLAG_TXC, 0);
+        call(txcVectors[uart], uart, "TXC interrupt of UART");
+    }
+}
+
+static void dmaInterruptStep(uint8_t c) {
+    DMA_CH_t *ch = channels[c];
+    if (!(SREG & _BV(SREG_I)) || !(ch->CTRLB & DMA_CH_TRNIF_bm)
+            || !((ch->CTRLB >> DMA_CH_TRNINTLVL_gp) & 0x03)) {
+        return;
+    }
+
+    // Entering the vector does not clear the flag, writing a one does.
+    // Plain memory can not tell that apart from leaving it set, so the
+    // flag is taken out while the handler runs. Unless the handler writes
+    // a one, it is set again and the interrupt is taken again right away.
+    ch->CTRLB &= ~DMA_CH_TRNIF_bm;
+    call(dmaVectors[c], c, "interrupt of DMA channel");
+    if (ch->CTRLB & DMA_CH_TRNIF_bm) {
+        ch->CTRLB &= ~DMA_CH_TRNIF_bm;
+        dmaRepeats[c] = 0;
+    } else {
+        ch->CTRLB |= DMA_CH_TRNIF_bm;
+        if (++dmaRepeats[c] > SIM_DMA_REPEATS) {
+            fprintf(stderr, "sim: DMA channel %d interrupt flag never cleared\n", c);
+            exit(1);
+        }
+    }
+}
+
+static void timerStep(void) {
+    if ((timerCycles == 0) || (now < timerNext)) {
+        return;
+    }
+    timerNext += timerCycles;
+    if (SREG & _BV(SREG_I)) {
+        call(timerHandler, 0, "timer interrupt");
+    }
+}
+
+void simSetTimer(uint32_t cycles, void (*handler)(void)) {
+    timerCycles = cycles;
+    timerNext = now + cycles;
+    timerHandler = handler;
+}
+
+void simSleep(void) {
+    uint32_t before = interrupts;
+    uint64_t limit = now + F_CPU;
+    while (interrupts == before) {
+        if (now >= limit) {
+            fprintf(stderr, "sim: no interrupt wakes up the sleeping CPU\n");
+            exit(1);
+        }
+        simRun(SIM_STEP);
+        slept += SIM_STEP;
+    }
+}
+
+uint64_t simSleepCycles(void) {
+    return slept;
+}
+
+void simRun(uint32_t cycles) {
+    uint64_t end = now + cycles;
+    while (now < end) {
+        for (uint8_t i = 0; i < SIM_PORTS; i++) {
+            lineStep(i);
+        }
+#ifdef SERIAL_HOST_SIM_XMEGA
+        if (simDma.CTRL & DMA_ENABLE_bm) {
+            for (uint8_t c = 0; c < 4; c++) {
+                dmaTransfer(c);
+            }
+        }
+#endif
+        for (uint8_t i = 0; i < SIM_PORTS; i++) {
+            interruptStep(i);
+        }
+        for (uint8_t c = 0; c < 4; c++) {
+            dmaInterruptStep(c);
+        }
+        timerStep();
+        now += SIM_STEP;
+    }
+}
+
+void simRunChars(uint8_t uart, uint32_t chars) {
+    simRun(chars * simCharTime(uart));
+}
+
+// ----------------------
+// |   stdio streams    |
+// ----------------------
+
+typedef struct {
+    uint8_t uart;
+    int (*put)(uint8_t, char);
+    int (*get)(uint8_t);
+    FILE *file;
+} SimStream;
+
+static SimStream streams[SIM_PORTS];
+
+static ssize_t streamWrite(void *cookie, const char *data, size_t length) {
+    SimStream *s = cookie;
+    for (size_t i = 0; i < length; i++) {
+        s->put(s->uart, data[i]);
+    }
+    return length;
+}
+
+static ssize_t streamRead(void *cookie, char *data, size_t length) {
+    SimStream *s = cookie;
+    if (length == 0) {
+        return 0;
+    }
+    int c = s->get(s->uart);
+    if (c == EOF) {
+        return -1;
+    }
+    data[0] = c;
+    return 1;
+}
+
+FILE *simStreamOpen(uint8_t uart, int (*put)(uint8_t, char), int (*get)(uint8_t)) {
+    SimStream *s = &streams[uart];
+    if (s->file == 0) {
+        cookie_io_functions_t functions = { streamRead, streamWrite, 0, 0 };
+        s->uart = uart;
+        s->put = put;
+        s->get = get;
+        s->file = fopencookie(s, "r+", functions);
+        setvbuf(s->file, 0, _IONBF, 0);
+    }
+    return s->file;
+}
@@ -0,0 +1,192 @@
+/*
+ * sim.h
+ *
+ * Copyright (c) 2012 - 2017 Thomas Buck <xythobuz@xythobuz.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _sim_h
+#define _sim_h
+
+/** \file sim.h
+ *  Host-side USART simulator.
+ *  Models the transmitter and receiver of every UART module
+ *  in virtual CPU cycles, at the baudrate configured in the
+ *  simulated registers, and calls the interrupt vectors of
+ *  the library whenever the real hardware would.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef SERIAL_HOST_SIM_XMEGA
+#define SIM_PORTS 4 /**< Number of simulated classic USART modules */
+#else
+#define SIM_PORTS 8 /**< Number of simulated XMega USART modules */
+#endif
+
+#define SIM_QUEUE_SIZE 4096 /**< Line buffer size per direction and port */
+#define SIM_STEP 8 /**< Simulation resolution in CPU cycles */
+
+/** Reset all simulated registers and line state. */
+void simInit(void);
+
+/** Advance virtual time, firing interrupts when they become pending.
+ *  \param cycles Number of CPU cycles to simulate
+ */
+void simRun(uint32_t cycles);
+
+/** Advance virtual time by a number of character times.
+ *  \param uart UART module whose baudrate is used
+ *  \param chars Number of character times to simulate
+ */
+void simRunChars(uint8_t uart, uint32_t chars);
+
+/** Get the current virtual time.
+ *  \returns CPU cycles since simInit()
+ */
+uint64_t simTime(void);
+
+/** Queue bytes to be received, one character time apart.
+ *  \param uart UART module receiving the data
+ *  \param data Bytes the remote end sends
+ *  \param length Number of bytes
+ */
+void simReceive(uint8_t uart, const uint8_t *data, uint16_t length);
+
+/** Queue an address frame, with the 9th data bit set.
+ *  \param uart UART module receiving the frame
+ *  \param address Address the remote end sends
+ */
+void simReceiveAddress(uint8_t uart, uint8_t address);
+
+/** Set an additional idle time between received bytes.
+ *  Used to simulate a remote end sending slower than line rate.
+ *  \param uart UART module to configure
+ *  \param cycles Idle CPU cycles after each received byte
+ */
+void simSetRxGap(uint8_t uart, uint32_t cycles);
+
+#define SIM_FRAME_ERROR 0x01 /**< Receive the next byte without a stop bit */
+#define SIM_PARITY_ERROR 0x02 /**< Receive the next byte with a wrong parity bit */
+
+/** Flag errors for the next received byte.
+ *  \param uart UART module to configure
+ *  \param errors SIM_FRAME_ERROR and / or SIM_PARITY_ERROR
+ */
+void simSetRxErrors(uint8_t uart, uint8_t errors);
+
+/** Get the number of bytes still waiting on the line.
+ *  \param uart UART module to check
+ *  \returns Bytes not yet received
+ */
+uint16_t simRxPending(uint8_t uart);
+
+/** Fetch the bytes that were completely transmitted.
+ *  \param uart UART module to read
+ *  \param data Buffer for the transmitted bytes
+ *  \param length Buffer size
+ *  \returns Number of bytes copied and removed from the log
+ */
+uint16_t simTransmitted(uint8_t uart, uint8_t *data, uint16_t length);
+
+/** Get the duration of one frame, as currently configured.
+ *  \param uart UART module to check
+ *  \returns CPU cycles per character
+ */
+uint32_t simCharTime(uint8_t uart);
+
+/** Get the baudrate, as currently configured.
+ *  \param uart UART module to check
+ *  \returns Bits per second
+ */
+uint32_t simBaudrate(uint8_t uart);
+
+/** Get the number of bytes lost in the receive data register.
+ *  \param uart UART module to check
+ *  \returns Bytes that arrived before the previous one was read
+ */
+uint32_t simOverruns(uint8_t uart);
+
+/** Get the number of bytes the library overwrote in the transmit data register.
+ *  \param uart UART module to check
+ *  \returns Bytes written while the data register was not empty
+ */
+uint32_t simCollisions(uint8_t uart);
+
+/** Get the number of transmitted frames with the 9th data bit set.
+ *  \param uart UART module to check
+ *  \returns Address frames sent since simInit()
+ */
+uint32_t simAddressFrames(uint8_t uart);
+
+/** Get the number of interrupt vectors called.
+ *  \returns Interrupts executed since simInit()
+ */
+uint32_t simInterruptCount(void);
+
+/** Call a handler as timer interrupt in regular intervals.
+ *  \param cycles CPU cycles between calls, 0 to stop the timer
+ *  \param handler Interrupt handler
+ */
+void simSetTimer(uint32_t cycles, void (*handler)(void));
+
+/** Sleep until the next interrupt.
+ *  Used by sleep_cpu() instead of the sleep instruction. Fails the
+ *  simulation if no interrupt arrives within one second.
+ */
+void simSleep(void);
+
+/** Get the time spent in sleep mode.
+ *  \returns CPU cycles slept since simInit()
+ */
+uint64_t simSleepCycles(void);
+
+/** Write to the transmit data register.
+ *  Used by the library instead of a plain register write.
+ *  \param uart UART module to write to
+ *  \param data Byte to transmit
+ */
+void simPutData(uint8_t uart, uint8_t data);
+
+/** Read from the receive data register.
+ *  Used by the library instead of a plain register read.
+ *  \param uart UART module to read from
+ *  \returns Received byte
+ */
+uint8_t simGetData(uint8_t uart);
+
+/** Open a host stdio stream calling the stream hooks of the library.
+ *  Stands in for fdev_setup_stream() of avr-libc. The stream is
+ *  unbuffered, every byte goes through the hooks, and it is only
+ *  opened once per UART module.
+ *  \param uart UART module of the stream
+ *  \param put Called for every written byte
+ *  \param get Called for every read byte, returns EOF on error
+ *  \returns Stream
+ */
+FILE *simStreamOpen(uint8_t uart, int (*put)(uint8_t, char), int (*get)(uint8_t));
+
+#endif // _sim_h
@@ -0,0 +1,1155 @@
+/*
+ * simtest.c
+ *
+ * Copyright (c) 2012 - 2017 Thomas Buck <xythobuz@xythobuz.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+#include <stdint.h>
+
+#include "serial.h"
+#include "sim.h"
+
+/** \file simtest.c
+ *  Regression tests for the UART library, running on the host simulator.
+ */
+
+static int failures = 0;
+
+#define CHECK(x) do { \
+    if (!(x)) { \
+        printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #x); \
+        failures++; \
+    } \
+} while (0)
+
+#define TESTBAUD BAUD(38400, F_CPU)
+
+static void setup(uint8_t uart) {
+    simInit();
+    serialInit(uart, TESTBAUD);
+    sei();
+}
+
+static uint16_t transmitted(uint8_t uart, uint8_t *buf, uint16_t length) {
+    simRunChars(uart, length + 2);
+    return simTransmitted(uart, buf, length);
+}
+
+static void testTransmit(void) {
+    uint8_t buf[32];
+    setup(0);
+    uint16_t space = serialTxBufferFree(0);
+    CHECK((space & (space - 1)) == 0);
+    serialWriteString(0, "Hello");
+    serialWrite(0, '!');
+    serialWriteString_P(0, PSTR(" flash"));
+    CHECK(transmitted(0, buf, sizeof(buf)) == 12);
+    CHECK(memcmp(buf, "Hello! flash", 12) == 0);
+    CHECK(serialTxBufferEmpty(0));
+    CHECK(simCollisions(0) == 0);
+}
+
+// Send a formatted number and compare what arrives
+#define CHECKFORMAT(call, text) do { \
+    uint8_t buf[32]; \
+    call; \
+    uint16_t n = transmitted(0, buf, sizeof(buf)); \
+    CHECK((n == strlen(text)) && (memcmp(buf, text, n) == 0)); \
+} while (0)
+
+static void testFormat(void) {
+    setup(0);
+    CHECKFORMAT(serialWriteInt16(0, 0), "0");
+    CHECKFORMAT(serialWriteInt16(0, 65535), "65535");
+    CHECKFORMAT(serialWriteUInt32(0, 4294967295ul), "4294967295");
+    CHECKFORMAT(serialWriteUInt32(0, 1000000), "1000000");
+    CHECKFORMAT(serialWriteInt32(0, -2147483647l - 1), "-2147483648");
+    CHECKFORMAT(serialWriteInt32(0, 42), "42");
+    CHECKFORMAT(serialWriteFixed(0, 1234, 2), "12.34");
+    CHECKFORMAT(serialWriteFixed(0, -5, 2), "-0.05");
+    CHECKFORMAT(serialWriteFixed(0, 7, 0), "7");
+    CHECKFORMAT(serialWriteHex(0, 0xBEEF, 0), "BEEF");
+    CHECKFORMAT(serialWriteHex(0, 0x1A, 4), "001A");
+    CHECKFORMAT(serialWriteHex(0, 0xDEADBEEF, 8), "DEADBEEF");
+    CHECKFORMAT(serialWriteBinary(0, 5, 8), "00000101");
+    CHECKFORMAT(serialWriteBinary(0, 0, 0), "0");
+    CHECKFORMAT(serialWriteBinary(0, 0x8000, 0), "1000000000000000");
+}
+
+static void testLineRate(void) {
+    uint8_t buf[32];
+    setup(0);
+
+    // The next byte waits in the data register, no gaps between frames
+    serialWriteString(0, "0123456789abcdef");
+    simRun(16 * simCharTime(0) + SIM_STEP);
+    CHECK(simTransmitted(0, buf, sizeof(buf)) == 16);
+    CHECK(memcmp(buf, "0123456789abcdef", 16) == 0);
+}
+
+#if BAUD_ERROR(115200, F_CPU) > BAUD_TOLERANCE
+#error BAUD_ERROR() has to work in the preprocessor
+#endif
+
+// Configure a baudrate, check its accuracy and send a byte with it
+#define CHECKBAUD(rate) do { \
+    uint8_t c; \
+    simInit(); \
+    serialInit(0, BAUD(rate, F_CPU)); \
+    sei(); \
+    uint32_t actual = simBaudrate(0); \
+    uint32_t error = ((actual > rate) ? (actual - rate) : (rate - actual)) * 1000ull / rate; \
+    CHECK(error <= BAUD_ERROR(rate, F_CPU)); \
+    CHECK(BAUD_ERROR(rate, F_CPU) <= BAUD_TOLERANCE); \
+    serialWrite(0, 'b'); \
+    CHECK(transmitted(0, &c, 1) == 1); \
+    CHECK(c == 'b'); \
+} while (0)
+
+static void testBaudrates(void) {
+    CHECKBAUD(300);
+    CHECKBAUD(9600);
+    CHECKBAUD(38400);
+    CHECKBAUD(115200);
+    CHECKBAUD(230400);
+    CHECKBAUD(500000);
+#ifdef SERIAL_HOST_SIM_XMEGA
+    CHECKBAUD(921600);
+    CHECKBAUD(1000000);
+    CHECKBAUD(2000000);
+#endif
+
+    // Runtime values still work, with the plain normal speed setting
+    volatile uint32_t rate = 9600;
+    CHECK(BAUD(rate, F_CPU) == (F_CPU / (9600 * 16l) - 1));
+    uint8_t c;
+    simInit();
+    serialInit(0, BAUD(rate, F_CPU));
+    sei();
+    serialWrite(0, 'r');
+    CHECK(transmitted(0, &c, 1) == 1);
+    CHECK(c == 'r');
+}
+
+static void testFrames(void) {
+    uint8_t buf[32];
+    setup(0);
+    uint64_t time = simCharTime(0);
+
+    // Start bit, 7 data bits, parity and 2 stop bits
+    serialInitFrame(0, TESTBAUD, SERIAL_DATA_7 | SERIAL_PARITY_EVEN | SERIAL_STOP_2);
+    CHECK(simCharTime(0) == (time * 11 / 10));
+    serialInitFrame(0, TESTBAUD, SERIAL_9N1);
+    CHECK(simCharTime(0) == (time * 11 / 10));
+
+    // Only the address has the 9th bit set
+    serialWriteString(0, "ab");
+    serialWriteAddress(0, 0x42);
+    serialWrite(0, 'c');
+    CHECK(transmitted(0, buf, sizeof(buf)) == 4);
+    CHECK(memcmp(buf, "ab\x42" "c", 4) == 0);
+    CHECK(simAddressFrames(0) == 1);
+    CHECK(simCollisions(0) == 0);
+}
+
+static void testReceive(void) {
+    uint8_t buf[32];
+    setup(0);
+    CHECK(!serialHasChar(0));
+    simReceive(0, (const uint8_t *)"abcdef", 6);
+    simRunChars(0, 8);
+    CHECK(serialHasChar(0));
+    CHECK(serialRxBufferUsed(0) == 6);
+    CHECK(serialGet(0) == 'a');
+    CHECK(serialReadBuffer(0, buf, 3) == 3);
+    CHECK(memcmp(buf, "bcd", 3) == 0);
+    CHECK(serialReadBuffer(0, buf, sizeof(buf)) == 2);
+    CHECK(memcmp(buf, "ef", 2) == 0);
+    CHECK(serialRxBufferEmpty(0));
+    CHECK(serialReadBuffer(0, buf, sizeof(buf)) == 0);
+    CHECK(serialGet(0) == 0);
+}
+
+static void testWrap(void) {
+    uint8_t in[7], out[16];
+    setup(0);
+    for (uint8_t round = 0; round < 40; round++) {
+        for (uint8_t i = 0; i < sizeof(in); i++) {
+            in[i] = round * sizeof(in) + i;
+        }
+
+        simReceive(0, in, sizeof(in));
+        simRunChars(0, sizeof(in) + 1);
+        CHECK(serialReadBuffer(0, out, sizeof(out)) == sizeof(in));
+        CHECK(memcmp(in, out, sizeof(in)) == 0);
+
+        serialWriteBuffer(0, in, sizeof(in));
+        CHECK(transmitted(0, out, sizeof(out)) == sizeof(in));
+        CHECK(memcmp(in, out, sizeof(in)) == 0);
+    }
+}
+
+static void tick(void) {
+    serialTick();
+}
+
+static void testBlocking(void) {
+    uint8_t in[100], out[128], c;
+    setup(0);
+    for (uint8_t i = 0; i < sizeof(in); i++) {
+        in[i] = i + 1;
+    }
+
+    // Waiting for a byte still on the line, and for transmit buffer space
+    simReceive(0, (const uint8_t *)"w", 1);
+    CHECK(serialGetBlocking(0) == 'w');
+    serialWriteBuffer(0, in, sizeof(in));
+    CHECK(transmitted(0, out, sizeof(out)) == sizeof(in));
+    CHECK(memcmp(in, out, sizeof(in)) == 0);
+
+    // Timeouts are counted in timer ticks
+    simSetTimer(F_CPU / 1000, tick);
+    uint64_t start = simTime();
+    CHECK(!serialGetTimeout(0, &c, 5));
+    CHECK((simTime() - start) >= (4 * (F_CPU / 1000)));
+    simReceive(0, (const uint8_t *)"t", 1);
+    CHECK(serialGetTimeout(0, &c, 5));
+    CHECK(c == 't');
+    simSetTimer(0, 0);
+
+#if defined(SERIALSLEEP) && !defined(SERIAL_DMA_RX_0)
+    // Only the receive interrupt wakes up a reader, not the DMA controller
+    CHECK(simSleepCycles() > 0);
+#endif
+    CHECK(simCollisions(0) == 0);
+}
+
+#ifndef SERIAL_DMA_RX_0
+static uint16_t overflow(uint8_t uart) {
+    uint8_t in[1024], out[1024];
+    setup(uart);
+    for (uint16_t i = 0; i < sizeof(in); i++) {
+        in[i] = i * 7;
+    }
+    simReceive(uart, in, sizeof(in));
+    simRunChars(uart, sizeof(in) + 1);
+    CHECK(serialRxBufferFull(uart));
+
+    // The oldest bytes are kept, the rest is dropped
+    uint16_t count = serialReadBuffer(uart, out, sizeof(out));
+    CHECK((count > 0) && (count < sizeof(in)));
+    CHECK((count & (count - 1)) == 0);
+    CHECK(memcmp(in, out, count) == 0);
+    CHECK(serialRxBufferEmpty(uart));
+    CHECK(simOverruns(uart) == 0);
+    return count;
+}
+
+static void testOverflow(void) {
+    uint16_t size = overflow(0);
+#ifdef RX_BUFFER_SIZE_0
+    CHECK(size == RX_BUFFER_SIZE_0);
+#endif
+#ifndef SERIAL_POLLED_1
+    size = overflow(1);
+#ifdef RX_BUFFER_SIZE_1
+    CHECK(size == RX_BUFFER_SIZE_1);
+#endif
+#endif // SERIAL_POLLED_1
+    (void)size;
+}
+#endif // SERIAL_DMA_RX_0
+
+static void testPorts(void) {
+    uint8_t buf[8];
+    simInit();
+    for (uint8_t i = 0; i < serialAvailable(); i++) {
+        serialInit(i, TESTBAUD);
+    }
+    sei();
+
+    for (uint8_t i = 0; i < serialAvailable(); i++) {
+        serialWrite(i, 'A' + i);
+        simReceive(i, (const uint8_t *)"01234567" + i, 1);
+    }
+    simRunChars(0, 3);
+    for (uint8_t i = 0; i < serialAvailable(); i++) {
+        CHECK(simTransmitted(i, buf, sizeof(buf)) == 1);
+        CHECK(buf[0] == 'A' + i);
+#ifdef SERIAL_PACKETS_3
+        if (i == 3) {
+            continue; // Only stores whole packets
+        }
+#endif
+        CHECK(serialGet(i) == '0' + i);
+        CHECK(!serialHasChar(i));
+    }
+}
+
+static void testPortApi(void) {
+    uint8_t buf[8];
+    simInit();
+    serialInit(2, TESTBAUD);
+    sei();
+
+    serial2Write('f');
+    serial2Write('x');
+    CHECK(transmitted(2, buf, sizeof(buf)) == 2);
+    CHECK(memcmp(buf, "fx", 2) == 0);
+
+    CHECK(!serial2HasChar());
+    simReceive(2, (const uint8_t *)"in", 2);
+    simRunChars(2, 3);
+    CHECK(serial2HasChar());
+    CHECK(serial2Get() == 'i');
+    CHECK(serial2Get() == 'n');
+    CHECK(!serial2HasChar());
+    CHECK(serial2Get() == 0);
+
+    // Wrapping around, and waiting in serialWrite() while the buffer is full
+    uint8_t big[TX_BUFFER_SIZE_2 + 3];
+    for (uint16_t i = 0; i < sizeof(big); i++) {
+        serial2Write('a' + (i % 26));
+    }
+    CHECK(transmitted(2, big, sizeof(big)) == sizeof(big));
+    for (uint16_t i = 0; i < sizeof(big); i++) {
+        CHECK(big[i] == 'a' + (i % 26));
+    }
+
+    for (uint16_t i = 0; i < RX_BUFFER_SIZE_2; i++) {
+        simReceive(2, (const uint8_t *)"ok", 2);
+        simRunChars(2, 3);
+        CHECK(serial2Get() == 'o');
+        CHECK(serial2Get() == 'k');
+    }
+    CHECK(!serial2HasChar());
+}
+
+static void testClose(void) {
+    uint8_t buf[8];
+    setup(0);
+    serialWriteString(0, "bye");
+    simRunChars(0, 5);
+    serialClose(0);
+    CHECK(transmitted(0, buf, sizeof(buf)) == 3);
+    simReceive(0, (const uint8_t *)"x", 1);
+    simRunChars(0, 2);
+    CHECK(!serialHasChar(0));
+}
+
+#ifdef SERIAL_DMA_RX_0
+static void testDma(void) {
+    uint8_t in[100], out[128];
+    setup(0);
+    for (uint8_t i = 0; i < sizeof(in); i++) {
+        in[i] = i * 3;
+    }
+
+    uint32_t interrupts = simInterruptCount();
+    simReceive(0, in, sizeof(in));
+    serialWriteBuffer(0, in, sizeof(in));
+    simRunChars(0, sizeof(in) + 2);
+    CHECK(serialRxBufferUsed(0) == sizeof(in));
+    CHECK(serialReadBuffer(0, out, sizeof(out)) == sizeof(in));
+    CHECK(memcmp(in, out, sizeof(in)) == 0);
+    CHECK(simTransmitted(0, out, sizeof(out)) == sizeof(in));
+    CHECK(memcmp(in, out, sizeof(in)) == 0);
+    CHECK(serialTxBufferEmpty(0));
+
+    // One interrupt per transmitted block, none per byte
+    CHECK((simInterruptCount() - interrupts) <= 2);
+    CHECK(simOverruns(0) == 0);
+    CHECK(simCollisions(0) == 0);
+}
+#endif // SERIAL_DMA_RX_0
+
+#ifdef SERIAL_DMA_TX_1
+static void testDmaTx(void) {
+    uint8_t out[32];
+    setup(1);
+
+    // Every block is counted once, also when the line stays idle after it
+    for (uint8_t round = 0; round < 3; round++) {
+        uint32_t interrupts = simInterruptCount();
+        serialWriteString(1, "block");
+        CHECK(transmitted(1, out, sizeof(out)) == 5);
+        CHECK(memcmp(out, "block", 5) == 0);
+        simRunChars(1, 4);
+        CHECK(simTransmitted(1, out, sizeof(out)) == 0);
+        CHECK(serialTxBufferEmpty(1));
+        CHECK((simInterruptCount() - interrupts) == 1);
+    }
+}
+#endif // SERIAL_DMA_TX_1
+
+#ifdef SERIALLINES
+static void testLines(void) {
+    char line[16];
+    setup(0);
+    CHECK(!serialHasLine(0));
+    CHECK(serialReadLine(0, line, sizeof(line)) == 0);
+    CHECK(line[0] == '\0');
+
+    simReceive(0, (const uint8_t *)"$GP,1\nAT\n\npart", 14);
+    simRunChars(0, 16);
+    CHECK(serialHasLine(0));
+    CHECK(serialReadLine(0, line, sizeof(line)) == 6);
+    CHECK(strcmp(line, "$GP,1") == 0);
+    CHECK(serialGet(0) == 'A');
+    CHECK(serialReadLine(0, line, sizeof(line)) == 2);
+    CHECK(strcmp(line, "T") == 0);
+    CHECK(serialReadLine(0, line, sizeof(line)) == 1);
+    CHECK(strcmp(line, "") == 0);
+    CHECK(!serialHasLine(0));
+    CHECK(serialReadLine(0, line, sizeof(line)) == 0);
+
+    // Lines longer than the buffer are split
+    simReceive(0, (const uint8_t *)"ial line\n", 9);
+    simRunChars(0, 10);
+    CHECK(serialReadLine(0, line, 8) == 7);
+    CHECK(strcmp(line, "partial") == 0);
+    CHECK(serialHasLine(0));
+    CHECK(serialReadLine(0, line, 8) == 6);
+    CHECK(strcmp(line, " line") == 0);
+
+    // Terminators taken by the other read functions are accounted for
+    simReceive(0, (const uint8_t *)"a\nb\n", 4);
+    simRunChars(0, 5);
+    CHECK(serialReadBuffer(0, (uint8_t *)line, 4) == 4);
+    CHECK(!serialHasLine(0));
+
+    // A full buffer without terminator can still be read
+    uint8_t in[255];
+    memset(in, 'x', sizeof(in));
+    simReceive(0, in, sizeof(in));
+    simRunChars(0, sizeof(in) + 1);
+    CHECK(serialHasLine(0));
+    CHECK(serialReadLine(0, line, sizeof(line)) == (sizeof(line) - 1));
+    CHECK(!serialHasLine(0));
+}
+#endif // SERIALLINES
+
+#ifdef SERIAL_RTS_PORT_0
+static void testRtsCts(void) {
+    uint8_t in[64], out[64];
+    setup(0);
+    CHECK(DDRB & _BV(SERIAL_RTS_PIN_0));
+    CHECK(!(DDRB & _BV(SERIAL_CTS_PIN_0)));
+    CHECK(!(PORTB & _BV(SERIAL_RTS_PIN_0)));
+
+    // RTS stops the remote end shortly before the buffer is full
+    uint16_t size = 0;
+    while (!(PORTB & _BV(SERIAL_RTS_PIN_0)) && (size < 1024)) {
+        simReceive(0, (const uint8_t *)"r", 1);
+        simRunChars(0, 2);
+        size++;
+    }
+    CHECK(!serialRxBufferFull(0));
+    CHECK(serialRxBufferUsed(0) == size);
+
+    // And lets it continue once half of it is free again
+    uint16_t used = size;
+    while ((PORTB & _BV(SERIAL_RTS_PIN_0)) && (used > 0)) {
+        serialGet(0);
+        used--;
+    }
+    CHECK(serialRxBufferUsed(0) == used);
+    CHECK((used >= (size / 2)) && (used < (size - 1)));
+    CHECK(serialReadBuffer(0, in, sizeof(in)) == used);
+
+    // Nothing is sent while CTS is high
+    PINB |= _BV(SERIAL_CTS_PIN_0);
+    serialWriteString(0, "cts");
+    simRunChars(0, 5);
+    CHECK(simTransmitted(0, out, sizeof(out)) == 0);
+    PINB &= ~_BV(SERIAL_CTS_PIN_0);
+    simRunChars(0, 5);
+    CHECK(simTransmitted(0, out, sizeof(out)) == 0);
+    serialCtsChanged(0);
+    CHECK(transmitted(0, out, sizeof(out)) == 3);
+    CHECK(memcmp(out, "cts", 3) == 0);
+
+    // Stopping in the middle of the buffer
+    serialWriteString(0, "0123456789");
+    simRunChars(0, 3);
+    PINB |= _BV(SERIAL_CTS_PIN_0);
+    simRunChars(0, 10);
+    uint16_t count = simTransmitted(0, out, sizeof(out));
+    CHECK((count > 0) && (count < 10));
+    PINB &= ~_BV(SERIAL_CTS_PIN_0);
+    serialCtsChanged(0);
+    CHECK(transmitted(0, out + count, sizeof(out) - count) == (10 - count));
+    CHECK(memcmp(out, "0123456789", 10) == 0);
+
+    serialClose(0);
+    CHECK(PORTB & _BV(SERIAL_RTS_PIN_0));
+}
+#endif // SERIAL_RTS_PORT_0
+
+#ifdef SERIAL_DE_PORT_0
+#define DE (PORTD & _BV(SERIAL_DE_PIN_0))
+
+// Run until length bytes went out, DE has to stay on the whole time
+static uint16_t driven(uint8_t uart, uint8_t *buf, uint16_t length) {
+    uint16_t count = 0;
+    uint64_t end = simCharTime(uart) * (length + 2);
+    for (uint64_t t = 0; (t < end) && (count < length); t += SIM_STEP) {
+        CHECK(DE);
+        simRun(SIM_STEP);
+        count += simTransmitted(uart, buf + count, length - count);
+    }
+    return count;
+}
+
+static void testRs485(void) {
+    uint8_t out[32];
+    setup(0);
+    CHECK(DDRD & _BV(SERIAL_DE_PIN_0));
+    CHECK(!DE);
+
+    // DE goes on with the write and off right after the last stop bit
+    serialWriteString(0, "bus");
+    CHECK(driven(0, out, 3) == 3);
+    CHECK(memcmp(out, "bus", 3) == 0);
+    simRun(SIM_STEP);
+    CHECK(!DE);
+
+    // Writing again after a gap turns it on again
+    serialWrite(0, 'a');
+    CHECK(driven(0, out, 1) == 1);
+    simRun(SIM_STEP);
+    CHECK(!DE);
+    serialWriteAddress(0, 0x42);
+    CHECK(driven(0, out, 1) == 1);
+    CHECK(out[0] == 0x42);
+    simRun(SIM_STEP);
+    CHECK(!DE);
+
+    // Nothing happens when receiving
+    simReceive(0, (const uint8_t *)"rx", 2);
+    simRunChars(0, 3);
+    CHECK(!DE);
+    CHECK(serialReadBuffer(0, out, sizeof(out)) == 2);
+
+    // Closing waits for the end of the transmission
+    serialWriteString(0, "end");
+    serialClose(0);
+    CHECK(!DE);
+    simRunChars(0, 2);
+    CHECK(simTransmitted(0, out, sizeof(out)) == 3);
+    CHECK(simCollisions(0) == 0);
+}
+#endif // SERIAL_DE_PORT_0
+
+#ifdef SERIAL_POLLED_1
+static void testPolled(void) {
+    uint8_t buf[32];
+    setup(1);
+    uint32_t interrupts = simInterruptCount();
+
+    // Every byte waits for the data register, nothing is buffered
+    serialWriteString(1, "polled");
+    CHECK(transmitted(1, buf, sizeof(buf)) == 6);
+    CHECK(memcmp(buf, "polled", 6) == 0);
+    CHECK(simCollisions(1) == 0);
+    CHECK(serialTxBufferEmpty(1));
+
+    simReceive(1, (const uint8_t *)"ab", 2);
+    CHECK(serialGetBlocking(1) == 'a');
+    CHECK(serialGetBlocking(1) == 'b');
+    CHECK(!serialHasChar(1));
+    CHECK(serialGet(1) == 0);
+    CHECK(simOverruns(1) == 0);
+
+    // The receiver holds a single byte, anything more is lost
+    simReceive(1, (const uint8_t *)"xyz", 3);
+    simRunChars(1, 4);
+    CHECK(serialRxBufferUsed(1) == 1);
+    CHECK(serialReadBuffer(1, buf, sizeof(buf)) == 1);
+    CHECK(simOverruns(1) > 0);
+
+#ifdef FLOWCONTROL
+    // XON and XOFF are written directly as well
+    setFlow(1, 0);
+    setFlow(1, 0);
+    setFlow(1, 1);
+    CHECK(transmitted(1, buf, sizeof(buf)) == 2);
+    CHECK((buf[0] == 0x13) && (buf[1] == 0x11));
+#endif
+
+    CHECK(simInterruptCount() == interrupts);
+}
+#endif // SERIAL_POLLED_1
+
+#ifdef SERIALREFERENCE
+static uint8_t referenceCalls = 0;
+
+static void referenceDone(uint8_t uart) {
+    CHECK(uart == 0);
+    referenceCalls++;
+}
+
+static const uint8_t banner[] PROGMEM = "flash banner";
+
+static void testReference(void) {
+    static const char *ram = "0123456789abcdefghijklmnopqrstuvwxyz";
+    uint8_t buf[64];
+    setup(0);
+
+    // Longer than the transmit buffer, sent in order with the copied bytes
+    serialWriteString(0, "<");
+    serialWriteReference(0, (const uint8_t *)ram, 36, referenceDone);
+    CHECK(!serialReferenceDone(0));
+    CHECK(!serialTxBufferEmpty(0));
+    serialWriteString(0, ">");
+    simRunChars(0, 40);
+    CHECK(serialReferenceDone(0));
+    CHECK(referenceCalls == 1);
+
+    serialWriteReference_P(0, banner, sizeof(banner) - 1, 0);
+    CHECK(transmitted(0, buf, sizeof(buf)) == 50);
+    CHECK(memcmp(buf, "<", 1) == 0);
+    CHECK(memcmp(buf + 1, ram, 36) == 0);
+    CHECK(memcmp(buf + 37, ">flash banner", 13) == 0);
+    CHECK(serialTxBufferEmpty(0));
+    CHECK(referenceCalls == 1);
+    CHECK(simCollisions(0) == 0);
+}
+#endif // SERIALREFERENCE
+
+#ifdef SERIALSTDIO
+static void testStdio(void) {
+    uint8_t buf[64];
+    setup(0);
+    FILE *stream = serialStream(0);
+    CHECK(stream != 0);
+    CHECK(serialStream(serialAvailable()) == 0);
+
+    // Staged until the end of the line
+    fprintf(stream, "x=%d", 42);
+    CHECK(transmitted(0, buf, sizeof(buf)) == 0);
+    fputc('\n', stream);
+    CHECK(transmitted(0, buf, sizeof(buf)) == 5);
+    CHECK(memcmp(buf, "x=42\n", 5) == 0);
+
+    // Longer output is sent in pieces, the rest on request
+    fputs("0123456789abcdefghij", stream);
+    uint16_t count = transmitted(0, buf, sizeof(buf));
+    CHECK(count < 20);
+    serialStreamFlush(0);
+    CHECK(transmitted(0, buf + count, sizeof(buf) - count) == (20 - count));
+    CHECK(memcmp(buf, "0123456789abcdefghij", 20) == 0);
+
+    // Reading sends the prompt first
+    simReceive(0, (const uint8_t *)"ok", 2);
+    simRunChars(0, 3);
+    fputs("> ", stream);
+    CHECK(fgetc(stream) == 'o');
+    CHECK(fgetc(stream) == 'k');
+    CHECK(transmitted(0, buf, sizeof(buf)) == 2);
+    CHECK(memcmp(buf, "> ", 2) == 0);
+    CHECK(simCollisions(0) == 0);
+}
+#endif // SERIALSTDIO
+
+#ifdef SERIALSTATS
+static void testStats(void) {
+    SerialStats stats;
+    uint8_t in[255], out[255];
+    setup(0);
+    serialGetStats(0, &stats);
+    CHECK((stats.received == 0) && (stats.transmitted == 0));
+
+    serialWriteString(0, "stats");
+    simReceive(0, (const uint8_t *)"abc", 3);
+    simRunChars(0, 7);
+    serialGetStats(0, &stats);
+    CHECK(stats.received == 3);
+    CHECK(stats.transmitted == 5);
+    CHECK(stats.maxRxUsed == 3);
+    CHECK(serialReadBuffer(0, out, sizeof(out)) == 3);
+
+    // Bytes with errors are counted and kept
+    simSetRxErrors(0, SIM_FRAME_ERROR);
+    simReceive(0, (const uint8_t *)"f", 1);
+    simRunChars(0, 2);
+    simSetRxErrors(0, SIM_PARITY_ERROR);
+    simReceive(0, (const uint8_t *)"p", 1);
+    simRunChars(0, 2);
+
+    // Interrupts disabled for too long, the hardware loses bytes
+    cli();
+    simReceive(0, (const uint8_t *)"xyz", 3);
+    simRunChars(0, 4);
+    sei();
+    simRunChars(0, 1);
+
+    serialGetStats(0, &stats);
+    CHECK(stats.frameErrors == 1);
+    CHECK(stats.parityErrors == 1);
+    CHECK(stats.overruns == 1);
+    CHECK(stats.overflows == 0);
+    CHECK(stats.received == 6);
+    CHECK(serialReadBuffer(0, out, sizeof(out)) == 3);
+    CHECK(memcmp(out, "fpx", 3) == 0);
+
+    // The high-water mark shows the buffer size, the rest was dropped
+    memset(in, 'o', sizeof(in));
+    simReceive(0, in, sizeof(in));
+    simRunChars(0, sizeof(in) + 1);
+    uint16_t size = serialRxBufferUsed(0);
+    serialGetStats(0, &stats);
+    CHECK(stats.received == (6 + sizeof(in)));
+    CHECK(stats.maxRxUsed == size);
+    CHECK(stats.overflows == (sizeof(in) - size));
+#ifdef FLOWCONTROL
+    CHECK(stats.xoffs == 1);
+#endif
+
+    serialClearStats(0);
+    serialGetStats(0, &stats);
+    CHECK((stats.received == 0) && (stats.overflows == 0) && (stats.maxRxUsed == 0));
+}
+#endif // SERIALSTATS
+
+#ifdef SERIALMULTIDROP
+static void testMpcm(void) {
+    uint8_t buf[32];
+    setup(0);
+    serialInitFrame(0, TESTBAUD, SERIAL_9N1);
+    serialSetAddress(0, 0x12, 1);
+    uint32_t interrupts = simInterruptCount();
+
+    // Data for other nodes does not even raise an interrupt
+    simReceive(0, (const uint8_t *)"other", 5);
+    simRunChars(0, 6);
+    CHECK(!serialHasChar(0));
+    CHECK(simInterruptCount() == interrupts);
+
+    // Our address is swallowed and enables the receiver
+    simReceiveAddress(0, 0x12);
+    simReceive(0, (const uint8_t *)"ours", 4);
+    simRunChars(0, 6);
+    CHECK(serialReadBuffer(0, buf, sizeof(buf)) == 4);
+    CHECK(memcmp(buf, "ours", 4) == 0);
+
+    // Until another node is addressed
+    simReceiveAddress(0, 0x34);
+    simReceive(0, (const uint8_t *)"theirs", 6);
+    simRunChars(0, 8);
+    CHECK(!serialHasChar(0));
+
+    // Without the filter, everything is received
+    serialSetAddress(0, 0x12, 0);
+    simReceive(0, (const uint8_t *)"all", 3);
+    simRunChars(0, 4);
+    CHECK(serialReadBuffer(0, buf, sizeof(buf)) == 3);
+    CHECK(memcmp(buf, "all", 3) == 0);
+}
+#endif // SERIALMULTIDROP
+
+#ifdef SERIALPENDING
+static void testPending(void) {
+    uint8_t buf[8];
+    simInit();
+    for (uint8_t i = 0; i < serialAvailable(); i++) {
+        serialInit(i, TESTBAUD);
+    }
+    sei();
+    CHECK(serialPendingMask() == 0);
+
+    // Marked by the interrupts, and only cleared once empty
+    simReceive(2, (const uint8_t *)"ab", 2);
+    simReceive(3, (const uint8_t *)"c", 1);
+    simRunChars(2, 3);
+    CHECK(serialPendingMask() == 0x0C);
+    CHECK(serialTxSpaceMask() == 0x0F);
+    CHECK(serialGet(2) == 'a');
+    CHECK(serialPendingMask() == 0x0C);
+    CHECK(serialGet(2) == 'b');
+    CHECK(serialPendingMask() == 0x08);
+    CHECK(serialReadBuffer(3, buf, sizeof(buf)) == 1);
+    CHECK(serialPendingMask() == 0);
+
+#ifdef SERIAL_POLLED_1
+    // Polled UARTs are checked every time
+    simReceive(1, (const uint8_t *)"p", 1);
+    simRunChars(1, 2);
+    CHECK(serialPendingMask() == 0x02);
+    CHECK(serialGet(1) == 'p');
+    CHECK(serialPendingMask() == 0);
+#endif
+
+    // A full transmit buffer clears the bit until the interrupt made room
+    uint16_t count = 0;
+    while ((serialTxSpaceMask() & 0x01) && (count < 1000)) {
+        serialWrite(0, 'x');
+        count++;
+    }
+    CHECK(serialTxBufferFull(0));
+    CHECK(serialTxSpaceMask() == 0x0E);
+    simRunChars(0, 2);
+    CHECK(serialTxSpaceMask() == 0x0F);
+    simRunChars(0, count + 2);
+}
+#endif // SERIALPENDING
+
+#ifdef SERIALCALLBACKS
+static uint8_t hooked[16], hookedCount;
+
+// Takes digits, everything else goes to the receive buffer
+static uint8_t byteHook(uint8_t uart, uint8_t data) {
+    if ((uart != 0) || (data < '0') || (data > '9')) {
+        return 0;
+    }
+    if (hookedCount < sizeof(hooked)) {
+        hooked[hookedCount++] = data;
+    }
+    return 1;
+}
+
+static void testCallbacks(void) {
+    uint8_t buf[32];
+    setup(0);
+    serialInit(1, TESTBAUD);
+    hookedCount = 0;
+    serialSetByteCallback(0, byteHook);
+    serialSetRxLevel(0, 4);
+
+    // Taken bytes never reach the buffer
+    simReceive(0, (const uint8_t *)"a1b2c", 5);
+    simRunChars(0, 6);
+    CHECK((hookedCount == 2) && (memcmp(hooked, "12", 2) == 0));
+    CHECK(serialRxLevelMask() == 0);
+    CHECK(serialRxBufferUsed(0) == 3);
+
+    // Noted by the interrupt, reported once
+    simReceive(0, (const uint8_t *)"def", 3);
+    simRunChars(0, 4);
+    CHECK(serialRxLevelMask() == 0x01);
+    CHECK(serialRxLevelMask() == 0);
+
+    // Again with the next byte while the level holds
+    simReceive(0, (const uint8_t *)"g", 1);
+    simRunChars(0, 2);
+    CHECK(serialRxLevelMask() == 0x01);
+
+    // Not for a buffer read below the level since
+    simReceive(0, (const uint8_t *)"h", 1);
+    simRunChars(0, 2);
+    CHECK(serialReadBuffer(0, buf, sizeof(buf)) == 8);
+    CHECK(memcmp(buf, "abcdefgh", 8) == 0);
+    CHECK(serialRxLevelMask() == 0);
+
+    // Armed at or below the current level, and jumping past it
+    simReceive(1, (const uint8_t *)"xyz", 3);
+    simRunChars(1, 4);
+    serialSetRxLevel(1, 2);
+    CHECK(serialRxLevelMask() == 0x02);
+    serialSetRxLevel(1, 0);
+    serialReadBuffer(1, buf, sizeof(buf));
+
+    // Removed
+    serialSetByteCallback(0, 0);
+    serialSetRxLevel(0, 0);
+    simReceive(0, (const uint8_t *)"3456", 4);
+    simRunChars(0, 5);
+    CHECK(hookedCount == 2);
+    CHECK(serialRxLevelMask() == 0);
+    CHECK(serialReadBuffer(0, buf, sizeof(buf)) == 4);
+}
+#endif // SERIALCALLBACKS
+
+#ifdef SERIALIDLE
+static uint8_t frameUart;
+static uint16_t frameLength, frameCount;
+
+static void frameDone(uint8_t uart, uint16_t length) {
+    frameUart = uart;
+    frameLength = length;
+    frameCount++;
+}
+
+static void testIdle(void) {
+    uint8_t buf[32];
+    setup(1);
+    simSetTimer(simCharTime(1) / 2, tick);
+    serialSetIdleTimeout(1, 8, frameDone);
+    frameCount = 0;
+
+    // A frame ends 3.5 to 4 characters after its last byte
+    simReceive(1, (const uint8_t *)"frame", 5);
+    simRunChars(1, 5);
+    simRunChars(1, 3);
+    CHECK(serialFrameComplete(1) == 0);
+    CHECK(frameCount == 0);
+    simRunChars(1, 2);
+    CHECK(frameCount == 1);
+    CHECK((frameUart == 1) && (frameLength == 5));
+    CHECK(serialFrameComplete(1) == 5);
+    CHECK(serialFrameComplete(1) == 0);
+    CHECK(serialReadBuffer(1, buf, sizeof(buf)) == 5);
+
+    // Shorter gaps do not split it
+    simReceive(1, (const uint8_t *)"ab", 2);
+    simRunChars(1, 4);
+    simReceive(1, (const uint8_t *)"cde", 3);
+    simRunChars(1, 10);
+    CHECK(frameCount == 2);
+    CHECK(serialFrameComplete(1) == 5);
+
+    // Turned off, nothing is reported
+    serialSetIdleTimeout(1, 0, 0);
+    simReceive(1, (const uint8_t *)"off", 3);
+    simRunChars(1, 10);
+    CHECK(frameCount == 2);
+    CHECK(serialFrameComplete(1) == 0);
+    simSetTimer(0, 0);
+}
+#endif // SERIALIDLE
+
+#ifdef SERIAL_PACKETS_3
+// Reference COBS decoder, checks the CRC and removes it
+static int16_t decodePacket(const uint8_t *in, uint16_t length, uint8_t *out) {
+    uint16_t count = 0, i = 0;
+    if ((length == 0) || (in[length - 1] != 0)) {
+        return -1;
+    }
+    length--;
+    while (i < length) {
+        uint8_t code = in[i++];
+        if ((code == 0) || ((i + code - 1) > length)) {
+            return -1;
+        }
+        for (uint8_t j = 1; j < code; j++) {
+            out[count++] = in[i++];
+        }
+        if ((code != 0xFF) && (i < length)) {
+            out[count++] = 0;
+        }
+    }
+    uint16_t crc = 0xFFFF;
+    for (i = 0; i < count; i++) {
+        crc = _crc_ccitt_update(crc, out[i]);
+    }
+    return ((count >= 2) && (crc == 0)) ? (int16_t)(count - 2) : -1;
+}
+
+// Send a packet, check the encoding and receive it again
+static void checkPacket(const uint8_t *data, uint16_t length) {
+    static uint8_t line[400], out[400];
+    serialSendPacket(3, data, length);
+    uint16_t n = transmitted(3, line, sizeof(line));
+    CHECK(n <= (length + 4 + ((length + 2) / 254)));
+    CHECK(memchr(line, 0, n) == &line[n - 1]);
+    CHECK(decodePacket(line, n, out) == length);
+    CHECK(memcmp(out, data, length) == 0);
+
+    simReceive(3, line, n);
+    simRunChars(3, n + 1);
+    CHECK(serialHasPacket(3));
+    memset(out, 0xAA, sizeof(out));
+    CHECK(serialReadPacket(3, out, sizeof(out)) == length);
+    CHECK(memcmp(out, data, length) == 0);
+    CHECK(!serialHasPacket(3));
+}
+
+static void testPackets(void) {
+    uint8_t data[300], line[400];
+    setup(3);
+
+    checkPacket(data, 0);
+    checkPacket((const uint8_t *)"\0\0", 2);
+    checkPacket((const uint8_t *)"hello\0world", 11);
+    for (uint16_t i = 0; i < sizeof(data); i++) {
+        data[i] = (i % 251) + 1;
+    }
+    checkPacket(data, sizeof(data)); // Blocks of 254 bytes without a zero
+    checkPacket(data, 254);
+    checkPacket(data, 253);
+    data[100] = 0;
+    checkPacket(data, sizeof(data));
+
+    // Bit errors and garbage in front of a packet are dropped
+    serialSendPacket(3, (const uint8_t *)"crc", 3);
+    uint16_t n = transmitted(3, line, sizeof(line));
+    line[2] ^= 0x10;
+    simReceive(3, (const uint8_t *)"\0\0\x05xx\0", 6);
+    simReceive(3, line, n);
+    simRunChars(3, n + 7);
+    CHECK(!serialHasPacket(3));
+    checkPacket((const uint8_t *)"ok", 2);
+
+    // Packets that do not fit are skipped, the next one arrives
+    serialSendPacket(3, data, sizeof(data));
+    n = transmitted(3, line, sizeof(line));
+    for (uint8_t i = 0; i < 2; i++) {
+        simReceive(3, line, n);
+    }
+    simRunChars(3, (2 * n) + 1);
+#ifdef SERIAL_RTS_PORT_3
+    // The second one filled the buffer and stopped the remote end
+    CHECK(PORTB & _BV(SERIAL_RTS_PIN_3));
+#endif
+    CHECK(serialReadPacket(3, line, sizeof(line)) == sizeof(data));
+    CHECK(!serialHasPacket(3));
+#ifdef SERIAL_RTS_PORT_3
+    CHECK(!(PORTB & _BV(SERIAL_RTS_PIN_3)));
+#endif
+    checkPacket((const uint8_t *)"next", 4);
+
+    // Reading into a small buffer cuts the packet off
+    serialSendPacket(3, (const uint8_t *)"truncated", 9);
+    n = transmitted(3, line, sizeof(line));
+    simReceive(3, line, n);
+    simRunChars(3, n + 1);
+    CHECK(serialReadPacket(3, data, 5) == 9);
+    CHECK(memcmp(data, "trunc", 5) == 0);
+    CHECK(!serialHasPacket(3));
+
+#ifdef SERIALSTATS
+    SerialStats stats;
+    serialGetStats(3, &stats);
+    CHECK(stats.packetErrors == 3);
+#endif
+}
+#endif // SERIAL_PACKETS_3
+
+#ifdef FLOWCONTROL
+static void testFlowControl(void) {
+    uint8_t out[64];
+    uint16_t sent = 0;
+    setup(0);
+
+    // XOFF once the buffer fills up
+    while ((simTransmitted(0, out, sizeof(out)) == 0) && (sent < 1024)) {
+        CHECK(!serialRxBufferFull(0));
+        simReceive(0, (const uint8_t *)"x", 1);
+        simRunChars(0, 2);
+        sent++;
+    }
+    CHECK(out[0] == 0x13);
+
+    // XON once it is drained again
+    uint16_t count = 0, n;
+    while ((n = serialReadBuffer(0, out, sizeof(out))) > 0) {
+        count += n;
+    }
+    CHECK(count == sent);
+    simRunChars(0, 2);
+    CHECK(simTransmitted(0, out, sizeof(out)) == 1);
+    CHECK(out[0] == 0x11);
+
+    // Bytes dropped while the remote end ignores XOFF do not delay XON
+    uint8_t in[255];
+    memset(in, 'y', sizeof(in));
+    simReceive(0, in, sizeof(in));
+    simRunChars(0, sizeof(in) + 1);
+    CHECK(serialRxBufferFull(0));
+    CHECK(simTransmitted(0, out, sizeof(out)) == 1);
+    CHECK(out[0] == 0x13);
+    while (serialReadBuffer(0, out, sizeof(out)) > 0);
+    simRunChars(0, 2);
+    CHECK(simTransmitted(0, out, sizeof(out)) == 1);
+    CHECK(out[0] == 0x11);
+}
+#endif // FLOWCONTROL
+
+int main(void) {
+    testTransmit();
+    testLineRate();
+    testFormat();
+    testBaudrates();
+    testFrames();
+    testReceive();
+    testWrap();
+    testBlocking();
+#ifndef SERIAL_DMA_RX_0
+    testOverflow();
+#else
+    testDma();
+#endif
+#ifdef SERIAL_DMA_TX_1
+    testDmaTx();
+#endif
+    testPorts();
+    testPortApi();
+    testClose();
+#ifdef FLOWCONTROL
+    testFlowControl();
+#endif
+#ifdef SERIALLINES
+    testLines();
+#endif
+#ifdef SERIAL_RTS_PORT_0
+    testRtsCts();
+#endif
+#ifdef SERIAL_DE_PORT_0
+    testRs485();
+#endif
+#ifdef SERIAL_POLLED_1
+    testPolled();
+#endif
+#ifdef SERIALREFERENCE
+    testReference();
+#endif
+#ifdef SERIALSTDIO
+    testStdio();
+#endif
+#ifdef SERIALSTATS
+    testStats();
+#endif
+#ifdef SERIALMULTIDROP
+    testMpcm();
+#endif
+#ifdef SERIALPENDING
+    testPending();
+#endif
+#ifdef SERIALCALLBACKS
+    testCallbacks();
+#endif
+#ifdef SERIALIDLE
+    testIdle();
+#endif
+#ifdef SERIAL_PACKETS_3
+    testPackets();
+#endif
+
+    if (failures > 0) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
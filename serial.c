@@ -29,7 +29,12 @@
  */
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/crc16.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "serial.h"
 #include "serial_device.h"
@@ -45,528 +50,2916 @@
  *  UART Library Implementation
  */
 
-/** If you define this, a '\\r' (CR) will be put in front of a '\\n' (LF) when sending a byte.
- *  Binary Communication will then be impossible!
+// SERIALINJECTCR, FLOWCONTROL and SERIALLINES are switched in serial.h
+
+/** Defining this allows sending buffers by reference,
+ *  with serialWriteReference() and serialWriteReference_P()
  */
-// #define SERIALINJECTCR
+//#define SERIALREFERENCE
 
-#ifndef UART_XMEGA
+/** Defining this lets the receive interrupt filter by address in
+ *  multi-processor communication mode, for serialSetAddress()
+ */
+//#define SERIALMULTIDROP
+
+/** Defining this lets the receive interrupt mark UARTs with received data,
+ *  for serialPendingMask()
+ */
+//#define SERIALPENDING
 
-#ifndef RX_BUFFER_SIZE
-#define RX_BUFFER_SIZE 32 /**< RX Buffer Size in Bytes (Power of 2) */
-#endif // RX_BUFFER_SIZE
+/** Defining this lets the receive interrupt call back the application,
+ *  for every byte and at a buffer level, see serialSetByteCallback()
+ */
+//#define SERIALCALLBACKS
 
-#ifndef TX_BUFFER_SIZE
-#define TX_BUFFER_SIZE 16 /**< TX Buffer Size in Bytes (Power of 2) */
-#endif // TX_BUFFER_SIZE
+/** Defining this detects idle lines after received frames, counted in
+ *  serialTick() calls, for serialSetIdleTimeout() and serialFrameComplete()
+ */
+//#define SERIALIDLE
 
-#else // UART_XMEGA
+/** Defining this keeps statistics and error counters for every UART,
+ *  for serialGetStats()
+ */
+//#define SERIALSTATS
 
-#ifndef RX_BUFFER_SIZE
-#define RX_BUFFER_SIZE 128 /**< RX Buffer Size in Bytes (Power of 2) */
-#endif // RX_BUFFER_SIZE
+/** Defining this puts the CPU into idle sleep while waiting for an interrupt,
+ *  instead of spinning in the blocking functions
+ */
+//#define SERIALSLEEP
 
-#ifndef TX_BUFFER_SIZE
-#define TX_BUFFER_SIZE 128 /**< TX Buffer Size in Bytes (Power of 2) */
-#endif // TX_BUFFER_SIZE
+/** Defining this gives every UART its own copy of the interrupt handlers,
+ *  with register and buffer addresses known at compile time instead of
+ *  looked up in tables. Faster, but costs flash for every UART.
+ */
+//#define SERIALINLINEISR
 
-#endif // UART_XMEGA
+/** Defining this provides a stdio stream for every UART, with serialStream() */
+//#define SERIALSTDIO
+
+#ifndef SERIALSTDIOBUFFER
+#define SERIALSTDIOBUFFER 16 /**< Bytes staged per stream until a newline, 0 sends every byte */
+#endif
+
+#if SERIALSTDIOBUFFER > 255
+#error SERIAL STDIO BUFFER HAS TO FIT 8BIT!
+#endif
 
-/** Defining this enables incoming XON XOFF (sends XOFF if rx buff is full) */
-//#define FLOWCONTROL
+#ifndef SERIALLINEEND
+#define SERIALLINEEND '\n' /**< Line terminator for serialReadLine() */
+#endif
 
-#define FLOWMARK 5 /**< Space remaining to trigger xoff/xon */
+#define FLOWMARK 5 /**< Space remaining to trigger xoff/xon or to stop RTS */
 #define XON 0x11 /**< XON Value */
 #define XOFF 0x13 /**< XOFF Value */
 
-#if (RX_BUFFER_SIZE < 2) || (TX_BUFFER_SIZE < 2)
-#error SERIAL BUFFER TOO SMALL!
+#if defined(FLOWCONTROL) || defined(SERIAL_RTSCTS)
+#define BUFFER_MIN 8
+#else
+#define BUFFER_MIN 2
 #endif
 
-#ifdef FLOWCONTROL
-#if (RX_BUFFER_SIZE < 8) || (TX_BUFFER_SIZE < 8)
+// Evaluate a buffer size check for every existing UART
+#define CHECK_PORT(n, check) ((UART_COUNT > n) \
+        && (check(RX_BUFFER_SIZE_ ## n) || check(TX_BUFFER_SIZE_ ## n)))
+#define CHECK_PORTS(check) (CHECK_PORT(0, check) || CHECK_PORT(1, check) \
+        || CHECK_PORT(2, check) || CHECK_PORT(3, check) || CHECK_PORT(4, check) \
+        || CHECK_PORT(5, check) || CHECK_PORT(6, check) || CHECK_PORT(7, check))
+
+#define BUFFER_TOO_SMALL(size) ((size) < BUFFER_MIN)
+#define BUFFER_TOO_BIG(size) ((size) > 32768)
+#define BUFFER_NOT_POW2(size) (((size) & ((size) - 1)) != 0)
+
+#if CHECK_PORTS(BUFFER_TOO_SMALL)
 #error SERIAL BUFFER TOO SMALL!
 #endif
+
+#if CHECK_PORTS(BUFFER_TOO_BIG)
+#error SERIAL BUFFER INDEX HAS TO FIT 16BIT!
+#endif
+
+#if CHECK_PORTS(BUFFER_NOT_POW2)
+#error SERIAL BUFFER SIZE HAS TO BE A POWER OF 2!
 #endif
 
-#if ((RX_BUFFER_SIZE + TX_BUFFER_SIZE) * UART_COUNT) >= (RAMEND - 0x60)
+// RAM used by the buffers of every existing UART
+#define PORT_RAM(n) ((UART_COUNT > n) ? (RX_BUFFER_SIZE_ ## n + TX_BUFFER_SIZE_ ## n) : 0)
+#define BUFFER_RAM (PORT_RAM(0) + PORT_RAM(1) + PORT_RAM(2) + PORT_RAM(3) \
+        + PORT_RAM(4) + PORT_RAM(5) + PORT_RAM(6) + PORT_RAM(7))
+
+#if BUFFER_RAM >= (RAMEND - 0x60)
 #error SERIAL BUFFER TOO LARGE!
 #endif
 
-#if (RX_BUFFER_SIZE > 65535) || (TX_BUFFER_SIZE > 65535)
-#error SERIAL BUFFER INDEX HAS TO FIT 16BIT!
+// Polled UARTs never enable their interrupts. Define SERIAL_POLLED_n to 1
+// and the same API talks directly to the data register of UART n, waiting
+// on its status flags. Its buffers, XON/XOFF, RTS/CTS and line mode are
+// not used then.
+#ifndef SERIAL_POLLED_0
+#define SERIAL_POLLED_0 0 /**< Poll UART 0 instead of using interrupts */
+#endif
+#ifndef SERIAL_POLLED_1
+#define SERIAL_POLLED_1 0 /**< Poll UART 1 instead of using interrupts */
+#endif
+#ifndef SERIAL_POLLED_2
+#define SERIAL_POLLED_2 0 /**< Poll UART 2 instead of using interrupts */
+#endif
+#ifndef SERIAL_POLLED_3
+#define SERIAL_POLLED_3 0 /**< Poll UART 3 instead of using interrupts */
+#endif
+#ifndef SERIAL_POLLED_4
+#define SERIAL_POLLED_4 0 /**< Poll UART 4 instead of using interrupts */
+#endif
+#ifndef SERIAL_POLLED_5
+#define SERIAL_POLLED_5 0 /**< Poll UART 5 instead of using interrupts */
+#endif
+#ifndef SERIAL_POLLED_6
+#define SERIAL_POLLED_6 0 /**< Poll UART 6 instead of using interrupts */
+#endif
+#ifndef SERIAL_POLLED_7
+#define SERIAL_POLLED_7 0 /**< Poll UART 7 instead of using interrupts */
 #endif
 
-#ifndef UART_XMEGA
+#define SERIAL_POLLED_MASK (((SERIAL_POLLED_0 != 0) << 0) \
+        | ((SERIAL_POLLED_1 != 0) << 1) | ((SERIAL_POLLED_2 != 0) << 2) \
+        | ((SERIAL_POLLED_3 != 0) << 3) | ((SERIAL_POLLED_4 != 0) << 4) \
+        | ((SERIAL_POLLED_5 != 0) << 5) | ((SERIAL_POLLED_6 != 0) << 6) \
+        | ((SERIAL_POLLED_7 != 0) << 7))
 
-// serialRegisters
-#define SERIALDATA  0
-#define SERIALB     1
-#define SERIALC     2
-#define SERIALA     3
-#define SERIALUBRRH 4
-#define SERIALUBRRL 5
-
-// serialBits
-#define SERIALUCSZ0 0
-#define SERIALUCSZ1 1
-#define SERIALRXCIE 2
-#define SERIALRXEN  3
-#define SERIALTXEN  4
-#define SERIALUDRIE 5
-#define SERIALUDRE  6
+#if SERIAL_POLLED_MASK != 0
+#define SERIAL_POLLED
+#endif
 
-#endif // UART_XMEGA
+// Packet UARTs decode COBS framed packets, ending with a CRC-16, in the
+// receive interrupt. Define SERIAL_PACKETS_n to 1 and only complete packets
+// with a correct CRC are stored for UART n, to be taken out again with
+// serialReadPacket(). serialSendPacket() can then be used on every UART.
+#ifndef SERIAL_PACKETS_0
+#define SERIAL_PACKETS_0 0 /**< Decode received packets of UART 0 */
+#endif
+#ifndef SERIAL_PACKETS_1
+#define SERIAL_PACKETS_1 0 /**< Decode received packets of UART 1 */
+#endif
+#ifndef SERIAL_PACKETS_2
+#define SERIAL_PACKETS_2 0 /**< Decode received packets of UART 2 */
+#endif
+#ifndef SERIAL_PACKETS_3
+#define SERIAL_PACKETS_3 0 /**< Decode received packets of UART 3 */
+#endif
+#ifndef SERIAL_PACKETS_4
+#define SERIAL_PACKETS_4 0 /**< Decode received packets of UART 4 */
+#endif
+#ifndef SERIAL_PACKETS_5
+#define SERIAL_PACKETS_5 0 /**< Decode received packets of UART 5 */
+#endif
+#ifndef SERIAL_PACKETS_6
+#define SERIAL_PACKETS_6 0 /**< Decode received packets of UART 6 */
+#endif
+#ifndef SERIAL_PACKETS_7
+#define SERIAL_PACKETS_7 0 /**< Decode received packets of UART 7 */
+#endif
 
-static uint8_t volatile rxBuffer[UART_COUNT][RX_BUFFER_SIZE];
-static uint8_t volatile txBuffer[UART_COUNT][TX_BUFFER_SIZE];
-static uint16_t volatile rxRead[UART_COUNT];
-static uint16_t volatile rxWrite[UART_COUNT];
-static uint16_t volatile txRead[UART_COUNT];
-static uint16_t volatile txWrite[UART_COUNT];
-static uint8_t volatile shouldStartTransmission[UART_COUNT];
+#define SERIAL_PACKETS_MASK (((SERIAL_PACKETS_0 != 0) << 0) \
+        | ((SERIAL_PACKETS_1 != 0) << 1) | ((SERIAL_PACKETS_2 != 0) << 2) \
+        | ((SERIAL_PACKETS_3 != 0) << 3) | ((SERIAL_PACKETS_4 != 0) << 4) \
+        | ((SERIAL_PACKETS_5 != 0) << 5) | ((SERIAL_PACKETS_6 != 0) << 6) \
+        | ((SERIAL_PACKETS_7 != 0) << 7))
 
-#ifdef FLOWCONTROL
-static uint8_t volatile sendThisNext[UART_COUNT];
-static uint8_t volatile flow[UART_COUNT];
-static uint16_t volatile rxBufferElements[UART_COUNT];
+#if SERIAL_PACKETS_MASK != 0
+#define SERIAL_PACKETS
 #endif
 
-static void serialReceiveInterrupt(uint8_t uart);
-static void serialTransmitInterrupt(uint8_t uart);
+#if (SERIAL_PACKETS_MASK & SERIAL_POLLED_MASK) != 0
+#error A POLLED UART CAN NOT DECODE PACKETS IN THE RECEIVE INTERRUPT!
+#endif
 
-uint8_t serialAvailable(void) {
-    return UART_COUNT;
-}
+#if (defined(SERIAL_DE_PORT_0) && (SERIAL_POLLED_0 != 0)) \
+        || (defined(SERIAL_DE_PORT_1) && (SERIAL_POLLED_1 != 0)) \
+        || (defined(SERIAL_DE_PORT_2) && (SERIAL_POLLED_2 != 0)) \
+        || (defined(SERIAL_DE_PORT_3) && (SERIAL_POLLED_3 != 0)) \
+        || (defined(SERIAL_DE_PORT_4) && (SERIAL_POLLED_4 != 0)) \
+        || (defined(SERIAL_DE_PORT_5) && (SERIAL_POLLED_5 != 0)) \
+        || (defined(SERIAL_DE_PORT_6) && (SERIAL_POLLED_6 != 0)) \
+        || (defined(SERIAL_DE_PORT_7) && (SERIAL_POLLED_7 != 0))
+#error A POLLED UART HAS NO TRANSMIT COMPLETE INTERRUPT TO RELEASE RS-485 DE!
+#endif
 
-void serialWriteInt16(uint8_t uart, uint16_t num) {
-    if (uart >= UART_COUNT) {
-        return;
-    }
+#ifdef UART_XMEGA
 
-    uint8_t buf[5] = { 0, 0, 0, 0, 0 };
-    uint8_t n = 0;
-    if (num == 0) {
-        n = 1;
-    } else {
-        while (num > 0) {
-            buf[n++] = num % 10;
-            num /= 10;
-        }
-    }
+// DMA channels (0 to 3) moving the received or transmitted bytes of UART n.
+// Define SERIAL_DMA_RX_n / SERIAL_DMA_TX_n to a channel number to use them,
+// -1 keeps the interrupt driven transfer for that direction.
+#ifndef SERIAL_DMA_RX_0
+#define SERIAL_DMA_RX_0 -1 /**< DMA Channel receiving for UART 0 */
+#endif
+#ifndef SERIAL_DMA_TX_0
+#define SERIAL_DMA_TX_0 -1 /**< DMA Channel transmitting for UART 0 */
+#endif
+#ifndef SERIAL_DMA_RX_1
+#define SERIAL_DMA_RX_1 -1 /**< DMA Channel receiving for UART 1 */
+#endif
+#ifndef SERIAL_DMA_TX_1
+#define SERIAL_DMA_TX_1 -1 /**< DMA Channel transmitting for UART 1 */
+#endif
+#ifndef SERIAL_DMA_RX_2
+#define SERIAL_DMA_RX_2 -1 /**< DMA Channel receiving for UART 2 */
+#endif
+#ifndef SERIAL_DMA_TX_2
+#define SERIAL_DMA_TX_2 -1 /**< DMA Channel transmitting for UART 2 */
+#endif
+#ifndef SERIAL_DMA_RX_3
+#define SERIAL_DMA_RX_3 -1 /**< DMA Channel receiving for UART 3 */
+#endif
+#ifndef SERIAL_DMA_TX_3
+#define SERIAL_DMA_TX_3 -1 /**< DMA Channel transmitting for UART 3 */
+#endif
+#ifndef SERIAL_DMA_RX_4
+#define SERIAL_DMA_RX_4 -1 /**< DMA Channel receiving for UART 4 */
+#endif
+#ifndef SERIAL_DMA_TX_4
+#define SERIAL_DMA_TX_4 -1 /**< DMA Channel transmitting for UART 4 */
+#endif
+#ifndef SERIAL_DMA_RX_5
+#define SERIAL_DMA_RX_5 -1 /**< DMA Channel receiving for UART 5 */
+#endif
+#ifndef SERIAL_DMA_TX_5
+#define SERIAL_DMA_TX_5 -1 /**< DMA Channel transmitting for UART 5 */
+#endif
+#ifndef SERIAL_DMA_RX_6
+#define SERIAL_DMA_RX_6 -1 /**< DMA Channel receiving for UART 6 */
+#endif
+#ifndef SERIAL_DMA_TX_6
+#define SERIAL_DMA_TX_6 -1 /**< DMA Channel transmitting for UART 6 */
+#endif
+#ifndef SERIAL_DMA_RX_7
+#define SERIAL_DMA_RX_7 -1 /**< DMA Channel receiving for UART 7 */
+#endif
+#ifndef SERIAL_DMA_TX_7
+#define SERIAL_DMA_TX_7 -1 /**< DMA Channel transmitting for UART 7 */
+#endif
 
-    for (int8_t i = n - 1; i >= 0; i--) {
-        serialWrite(uart, buf[i] + '0');
-    }
-}
+#define DMA_PORT(n) ((UART_COUNT > n) \
+        && ((SERIAL_DMA_RX_ ## n >= 0) || (SERIAL_DMA_TX_ ## n >= 0)))
 
-void serialInit(uint8_t uart, uint16_t baud) {
-    if (uart >= UART_COUNT) {
-        return;
-    }
+#if DMA_PORT(0) || DMA_PORT(1) || DMA_PORT(2) || DMA_PORT(3) \
+        || DMA_PORT(4) || DMA_PORT(5) || DMA_PORT(6) || DMA_PORT(7)
+#define SERIAL_DMA
+#endif
 
-    // Initialize state variables
-    rxRead[uart] = 0;
-    rxWrite[uart] = 0;
-    txRead[uart] = 0;
-    txWrite[uart] = 0;
-    shouldStartTransmission[uart] = 1;
+#define DMA_POLLED(n) (DMA_PORT(n) && (SERIAL_POLLED_ ## n != 0))
 
-#ifdef FLOWCONTROL
-    sendThisNext[uart] = 0;
-    flow[uart] = 1;
-    rxBufferElements[uart] = 0;
-#endif // FLOWCONTROL
+#define SERIAL_DMA_RX_MASK (((SERIAL_DMA_RX_0 >= 0) << 0) \
+        | ((SERIAL_DMA_RX_1 >= 0) << 1) | ((SERIAL_DMA_RX_2 >= 0) << 2) \
+        | ((SERIAL_DMA_RX_3 >= 0) << 3) | ((SERIAL_DMA_RX_4 >= 0) << 4) \
+        | ((SERIAL_DMA_RX_5 >= 0) << 5) | ((SERIAL_DMA_RX_6 >= 0) << 6) \
+        | ((SERIAL_DMA_RX_7 >= 0) << 7))
 
-#ifndef UART_XMEGA
+#if DMA_POLLED(0) || DMA_POLLED(1) || DMA_POLLED(2) || DMA_POLLED(3) \
+        || DMA_POLLED(4) || DMA_POLLED(5) || DMA_POLLED(6) || DMA_POLLED(7)
+#error A POLLED UART CAN NOT USE DMA!
+#endif
+
+#endif // UART_XMEGA
+
+#ifndef SERIAL_DMA_RX_MASK
+#define SERIAL_DMA_RX_MASK 0
+#endif
+
+#if defined(SERIAL_DMA) && defined(FLOWCONTROL)
+#error XON/XOFF FLOW CONTROL HAS TO SEE EVERY BYTE, IT CAN NOT BE USED WITH DMA!
+#endif
+
+#if defined(SERIAL_DMA) && defined(SERIALLINES)
+#error LINE COUNTING HAS TO SEE EVERY BYTE, IT CAN NOT BE USED WITH DMA!
+#endif
+
+#if defined(SERIAL_DMA) && defined(SERIALREFERENCE)
+#error REFERENCE TRANSMISSION RUNS IN THE TRANSMIT INTERRUPT, IT CAN NOT BE USED WITH DMA!
+#endif
+
+#if defined(SERIAL_DMA) && defined(SERIAL_RTSCTS)
+#error RTS/CTS FLOW CONTROL HAS TO SEE EVERY BYTE, IT CAN NOT BE USED WITH DMA!
+#endif
 
-    // Default Configuration: 8N1
-    *serialRegisters[uart][SERIALC] = (1 << serialBits[uart][SERIALUCSZ0])
-            | (1 << serialBits[uart][SERIALUCSZ1]);
+#if defined(SERIAL_DMA) && defined(SERIAL_PACKETS)
+#error PACKET DECODING HAS TO SEE EVERY BYTE, IT CAN NOT BE USED WITH DMA!
+#endif
 
-    // Set baudrate
+// Register descriptor of every USART, built from SERIAL_DEVICES in
+// serial_device.h. Defined once here and only ever read from flash.
+typedef struct {
+#ifndef UART_XMEGA
+    volatile uint8_t *data;
+    volatile uint8_t *b;
+    volatile uint8_t *c;
+    volatile uint8_t *a;
 #if SERIALBAUDBIT == 8
-    *serialRegisters[uart][SERIALUBRRH] = (baud >> 8);
-    *serialRegisters[uart][SERIALUBRRL] = baud;
+    volatile uint8_t *baudHigh;
+    volatile uint8_t *baudLow;
 #else // SERIALBAUDBIT == 8
-    *serialBaudRegisters[uart] = baud;
+    volatile uint16_t *baud;
 #endif // SERIALBAUDBIT == 8
+#else // UART_XMEGA
+    volatile USART_t *usart;
+    uint8_t dmaTrigger; // Receive complete, data register empty is the next one
+#endif // UART_XMEGA
+} SerialDevice;
 
-    // Enable Interrupts
-    *serialRegisters[uart][SERIALB] = (1 << serialBits[uart][SERIALRXCIE]);
+typedef const SERIALFLASH SerialDevice *SerialDeviceRef;
 
-    // Enable Receiver/Transmitter
-    *serialRegisters[uart][SERIALB] |= (1 << serialBits[uart][SERIALRXEN])
-            | (1 << serialBits[uart][SERIALTXEN]);
+static const SERIALFLASH SerialDevice serialDevices[UART_COUNT] = SERIAL_DEVICES;
+
+#define SERIALDEVICE(uart) (&serialDevices[uart])
 
+// Data register access, may be provided by serial_device.h instead
+#ifndef SERIALPUTDATA
+#ifndef UART_XMEGA
+#define SERIALPUTDATA(uart, dev, value) (*(dev)->data = (value))
+#define SERIALGETDATA(uart, dev) (*(dev)->data)
 #else // UART_XMEGA
+#define SERIALPUTDATA(uart, dev, value) ((dev)->usart->DATA = (value))
+#define SERIALGETDATA(uart, dev) ((dev)->usart->DATA)
+#endif // UART_XMEGA
+#endif // SERIALPUTDATA
 
-    // Default Configuration: 8N1
-    serialRegisters[uart]->CTRLC = 0x03;
+#ifdef SERIAL_POLLED
+#define POLLED(uart) (SERIAL_POLLED_MASK & (1 << (uart)))
+#endif // SERIAL_POLLED
 
-    // Set baudrate
-    serialRegisters[uart]->BAUDCTRLB = (baud & 0x0F00) >> 8;
-    serialRegisters[uart]->BAUDCTRLA = (baud & 0x00FF);
+#ifdef SERIAL_PACKETS
+#define PACKETS(uart) (SERIAL_PACKETS_MASK & (1 << (uart)))
+#define PACKETHEADER 2 // Length stored in front of every received packet
+#define PACKETBUSY 0x01 // Bytes received since the last delimiter
+#define PACKETDROP 0x02 // Packet does not fit, skip it up to the delimiter
+#endif // SERIAL_PACKETS
 
-    // Enable Interrupts
-    serialRegisters[uart]->CTRLA = UART_INTERRUPT_LEVEL_RX << 4; // RXCINTLVL
+// Status flags, for polled UARTs and bypassing the buffers
+#ifndef UART_XMEGA
+#define RXREADY(uart) (*SERIALDEVICE(uart)->a & (1 << SERIALRXC))
+#define TXREADY(uart) (*SERIALDEVICE(uart)->a & (1 << SERIALUDRE))
+#else // UART_XMEGA
+#define RXREADY(uart) (SERIALDEVICE(uart)->usart->STATUS & USART_RXCIF_bm)
+#define TXREADY(uart) (SERIALDEVICE(uart)->usart->STATUS & USART_DREIF_bm)
+#endif // UART_XMEGA
 
-    // Enable Receiver/Transmitter
-    serialRegisters[uart]->CTRLB = 0x18;
+// Called while waiting on the hardware or the transmit interrupt,
+// may be provided by serial_device.h instead
+#ifndef SERIALWAIT
+#define SERIALWAIT()
+#endif
+
+// Wait until the condition is true. With SERIALSLEEP the CPU idles between
+// interrupts, if interrupts are enabled and one of them is sure to change
+// the condition. Sleeping right after sei() is atomic, an interrupt
+// arriving after the last check still wakes up the CPU.
+#ifdef SERIALSLEEP
+#define SERIALSLEEPUNTIL(condition, wakes) do { \
+    uint8_t sleepSreg = SREG; \
+    cli(); \
+    if ((wakes) && (sleepSreg & _BV(SREG_I)) && !(condition)) { \
+        set_sleep_mode(SLEEP_MODE_IDLE); \
+        sleep_enable(); \
+        sei(); \
+        sleep_cpu(); \
+        sleep_disable(); \
+    } \
+    SREG = sleepSreg; \
+} while (0)
+#else // SERIALSLEEP
+#define SERIALSLEEPUNTIL(condition, wakes)
+#endif // SERIALSLEEP
+
+#define WAITUNTIL(condition, wakes) do { \
+    while (!(condition)) { \
+        SERIALSLEEPUNTIL(condition, wakes); \
+        SERIALWAIT(); \
+    } \
+} while (0)
+
+#ifdef SERIAL_RTSCTS
+// RTS/CTS pin access, see serial_device.h. Both are active low.
+#ifndef UART_XMEGA
+#define RTSOUTPUT(pin) (*((pin).port - 1) |= (pin).mask) // DDRx
+#define RTSREADY(pin) (*(pin).port &= ~(pin).mask)
+#define RTSSTOP(pin) (*(pin).port |= (pin).mask)
+#define CTSINPUT(pin) (*((pin).port - 1) &= ~(pin).mask) // DDRx
+#define CTSREADY(pin) (!(*((pin).port - 2) & (pin).mask)) // PINx
+#else // UART_XMEGA
+#define RTSOUTPUT(pin) ((pin).port->DIRSET = (pin).mask)
+#define RTSREADY(pin) ((pin).port->OUTCLR = (pin).mask)
+#define RTSSTOP(pin) ((pin).port->OUTSET = (pin).mask)
+#define CTSINPUT(pin) ((pin).port->DIRCLR = (pin).mask)
+#define CTSREADY(pin) (!((pin).port->IN & (pin).mask))
+#endif // UART_XMEGA
+#endif // SERIAL_RTSCTS
 
+#ifdef SERIAL_RS485
+// RS-485 driver enable pin access, see serial_device.h. Active high.
+#ifndef UART_XMEGA
+#define DEOUTPUT(pin) (*((pin).port - 1) |= (pin).mask) // DDRx
+#define DEON(pin) (*(pin).port |= (pin).mask)
+#define DEOFF(pin) (*(pin).port &= ~(pin).mask)
+#else // UART_XMEGA
+#define DEOUTPUT(pin) ((pin).port->DIRSET = (pin).mask)
+#define DEON(pin) ((pin).port->OUTSET = (pin).mask)
+#define DEOFF(pin) ((pin).port->OUTCLR = (pin).mask)
 #endif // UART_XMEGA
+#endif // SERIAL_RS485
+
+// Pin tables, built from SERIAL_RTS_n, SERIAL_CTS_n and SERIAL_DE_n
+#ifdef SERIAL_RTSCTS
+static SerialPin const SERIALFLASH serialRtsPins[UART_COUNT] = {
+    SERIAL_RTS_0,
+#if UART_COUNT > 1
+    SERIAL_RTS_1,
+#endif
+#if UART_COUNT > 2
+    SERIAL_RTS_2,
+#endif
+#if UART_COUNT > 3
+    SERIAL_RTS_3,
+#endif
+#if UART_COUNT > 4
+    SERIAL_RTS_4,
+#endif
+#if UART_COUNT > 5
+    SERIAL_RTS_5,
+#endif
+#if UART_COUNT > 6
+    SERIAL_RTS_6,
+#endif
+#if UART_COUNT > 7
+    SERIAL_RTS_7,
+#endif
+};
+
+static SerialPin const SERIALFLASH serialCtsPins[UART_COUNT] = {
+    SERIAL_CTS_0,
+#if UART_COUNT > 1
+    SERIAL_CTS_1,
+#endif
+#if UART_COUNT > 2
+    SERIAL_CTS_2,
+#endif
+#if UART_COUNT > 3
+    SERIAL_CTS_3,
+#endif
+#if UART_COUNT > 4
+    SERIAL_CTS_4,
+#endif
+#if UART_COUNT > 5
+    SERIAL_CTS_5,
+#endif
+#if UART_COUNT > 6
+    SERIAL_CTS_6,
+#endif
+#if UART_COUNT > 7
+    SERIAL_CTS_7,
+#endif
+};
+#endif // SERIAL_RTSCTS
+
+#ifdef SERIAL_RS485
+static SerialPin const SERIALFLASH serialDePins[UART_COUNT] = {
+    SERIAL_DE_0,
+#if UART_COUNT > 1
+    SERIAL_DE_1,
+#endif
+#if UART_COUNT > 2
+    SERIAL_DE_2,
+#endif
+#if UART_COUNT > 3
+    SERIAL_DE_3,
+#endif
+#if UART_COUNT > 4
+    SERIAL_DE_4,
+#endif
+#if UART_COUNT > 5
+    SERIAL_DE_5,
+#endif
+#if UART_COUNT > 6
+    SERIAL_DE_6,
+#endif
+#if UART_COUNT > 7
+    SERIAL_DE_7,
+#endif
+};
+#endif // SERIAL_RS485
+
+#ifdef SERIAL_DMA
+// DMA address register access, may be provided by serial_device.h instead
+#ifndef SERIALDMASOURCE
+#define SERIALDMASOURCE(channel, address) do { \
+    (channel)->SRCADDR0 = (uint16_t)(address); \
+    (channel)->SRCADDR1 = (uint16_t)(address) >> 8; \
+    (channel)->SRCADDR2 = 0; \
+} while (0)
+#define SERIALDMADESTINATION(channel, address) do { \
+    (channel)->DESTADDR0 = (uint16_t)(address); \
+    (channel)->DESTADDR1 = (uint16_t)(address) >> 8; \
+    (channel)->DESTADDR2 = 0; \
+} while (0)
+#endif // SERIALDMASOURCE
+#endif // SERIAL_DMA
+
+uint8_t volatile serialRxBuffer0[RX_BUFFER_SIZE_0];
+uint8_t volatile serialTxBuffer0[TX_BUFFER_SIZE_0];
+#if UART_COUNT > 1
+uint8_t volatile serialRxBuffer1[RX_BUFFER_SIZE_1];
+uint8_t volatile serialTxBuffer1[TX_BUFFER_SIZE_1];
+#endif
+#if UART_COUNT > 2
+uint8_t volatile serialRxBuffer2[RX_BUFFER_SIZE_2];
+uint8_t volatile serialTxBuffer2[TX_BUFFER_SIZE_2];
+#endif
+#if UART_COUNT > 3
+uint8_t volatile serialRxBuffer3[RX_BUFFER_SIZE_3];
+uint8_t volatile serialTxBuffer3[TX_BUFFER_SIZE_3];
+#endif
+#if UART_COUNT > 4
+uint8_t volatile serialRxBuffer4[RX_BUFFER_SIZE_4];
+uint8_t volatile serialTxBuffer4[TX_BUFFER_SIZE_4];
+#endif
+#if UART_COUNT > 5
+uint8_t volatile serialRxBuffer5[RX_BUFFER_SIZE_5];
+uint8_t volatile serialTxBuffer5[TX_BUFFER_SIZE_5];
+#endif
+#if UART_COUNT > 6
+uint8_t volatile serialRxBuffer6[RX_BUFFER_SIZE_6];
+uint8_t volatile serialTxBuffer6[TX_BUFFER_SIZE_6];
+#endif
+#if UART_COUNT > 7
+uint8_t volatile serialRxBuffer7[RX_BUFFER_SIZE_7];
+uint8_t volatile serialTxBuffer7[TX_BUFFER_SIZE_7];
+#endif
+
+static uint8_t volatile * const rxBuffer[UART_COUNT] = {
+    serialRxBuffer0,
+#if UART_COUNT > 1
+    serialRxBuffer1,
+#endif
+#if UART_COUNT > 2
+    serialRxBuffer2,
+#endif
+#if UART_COUNT > 3
+    serialRxBuffer3,
+#endif
+#if UART_COUNT > 4
+    serialRxBuffer4,
+#endif
+#if UART_COUNT > 5
+    serialRxBuffer5,
+#endif
+#if UART_COUNT > 6
+    serialRxBuffer6,
+#endif
+#if UART_COUNT > 7
+    serialRxBuffer7,
+#endif
+};
+
+static uint8_t volatile * const txBuffer[UART_COUNT] = {
+    serialTxBuffer0,
+#if UART_COUNT > 1
+    serialTxBuffer1,
+#endif
+#if UART_COUNT > 2
+    serialTxBuffer2,
+#endif
+#if UART_COUNT > 3
+    serialTxBuffer3,
+#endif
+#if UART_COUNT > 4
+    serialTxBuffer4,
+#endif
+#if UART_COUNT > 5
+    serialTxBuffer5,
+#endif
+#if UART_COUNT > 6
+    serialTxBuffer6,
+#endif
+#if UART_COUNT > 7
+    serialTxBuffer7,
+#endif
+};
+
+// The buffers form single-producer single-consumer queues. Every index has
+// exactly one writer: the interrupts own serialRxWrite and serialTxRead, the main
+// context owns serialRxRead and serialTxWrite. Nothing else is shared, so there are no
+// read-modify-write counters used from both sides.
+//
+// If every buffer holds at most 128 bytes, the indices are 8bit and can be
+// accessed atomically. Otherwise the main context writes its own indices
+// and reads the ones owned by the interrupts with interrupts disabled, so
+// a 16bit value is never seen half-updated. The interrupts can not be
+// interrupted by the main context, so they access all indices directly.
+// SerialIndex is picked in serial.h.
+
+#ifdef SERIAL_INDEX_16BIT
+
+static uint16_t serialIndexRead(uint16_t volatile *index) {
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t value = *index;
+    SREG = sreg;
+    return value;
 }
 
-void serialClose(uint8_t uart) {
-    if (uart >= UART_COUNT) {
+static void serialIndexAdd(uint16_t volatile *index, uint16_t count) {
+    uint8_t sreg = SREG;
+    cli();
+    *index += count;
+    SREG = sreg;
+}
+
+#define INDEXREAD(index) serialIndexRead(&(index))
+#define INDEXADD(index, count) serialIndexAdd(&(index), (count))
+
+#else // SERIAL_INDEX_16BIT
+
+#define INDEXREAD(index) (index)
+#define INDEXADD(index, count) ((index) += (count))
+
+#endif // SERIAL_INDEX_16BIT
+
+// Buffer sizes minus one, as sizes are powers of 2
+static SerialIndex const rxMask[UART_COUNT] = {
+    RX_BUFFER_SIZE_0 - 1,
+#if UART_COUNT > 1
+    RX_BUFFER_SIZE_1 - 1,
+#endif
+#if UART_COUNT > 2
+    RX_BUFFER_SIZE_2 - 1,
+#endif
+#if UART_COUNT > 3
+    RX_BUFFER_SIZE_3 - 1,
+#endif
+#if UART_COUNT > 4
+    RX_BUFFER_SIZE_4 - 1,
+#endif
+#if UART_COUNT > 5
+    RX_BUFFER_SIZE_5 - 1,
+#endif
+#if UART_COUNT > 6
+    RX_BUFFER_SIZE_6 - 1,
+#endif
+#if UART_COUNT > 7
+    RX_BUFFER_SIZE_7 - 1,
+#endif
+};
+
+static SerialIndex const txMask[UART_COUNT] = {
+    TX_BUFFER_SIZE_0 - 1,
+#if UART_COUNT > 1
+    TX_BUFFER_SIZE_1 - 1,
+#endif
+#if UART_COUNT > 2
+    TX_BUFFER_SIZE_2 - 1,
+#endif
+#if UART_COUNT > 3
+    TX_BUFFER_SIZE_3 - 1,
+#endif
+#if UART_COUNT > 4
+    TX_BUFFER_SIZE_4 - 1,
+#endif
+#if UART_COUNT > 5
+    TX_BUFFER_SIZE_5 - 1,
+#endif
+#if UART_COUNT > 6
+    TX_BUFFER_SIZE_6 - 1,
+#endif
+#if UART_COUNT > 7
+    TX_BUFFER_SIZE_7 - 1,
+#endif
+};
+
+// The read and write indices are free-running counters, only masked when
+// accessing the buffers. Their difference is the number of stored bytes,
+// so every slot can be used and full/empty need no special cases. They
+// and the buffers are not static, see SERIAL_PORT_INLINE() in serial.h.
+// The indices are linked under names carrying the configuration.
+SerialIndex volatile serialRxRead[UART_COUNT];
+SerialIndex volatile serialRxWrite[UART_COUNT];
+SerialIndex volatile serialTxRead[UART_COUNT];
+SerialIndex volatile serialTxWrite[UART_COUNT];
+uint8_t volatile serialShouldStart[UART_COUNT];
+
+
+// Incremented by serialTick(), for serialGetTimeout()
+static uint16_t volatile serialTicks;
+
+#ifdef FLOWCONTROL
+static uint8_t volatile sendThisNext[UART_COUNT];
+static uint8_t volatile flow[UART_COUNT];
+#endif
+
+#ifdef SERIALREFERENCE
+// Buffer sent by reference, before anything in the transmit buffer.
+// Only set up by main while txRefLength is 0, then owned by the ISR.
+static const uint8_t * volatile txRef[UART_COUNT];
+static uint16_t volatile txRefLength[UART_COUNT];
+static uint8_t volatile txRefFlash[UART_COUNT];
+static SerialCallback volatile txRefDone[UART_COUNT];
+#endif
+
+#ifdef SERIALMULTIDROP
+// Address of this node, the filter is on if rxAddressOn is set
+static uint8_t volatile rxAddress[UART_COUNT];
+static uint8_t volatile rxAddressOn[UART_COUNT];
+#endif
+
+#ifdef SERIALPENDING
+// Bit n is set by the receive interrupt of UART n when it stores data, and
+// only cleared by serialPendingMask() once the receive buffer is empty
+static uint8_t volatile rxPending;
+#define RXPENDING(uart) (rxPending |= (1 << (uart)))
+#else
+#define RXPENDING(uart)
+#endif
+
+#ifdef SERIALCALLBACKS
+// Called by the receive interrupt, set up by main with interrupts disabled
+static SerialByteCallback volatile rxByteHook[UART_COUNT];
+
+// Bit n is set by the receive interrupt of UART n while its buffer holds
+// at least rxLevel bytes, and cleared by serialRxLevelMask()
+static SerialIndex volatile rxLevel[UART_COUNT];
+static uint8_t volatile rxLevelReached;
+#endif
+
+#ifdef SERIALIDLE
+// Restarted by every received byte and counted down by serialTick().
+// A frame ends when it reaches 0, its length is then kept in idleFrame.
+static uint8_t volatile idleTimeout[UART_COUNT];
+static uint8_t volatile idleCount[UART_COUNT];
+static uint16_t volatile idleBytes[UART_COUNT];
+static uint16_t volatile idleFrame[UART_COUNT];
+static SerialFrameCallback volatile idleDone[UART_COUNT];
+#endif
+
+#ifdef SERIAL_PACKETS
+// Packet being decoded by the receive interrupt. It is stored behind
+// serialRxWrite, after room for its length, and serialRxWrite only moves on once it
+// is complete and its CRC is correct. Only used by the interrupt.
+static uint16_t packetLength[UART_COUNT];
+static uint16_t packetCrc[UART_COUNT];
+static uint8_t packetBlock[UART_COUNT]; // Bytes left in the COBS block
+static uint8_t packetCode[UART_COUNT]; // Code byte of the COBS block
+static uint8_t packetState[UART_COUNT];
+#endif
+
+#ifdef SERIALSTATS
+// Written by the interrupts, or by main for polled and DMA ports
+static SerialStats volatile stats[UART_COUNT];
+#endif
+
+#ifdef SERIALLINES
+// Terminators stored by the ISR and taken out again. Only their difference
+// matters, it saturates at 255 pending lines.
+static uint8_t volatile linesIn[UART_COUNT];
+static uint8_t volatile linesOut[UART_COUNT];
+#endif
+
+#ifdef SERIALSTDIO
+#ifndef SERIALSTREAMOPEN
+static FILE serialStreams[UART_COUNT];
+#endif
+
+#if SERIALSTDIOBUFFER > 0
+// Output of printf and friends, collected until a newline or a full buffer
+static char streamBuffer[UART_COUNT][SERIALSTDIOBUFFER];
+static uint8_t streamCount[UART_COUNT];
+#endif
+#endif // SERIALSTDIO
+
+#ifdef SERIAL_DMA
+#define DMACHANNEL(c) (((c) < 0) ? 0 : (&DMA.CH0 + (c)))
+
+// Channels used by every UART, 0 if it is interrupt driven
+static DMA_CH_t * const dmaRx[UART_COUNT] = {
+    DMACHANNEL(SERIAL_DMA_RX_0),
+#if UART_COUNT > 1
+    DMACHANNEL(SERIAL_DMA_RX_1),
+#endif
+#if UART_COUNT > 2
+    DMACHANNEL(SERIAL_DMA_RX_2),
+#endif
+#if UART_COUNT > 3
+    DMACHANNEL(SERIAL_DMA_RX_3),
+#endif
+#if UART_COUNT > 4
+    DMACHANNEL(SERIAL_DMA_RX_4),
+#endif
+#if UART_COUNT > 5
+    DMACHANNEL(SERIAL_DMA_RX_5),
+#endif
+#if UART_COUNT > 6
+    DMACHANNEL(SERIAL_DMA_RX_6),
+#endif
+#if UART_COUNT > 7
+    DMACHANNEL(SERIAL_DMA_RX_7),
+#endif
+};
+
+static DMA_CH_t * const dmaTx[UART_COUNT] = {
+    DMACHANNEL(SERIAL_DMA_TX_0),
+#if UART_COUNT > 1
+    DMACHANNEL(SERIAL_DMA_TX_1),
+#endif
+#if UART_COUNT > 2
+    DMACHANNEL(SERIAL_DMA_TX_2),
+#endif
+#if UART_COUNT > 3
+    DMACHANNEL(SERIAL_DMA_TX_3),
+#endif
+#if UART_COUNT > 4
+    DMACHANNEL(SERIAL_DMA_TX_4),
+#endif
+#if UART_COUNT > 5
+    DMACHANNEL(SERIAL_DMA_TX_5),
+#endif
+#if UART_COUNT > 6
+    DMACHANNEL(SERIAL_DMA_TX_6),
+#endif
+#if UART_COUNT > 7
+    DMACHANNEL(SERIAL_DMA_TX_7),
+#endif
+};
+
+// Length of the block currently sent by the transmit channel
+static uint16_t volatile dmaTxCount[UART_COUNT];
+#endif // SERIAL_DMA
+
+// Inlined into every caller, so a constant UART number folds the
+// register, bit and buffer tables into constant addresses
+#define SERIALINLINE static inline __attribute__((always_inline))
+
+#ifdef SERIALINLINEISR
+#define SERIALISR SERIALINLINE
+#else
+#define SERIALISR static
+#endif
+
+SERIALISR void serialReceiveInterrupt(uint8_t uart, SerialDeviceRef dev);
+SERIALISR void serialTransmitInterrupt(uint8_t uart, SerialDeviceRef dev);
+static void serialStartTransmission(uint8_t uart);
+SERIALINLINE uint16_t serialRxUsed(uint8_t uart);
+SERIALINLINE uint16_t serialTxUsed(uint8_t uart);
+static uint16_t serialTickCount(void);
+static void serialRxCopyOut(uint8_t uart, uint8_t *data, uint16_t offset,
+        uint16_t count, uint16_t consumed);
+#ifndef SERIALINJECTCR
+static void serialTxCopyIn(uint8_t uart, const uint8_t *data, uint16_t count);
+#endif
+#ifdef SERIALIDLE
+static void serialIdleTick(uint8_t uart);
+#endif
+
+#ifdef SERIALSLEEP
+static uint8_t serialRxWakes(uint8_t uart);
+#endif
+
+#ifdef FLOWCONTROL
+static void serialRxConsumed(uint8_t uart);
+#endif
+
+#ifdef SERIAL_RTSCTS
+static void serialRtsCheck(uint8_t uart);
+#endif
+
+#ifdef SERIAL_RS485
+static void serialDriverEnable(uint8_t uart);
+static void serialTxCompleteInterrupt(uint8_t uart, SerialDeviceRef dev);
+#endif
+
+#ifdef SERIALSTATS
+static void serialRxStats(uint8_t uart, SerialDeviceRef dev);
+#endif
+
+#ifdef SERIAL_PACKETS
+static void serialPacketReset(uint8_t uart);
+static void serialPacketReceive(uint8_t uart, uint8_t c);
+static void serialPacketStore(uint8_t uart, uint8_t c);
+static void serialPacketPut(uint8_t uart, uint8_t c);
+#endif
+
+#ifdef SERIALMULTIDROP
+static void serialMpcm(uint8_t uart, SerialDeviceRef dev, uint8_t on);
+static uint8_t serialRxAddress(uint8_t uart, SerialDeviceRef dev);
+#endif
+
+#ifdef SERIAL_POLLED
+static uint8_t serialPolledGet(uint8_t uart);
+#endif
+
+#ifdef SERIALLINES
+static void serialLinesConsumed(uint8_t uart, uint8_t count);
+static uint16_t serialRxFind(uint8_t uart, uint8_t c, uint16_t count);
+#endif
+
+#ifdef SERIALSTDIO
+static int serialStreamPut(uint8_t uart, char c);
+static int serialStreamGet(uint8_t uart);
+#ifndef SERIALSTREAMOPEN
+static int serialStdioPut(char c, FILE *stream);
+static int serialStdioGet(FILE *stream);
+#endif
+#endif // SERIALSTDIO
+
+#ifdef SERIAL_DMA
+static void serialDmaInit(uint8_t uart);
+static void serialDmaRxWrite(uint8_t uart);
+static void serialDmaTransmit(uint8_t uart);
+#endif
+
+uint8_t serialAvailable(void) {
+    return UART_COUNT;
+}
+
+// Decimal digits are extracted by subtracting powers of ten,
+// AVRs have no hardware division.
+static const uint32_t serialPowersOf10[10] PROGMEM = {
+    1000000000, 100000000, 10000000, 1000000, 100000,
+    10000, 1000, 100, 10, 1
+};
+
+static const char serialHexDigits[16] PROGMEM = "0123456789ABCDEF";
+
+// Store the decimal digits of num, at least minDigits, without termination.
+// Returns the number of digits, 10 at most.
+static uint8_t serialDecimal(char *buf, uint32_t num, uint8_t minDigits) {
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < 10; i++) {
+        uint32_t power = pgm_read_dword(&serialPowersOf10[i]);
+        char digit = '0';
+        while (num >= power) {
+            num -= power;
+            digit++;
+        }
+        if ((n > 0) || (digit != '0') || ((10 - i) <= minDigits)) {
+            buf[n++] = digit;
+        }
+    }
+    return n;
+}
+
+void serialWriteInt16(uint8_t uart, uint16_t num) {
+    serialWriteUInt32(uart, num);
+}
+
+void serialWriteUInt32(uint8_t uart, uint32_t num) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+    char buf[10];
+    uint8_t n = serialDecimal(buf, num, 1);
+    serialWriteBuffer(uart, (const uint8_t *)buf, n);
+}
+
+void serialWriteInt32(uint8_t uart, int32_t num) {
+    serialWriteFixed(uart, num, 0);
+}
+
+void serialWriteFixed(uint8_t uart, int32_t num, uint8_t decimals) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+    if (decimals > 9) {
+        decimals = 9;
+    }
+
+    char buf[12];
+    uint8_t n = 0;
+    uint32_t value = num;
+    if (num < 0) {
+        buf[n++] = '-';
+        value = -value;
+    }
+
+    // At least one digit in front of the point
+    n += serialDecimal(buf + n, value, decimals + 1);
+    if (decimals > 0) {
+        memmove(buf + n - decimals + 1, buf + n - decimals, decimals);
+        buf[n - decimals] = '.';
+        n++;
+    }
+    serialWriteBuffer(uart, (const uint8_t *)buf, n);
+}
+
+void serialWriteHex(uint8_t uart, uint32_t num, uint8_t digits) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+    if ((digits == 0) || (digits > 8)) {
+        // As many as needed
+        digits = 1;
+        for (uint32_t rest = num >> 4; rest != 0; rest >>= 4) {
+            digits++;
+        }
+    }
+
+    char buf[8];
+    for (int8_t i = digits - 1; i >= 0; i--) {
+        buf[i] = pgm_read_byte(&serialHexDigits[num & 0x0F]);
+        num >>= 4;
+    }
+    serialWriteBuffer(uart, (const uint8_t *)buf, digits);
+}
+
+void serialWriteBinary(uint8_t uart, uint32_t num, uint8_t bits) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+    if ((bits == 0) || (bits > 32)) {
+        // As many as needed
+        bits = 1;
+        for (uint32_t rest = num >> 1; rest != 0; rest >>= 1) {
+            bits++;
+        }
+    }
+
+    char buf[32];
+    for (int8_t i = bits - 1; i >= 0; i--) {
+        buf[i] = '0' + (num & 0x01);
+        num >>= 1;
+    }
+    serialWriteBuffer(uart, (const uint8_t *)buf, bits);
+}
+
+void serialInit(uint8_t uart, uint16_t baud) {
+    serialInitFrame(uart, baud, SERIAL_8N1);
+}
+
+void serialInitFrame(uint8_t uart, uint16_t baud, uint8_t frame) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+    // Initialize state variables
+    serialRxRead[uart] = 0;
+    serialRxWrite[uart] = 0;
+    serialTxRead[uart] = 0;
+    serialTxWrite[uart] = 0;
+    serialShouldStart[uart] = 1;
+
+#ifdef FLOWCONTROL
+    sendThisNext[uart] = 0;
+    flow[uart] = 1;
+#endif // FLOWCONTROL
+
+#ifdef SERIAL_PACKETS
+    serialPacketReset(uart);
+#endif // SERIAL_PACKETS
+
+#ifdef SERIALLINES
+    linesIn[uart] = 0;
+    linesOut[uart] = 0;
+#endif // SERIALLINES
+
+#ifdef SERIALREFERENCE
+    txRefLength[uart] = 0;
+#endif // SERIALREFERENCE
+
+#ifdef SERIALSTATS
+    memset((SerialStats *)&stats[uart], 0, sizeof(SerialStats));
+#endif // SERIALSTATS
+
+#ifdef SERIALMULTIDROP
+    rxAddressOn[uart] = 0;
+#endif // SERIALMULTIDROP
+
+#ifdef SERIALIDLE
+    idleTimeout[uart] = 0;
+    idleCount[uart] = 0;
+    idleFrame[uart] = 0;
+#endif // SERIALIDLE
+
+#ifdef SERIALCALLBACKS
+    rxByteHook[uart] = 0;
+    rxLevel[uart] = 0;
+    rxLevelReached &= ~(1 << uart);
+#endif // SERIALCALLBACKS
+
+#ifdef SERIALSTDIO
+#if SERIALSTDIOBUFFER > 0
+    streamCount[uart] = 0;
+#endif
+#ifndef SERIALSTREAMOPEN
+    fdev_setup_stream(&serialStreams[uart], serialStdioPut, serialStdioGet, _FDEV_SETUP_RW);
+    fdev_set_udata(&serialStreams[uart], (void *)(uintptr_t)uart);
+#endif
+#endif // SERIALSTDIO
+
+#ifdef SERIAL_RTSCTS
+    // Ready to receive, the buffer is empty
+    if (serialRtsPins[uart].port != 0) {
+        RTSREADY(serialRtsPins[uart]);
+        RTSOUTPUT(serialRtsPins[uart]);
+    }
+    if (serialCtsPins[uart].port != 0) {
+        CTSINPUT(serialCtsPins[uart]);
+    }
+#endif // SERIAL_RTSCTS
+
+#ifdef SERIAL_RS485
+    // Receiving until something is written
+    if (serialDePins[uart].port != 0) {
+        DEOFF(serialDePins[uart]);
+        DEOUTPUT(serialDePins[uart]);
+    }
+#endif // SERIAL_RS485
+
+#ifndef UART_XMEGA
+
+    // Frame format, spread over UCSRC and UCSZ2 in UCSRB
+    uint8_t format = ((frame & 0x01) << SERIALUCSZ0)
+            | (((frame >> 1) & 0x01) << SERIALUCSZ1)
+            | (((frame >> 4) & 0x03) << SERIALUPM0)
+            | (((frame >> 3) & 0x01) << SERIALUSBS);
+#ifdef URSEL
+    format |= (1 << URSEL); // UCSRC shares its address with UBRRH
+#endif
+    *SERIALDEVICE(uart)->c = format;
+    uint8_t control = ((frame >> 2) & 0x01) << SERIALUCSZ2;
+
+    // Set baudrate, with double speed if BAUD() picked it. Clears MPCM.
+    if (baud & BAUD_U2X) {
+        *SERIALDEVICE(uart)->a = (1 << SERIALU2X);
+    } else {
+        *SERIALDEVICE(uart)->a = 0;
+    }
+    baud &= ~BAUD_U2X;
+#if SERIALBAUDBIT == 8
+    *SERIALDEVICE(uart)->baudHigh = (baud >> 8);
+    *SERIALDEVICE(uart)->baudLow = baud;
+#else // SERIALBAUDBIT == 8
+    *SERIALDEVICE(uart)->baud = baud;
+#endif // SERIALBAUDBIT == 8
+
+    // Enable Interrupts, polled ports are only read by the application
+#ifdef SERIAL_POLLED
+    if (!POLLED(uart)) {
+#endif // SERIAL_POLLED
+        control |= (1 << SERIALRXCIE);
+#ifdef SERIAL_POLLED
+    }
+#endif // SERIAL_POLLED
+
+    // Enable Receiver/Transmitter
+    *SERIALDEVICE(uart)->b = control | (1 << SERIALRXEN)
+            | (1 << SERIALTXEN);
+
+#else // UART_XMEGA
+
+    // Frame format, asynchronous mode
+    SERIALDEVICE(uart)->usart->CTRLC = frame & 0x3F;
+
+    // Set baudrate, BSCALE and BSEL. BAUD() flags double speed in BSEL.
+    uint8_t doubleSpeed = 0;
+    if ((baud & 0xF800) == BAUD_CLK2X) {
+        doubleSpeed = 0x04; // CLK2X
+        baud &= ~0x0800;
+    }
+    SERIALDEVICE(uart)->usart->BAUDCTRLB = (baud >> 8);
+    SERIALDEVICE(uart)->usart->BAUDCTRLA = (baud & 0x00FF);
+
+    // Enable Interrupts
+    uint8_t level = UART_INTERRUPT_LEVEL_RX;
+#ifdef SERIAL_DMA
+    serialDmaInit(uart);
+    if (dmaRx[uart] != 0) {
+        // Received bytes are moved by the DMA controller
+        level = 0;
+    }
+#endif // SERIAL_DMA
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        level = 0;
+    }
+#endif // SERIAL_POLLED
+    SERIALDEVICE(uart)->usart->CTRLA = level << 4; // RXCINTLVL
+
+    // Enable Receiver/Transmitter
+    SERIALDEVICE(uart)->usart->CTRLB = 0x18 | doubleSpeed;
+
+#endif // UART_XMEGA
+}
+
+void serialClose(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+#ifndef UART_XMEGA
+
+    uint8_t sreg = SREG;
+    sei();
+    WAITUNTIL(serialTxBufferEmpty(uart), 1);
+
+    // Wait while Transmit Interrupt is on
+    WAITUNTIL(!(*SERIALDEVICE(uart)->b & (1 << SERIALUDRIE)), 1);
+
+#ifdef SERIAL_RS485
+    // Wait for the last stop bit, until DE has been released
+    WAITUNTIL(!(*SERIALDEVICE(uart)->b & (1 << SERIALTXCIE)), 1);
+#endif // SERIAL_RS485
+
+    cli();
+    *SERIALDEVICE(uart)->b = 0;
+    *SERIALDEVICE(uart)->c = 0;
+#ifdef SERIAL_RTSCTS
+    if (serialRtsPins[uart].port != 0) {
+        RTSSTOP(serialRtsPins[uart]);
+    }
+#endif // SERIAL_RTSCTS
+    SREG = sreg;
+
+#else // UART_XMEGA
+
+    uint8_t sreg = SREG;
+    sei();
+    WAITUNTIL(serialTxBufferEmpty(uart), 1);
+
+    // Wait while Transmit Interrupt is on
+    WAITUNTIL(!(SERIALDEVICE(uart)->usart->CTRLA & (UART_INTERRUPT_MASK << 0)), 1); // DREINTLVL
+
+#ifdef SERIAL_RS485
+    // Wait for the last stop bit, until DE has been released
+    WAITUNTIL(!(SERIALDEVICE(uart)->usart->CTRLA & (UART_INTERRUPT_MASK << 2)), 1); // TXCINTLVL
+#endif // SERIAL_RS485
+
+    cli();
+#ifdef SERIAL_DMA
+    if (dmaRx[uart] != 0) {
+        dmaRx[uart]->CTRLA = 0;
+    }
+    if (dmaTx[uart] != 0) {
+        dmaTx[uart]->CTRLA = 0;
+    }
+#endif // SERIAL_DMA
+    SERIALDEVICE(uart)->usart->CTRLA = 0;
+    SERIALDEVICE(uart)->usart->CTRLB = 0;
+    SERIALDEVICE(uart)->usart->CTRLC = 0;
+#ifdef SERIAL_RTSCTS
+    if (serialRtsPins[uart].port != 0) {
+        RTSSTOP(serialRtsPins[uart]);
+    }
+#endif // SERIAL_RTSCTS
+    SREG = sreg;
+
+#endif // UART_XMEGA
+}
+
+#ifdef FLOWCONTROL
+void setFlow(uint8_t uart, uint8_t on) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        // Without interrupts, send it directly once the transmitter is ready
+        if (flow[uart] != on) {
+            flow[uart] = on;
+#ifdef SERIALSTATS
+            if (on == 0) {
+                stats[uart].xoffs++;
+            }
+#endif // SERIALSTATS
+            serialWrite(uart, on ? XON : XOFF);
+        }
+        return;
+    }
+#endif // SERIAL_POLLED
+
+    if (flow[uart] != on) {
+        if (on == 1) {
+            // Send XON
+            WAITUNTIL(sendThisNext[uart] == 0, 1);
+            sendThisNext[uart] = XON;
+            flow[uart] = 1;
+            serialStartTransmission(uart);
+        } else {
+            // Send XOFF
+            sendThisNext[uart] = XOFF;
+            flow[uart] = 0;
+#ifdef SERIALSTATS
+            stats[uart].xoffs++;
+#endif // SERIALSTATS
+            serialStartTransmission(uart);
+        }
+
+        // Wait until it's transmitted / while transmit interrupt is turned on
+#ifndef UART_XMEGA
+        WAITUNTIL(!(*SERIALDEVICE(uart)->b & (1 << SERIALUDRIE)), 1);
+#else // UART_XMEGA
+        WAITUNTIL(!(SERIALDEVICE(uart)->usart->CTRLA & (UART_INTERRUPT_MASK << 0)), 1); // DREINTLVL
+#endif
+    }
+}
+#endif // FLOWCONTROL
+
+#ifdef SERIALMULTIDROP
+void serialSetAddress(uint8_t uart, uint8_t address, uint8_t on) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+    // Ignore everything until this address is seen
+    uint8_t sreg = SREG;
+    cli();
+    rxAddress[uart] = address;
+    rxAddressOn[uart] = on;
+    serialMpcm(uart, SERIALDEVICE(uart), on);
+    SREG = sreg;
+}
+#endif // SERIALMULTIDROP
+
+// ---------------------
+// |     Reception     |
+// ---------------------
+
+SERIALINLINE uint8_t serialHasCharInline(uint8_t uart) {
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        return RXREADY(uart) ? 1 : 0;
+    }
+#endif // SERIAL_POLLED
+
+    if (serialRxUsed(uart) != 0) {
+        // True if char available
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+uint8_t serialHasChar(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return 0;
+    }
+
+    return serialHasCharInline(uart);
+}
+
+uint8_t serialGetBlocking(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return 0;
+    }
+
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        while (!RXREADY(uart)) {
+            SERIALWAIT();
+        }
+        return serialPolledGet(uart);
+    }
+#endif // SERIAL_POLLED
+
+    WAITUNTIL(serialHasChar(uart), serialRxWakes(uart));
+    return serialGet(uart);
+}
+
+uint8_t serialGetTimeout(uint8_t uart, uint8_t *data, uint16_t ticks) {
+    if ((uart >= UART_COUNT) || (data == 0)) {
+        return 0;
+    }
+
+    uint16_t start = serialTickCount();
+    WAITUNTIL(serialHasChar(uart) || ((uint16_t)(serialTickCount() - start) >= ticks),
+            serialRxWakes(uart));
+    if (!serialHasChar(uart)) {
+        return 0;
+    }
+    *data = serialGet(uart);
+    return 1;
+}
+
+void serialTick(void) {
+    serialTicks++;
+
+#ifdef SERIALIDLE
+    for (uint8_t uart = 0; uart < UART_COUNT; uart++) {
+        serialIdleTick(uart);
+    }
+#endif // SERIALIDLE
+}
+
+#ifdef SERIALCALLBACKS
+void serialSetByteCallback(uint8_t uart, SerialByteCallback callback) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+    uint8_t sreg = SREG;
+    cli();
+    rxByteHook[uart] = callback;
+    SREG = sreg;
+}
+
+void serialSetRxLevel(uint8_t uart, uint16_t level) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+    // A level the buffer can not reach turns it off
+    if (level > ((uint16_t)rxMask[uart] + 1)) {
+        level = 0;
+    }
+
+    // Already reached, no further byte may arrive to note it
+    uint8_t sreg = SREG;
+    cli();
+    rxLevel[uart] = level;
+    if ((level != 0) && (serialRxUsed(uart) >= level)) {
+        rxLevelReached |= (1 << uart);
+    } else {
+        rxLevelReached &= ~(1 << uart);
+    }
+    SREG = sreg;
+}
+
+uint8_t serialRxLevelMask(void) {
+    // DMA ports are not seen by an interrupt per byte, always check them
+    uint8_t check = rxLevelReached | (SERIAL_DMA_RX_MASK & ((1 << UART_COUNT) - 1));
+    uint8_t mask = 0;
+    for (uint8_t uart = 0; check != 0; uart++, check >>= 1) {
+        if (!(check & 0x01)) {
+            continue;
+        }
+
+        // Taken once, noted again by the next byte while the level holds.
+        // Bits of buffers read below the level since then are dropped.
+        uint8_t sreg = SREG;
+        cli();
+        if ((rxLevel[uart] != 0) && (serialRxUsed(uart) >= rxLevel[uart])) {
+            mask |= (1 << uart);
+        }
+        rxLevelReached &= ~(1 << uart);
+        SREG = sreg;
+    }
+    return mask;
+}
+#endif // SERIALCALLBACKS
+
+#ifdef SERIALIDLE
+void serialSetIdleTimeout(uint8_t uart, uint8_t ticks, SerialFrameCallback done) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+    // The next received byte starts a new frame
+    uint8_t sreg = SREG;
+    cli();
+    idleTimeout[uart] = ticks;
+    idleCount[uart] = 0;
+    idleFrame[uart] = 0;
+    idleDone[uart] = done;
+    SREG = sreg;
+}
+
+uint16_t serialFrameComplete(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return 0;
+    }
+
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t length = idleFrame[uart];
+    idleFrame[uart] = 0;
+    SREG = sreg;
+    return length;
+}
+#endif // SERIALIDLE
+
+SERIALINLINE uint8_t serialGetInline(uint8_t uart) {
+    uint8_t c;
+
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        if (RXREADY(uart)) {
+            return serialPolledGet(uart);
+        } else {
+            return 0;
+        }
+    }
+#endif // SERIAL_POLLED
+
+    if (serialRxUsed(uart) != 0) {
+        c = rxBuffer[uart][serialRxRead[uart] & rxMask[uart]];
+        INDEXADD(serialRxRead[uart], 1);
+#ifdef FLOWCONTROL
+        serialRxConsumed(uart);
+#endif // FLOWCONTROL
+#ifdef SERIALLINES
+        if (c == SERIALLINEEND) {
+            serialLinesConsumed(uart, 1);
+        }
+#endif // SERIALLINES
+#ifdef SERIAL_RTSCTS
+        serialRtsCheck(uart);
+#endif // SERIAL_RTSCTS
+        return c;
+    } else {
+        return 0;
+    }
+}
+
+uint8_t serialGet(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return 0;
+    }
+
+    return serialGetInline(uart);
+}
+
+uint16_t serialReadBuffer(uint8_t uart, uint8_t *data, uint16_t length) {
+    if ((uart >= UART_COUNT) || (data == 0)) {
+        return 0;
+    }
+
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        // Everything the receiver holds right now
+        uint16_t count = 0;
+        while ((count < length) && RXREADY(uart)) {
+            data[count++] = serialPolledGet(uart);
+        }
+        return count;
+    }
+#endif // SERIAL_POLLED
+
+    uint16_t count = serialRxUsed(uart);
+    if (count > length) {
+        count = length;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    serialRxCopyOut(uart, data, 0, count, count);
+
+#ifdef FLOWCONTROL
+    serialRxConsumed(uart);
+#endif // FLOWCONTROL
+
+#ifdef SERIALLINES
+    uint8_t lines = 0;
+    for (uint16_t i = 0; i < count; i++) {
+        if ((data[i] == SERIALLINEEND) && (lines < 0xFF)) {
+            lines++;
+        }
+    }
+    serialLinesConsumed(uart, lines);
+#endif // SERIALLINES
+
+#ifdef SERIAL_RTSCTS
+    serialRtsCheck(uart);
+#endif // SERIAL_RTSCTS
+
+    return count;
+}
+
+#ifdef SERIALLINES
+uint8_t serialHasLine(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return 0;
+    }
+
+    // A full buffer without a terminator has to be read as well
+    if ((linesIn[uart] != linesOut[uart])
+            || (serialRxUsed(uart) == (rxMask[uart] + 1))) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+uint16_t serialReadLine(uint8_t uart, char *data, uint16_t length) {
+    if ((uart >= UART_COUNT) || (data == 0) || (length == 0)) {
+        return 0;
+    }
+
+    data[0] = '\0';
+    if (!serialHasLine(uart)) {
+        return 0;
+    }
+
+    // Up to the terminator, or as much as fits if the line is too long
+    uint16_t count = serialRxUsed(uart);
+    if (count > (length - 1)) {
+        count = length - 1;
+    }
+    uint16_t end = serialRxFind(uart, SERIALLINEEND, count);
+    uint16_t consumed = count;
+    if (end < count) {
+        count = end;
+        consumed = end + 1;
+    }
+
+    // The terminator is consumed, but not copied
+    serialRxCopyOut(uart, (uint8_t *)data, 0, count, consumed);
+    data[count] = '\0';
+
+#ifdef FLOWCONTROL
+    serialRxConsumed(uart);
+#endif // FLOWCONTROL
+
+    if (consumed > count) {
+        serialLinesConsumed(uart, 1);
+    }
+
+#ifdef SERIAL_RTSCTS
+    serialRtsCheck(uart);
+#endif // SERIAL_RTSCTS
+
+    return consumed;
+}
+#endif // SERIALLINES
+
+#ifdef SERIAL_PACKETS
+uint8_t serialHasPacket(uint8_t uart) {
+    if ((uart >= UART_COUNT) || !PACKETS(uart)) {
+        return 0;
+    }
+
+    return (serialRxUsed(uart) != 0) ? 1 : 0;
+}
+
+uint16_t serialReadPacket(uint8_t uart, uint8_t *data, uint16_t length) {
+    if ((data == 0) || !serialHasPacket(uart)) {
+        return 0;
+    }
+
+    // Length first, low byte first
+    SerialIndex read = serialRxRead[uart];
+    uint16_t size = rxBuffer[uart][read & rxMask[uart]]
+            | (rxBuffer[uart][(SerialIndex)(read + 1) & rxMask[uart]] << 8);
+    uint16_t count = size;
+    if (count > length) {
+        count = length;
+    }
+
+    serialRxCopyOut(uart, data, PACKETHEADER, count, PACKETHEADER + size);
+
+#ifdef FLOWCONTROL
+    serialRxConsumed(uart);
+#endif // FLOWCONTROL
+
+#ifdef SERIAL_RTSCTS
+    serialRtsCheck(uart);
+#endif // SERIAL_RTSCTS
+
+    return size;
+}
+#endif // SERIAL_PACKETS
+
+uint8_t serialRxBufferFull(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return 0;
+    }
+
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        return RXREADY(uart) ? 1 : 0;
+    }
+#endif // SERIAL_POLLED
+
+    return (serialRxUsed(uart) == (rxMask[uart] + 1));
+}
+
+uint16_t serialRxBufferUsed(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return 0;
+    }
+
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        return RXREADY(uart) ? 1 : 0;
+    }
+#endif // SERIAL_POLLED
+
+    return serialRxUsed(uart);
+}
+
+uint8_t serialRxBufferEmpty(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return 0;
+    }
+
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        return RXREADY(uart) ? 0 : 1;
+    }
+#endif // SERIAL_POLLED
+
+    if (serialRxUsed(uart) != 0) {
+        return 0;
+    } else {
+        return 1;
+    }
+}
+
+// ----------------------
+// |    Transmission    |
+// ----------------------
+
+SERIALINLINE void serialWriteInline(uint8_t uart, uint8_t data) {
+#ifdef SERIALINJECTCR
+    if (data == '\n') {
+        serialWrite(uart, '\r');
+    }
+#endif
+
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        while (!TXREADY(uart)) {
+            SERIALWAIT();
+        }
+        SERIALPUTDATA(uart, SERIALDEVICE(uart), data);
+#ifdef SERIALSTATS
+        stats[uart].transmitted++;
+#endif // SERIALSTATS
+        return;
+    }
+#endif // SERIAL_POLLED
+
+    WAITUNTIL(serialTxUsed(uart) != (txMask[uart] + 1), 1);
+
+    txBuffer[uart][serialTxWrite[uart] & txMask[uart]] = data;
+    INDEXADD(serialTxWrite[uart], 1);
+    serialStartTransmission(uart);
+}
+
+void serialWrite(uint8_t uart, uint8_t data) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+    serialWriteInline(uart, data);
+}
+
+void serialWriteAddress(uint8_t uart, uint8_t address) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+#ifdef SERIAL_POLLED
+    if (!POLLED(uart)) {
+#endif // SERIAL_POLLED
+        // Wait for the transmit interrupt to finish, then keep it off,
+        // so it can not send a byte with the 9th bit set in between
+        for (;;) {
+            WAITUNTIL(serialTxBufferEmpty(uart) && serialShouldStart[uart], 1);
+            uint8_t sreg = SREG;
+            cli();
+            uint8_t idle = serialShouldStart[uart];
+            serialShouldStart[uart] = 0;
+            SREG = sreg;
+            if (idle) {
+                break;
+            }
+        }
+#ifdef SERIAL_RS485
+        serialDriverEnable(uart);
+#endif // SERIAL_RS485
+#ifdef SERIAL_POLLED
+    }
+#endif // SERIAL_POLLED
+
+    // The 9th bit is taken over with the byte, when it moves on into the
+    // shift register and the data register is empty again
+    WAITUNTIL(TXREADY(uart), 0);
+    uint8_t sreg = SREG;
+    cli();
+#ifndef UART_XMEGA
+    *SERIALDEVICE(uart)->b |= (1 << SERIALTXB8);
+#else // UART_XMEGA
+    SERIALDEVICE(uart)->usart->CTRLB |= USART_TXB8_bm;
+#endif // UART_XMEGA
+    SERIALPUTDATA(uart, SERIALDEVICE(uart), address);
+    SREG = sreg;
+    WAITUNTIL(TXREADY(uart), 0);
+    cli();
+#ifndef UART_XMEGA
+    *SERIALDEVICE(uart)->b &= ~(1 << SERIALTXB8);
+#else // UART_XMEGA
+    SERIALDEVICE(uart)->usart->CTRLB &= ~USART_TXB8_bm;
+#endif // UART_XMEGA
+    SREG = sreg;
+
+#ifdef SERIALSTATS
+    stats[uart].transmitted++;
+#endif // SERIALSTATS
+
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        return;
+    }
+#endif // SERIAL_POLLED
+
+    // Hand the transmitter back, XON/XOFF may have been queued meanwhile
+    cli();
+    serialShouldStart[uart] = 1;
+#ifdef FLOWCONTROL
+    if (sendThisNext[uart] != 0) {
+        serialStartTransmission(uart);
+    }
+#endif // FLOWCONTROL
+    SREG = sreg;
+}
+
+void serialWriteBuffer(uint8_t uart, const uint8_t *data, uint16_t length) {
+    if ((uart >= UART_COUNT) || (data == 0)) {
+        return;
+    }
+
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        while (length-- > 0) {
+            serialWrite(uart, *data++);
+        }
+        return;
+    }
+#endif // SERIAL_POLLED
+
+#ifdef SERIALINJECTCR
+    // CR injection has to look at every byte anyway
+    while (length-- > 0) {
+        serialWrite(uart, *data++);
+    }
+#else // SERIALINJECTCR
+    while (length > 0) {
+        WAITUNTIL(serialTxUsed(uart) != (txMask[uart] + 1), 1);
+        uint16_t count = (txMask[uart] + 1) - serialTxUsed(uart);
+        if (count > length) {
+            count = length;
+        }
+
+        serialTxCopyIn(uart, data, count);
+        data += count;
+        length -= count;
+        serialStartTransmission(uart);
+    }
+#endif // SERIALINJECTCR
+}
+
+void serialWriteString(uint8_t uart, const char *data) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+    if (data == 0) {
+        serialWriteString(uart, "NULL");
+    } else {
+        serialWriteBuffer(uart, (const uint8_t *)data, strlen(data));
+    }
+}
+
+void serialWriteString_P(uint8_t uart, const char *data) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+    if (data == 0) {
+        serialWriteString(uart, "NULL");
+    } else {
+        char c;
+        while ((c = pgm_read_byte(data++)) != '\0') {
+            serialWrite(uart, c);
+        }
+    }
+}
+
+#ifdef SERIAL_PACKETS
+// Byte i of the packet data, followed by its CRC, low byte first
+#define PACKETBYTE(data, length, crc, i) (((i) < (length)) ? (data)[i] \
+        : (((i) == (length)) ? (uint8_t)(crc) : (uint8_t)((crc) >> 8)))
+
+void serialSendPacket(uint8_t uart, const uint8_t *data, uint16_t length) {
+    if ((uart >= UART_COUNT) || ((data == 0) && (length > 0))) {
+        return;
+    }
+
+    // Every COBS block is scanned for the next zero before it is sent, the
+    // CRC is updated on the way. It is complete once the scan reaches it.
+    uint16_t crc = 0xFFFF;
+    uint16_t checked = 0;
+    uint16_t total = length + 2;
+    uint16_t start = 0;
+    for (;;) {
+        uint16_t end = start;
+        uint8_t zero = 0;
+        while ((end < total) && ((end - start) < 254)) {
+            if ((end < length) && (end == checked)) {
+                crc = _crc_ccitt_update(crc, data[end]);
+                checked++;
+            }
+            if (PACKETBYTE(data, length, crc, end) == 0) {
+                zero = 1;
+                break;
+            }
+            end++;
+        }
+
+        serialPacketPut(uart, end - start + 1);
+        for (uint16_t i = start; i < end; i++) {
+            serialPacketPut(uart, PACKETBYTE(data, length, crc, i));
+        }
+
+        if (zero) {
+            start = end + 1;
+        } else if (end < total) {
+            start = end; // Full block without a zero
+        } else {
+            break;
+        }
+    }
+    serialPacketPut(uart, 0);
+
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        return;
+    }
+#endif // SERIAL_POLLED
+    serialStartTransmission(uart);
+}
+#endif // SERIAL_PACKETS
+
+#ifdef SERIALREFERENCE
+static void serialReference(uint8_t uart, const uint8_t *data, uint16_t length,
+        uint8_t flash, SerialCallback done) {
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        // No interrupt to hand it to, so send it right away
+        while (length-- > 0) {
+            serialWrite(uart, flash ? pgm_read_byte(data) : *data);
+            data++;
+        }
+        if (done != 0) {
+            done(uart);
+        }
+        return;
+    }
+#endif // SERIAL_POLLED
+
+    // Everything written before goes first
+    WAITUNTIL(serialTxBufferEmpty(uart), 1);
+
+    if (length == 0) {
+        if (done != 0) {
+            done(uart);
+        }
+        return;
+    }
+
+    uint8_t sreg = SREG;
+    cli();
+    txRef[uart] = data;
+    txRefFlash[uart] = flash;
+    txRefDone[uart] = done;
+    txRefLength[uart] = length;
+    serialStartTransmission(uart);
+    SREG = sreg;
+}
+
+void serialWriteReference(uint8_t uart, const uint8_t *data, uint16_t length,
+        SerialCallback done) {
+    if ((uart >= UART_COUNT) || (data == 0)) {
+        return;
+    }
+
+    serialReference(uart, data, length, 0, done);
+}
+
+void serialWriteReference_P(uint8_t uart, const uint8_t *data, uint16_t length,
+        SerialCallback done) {
+    if ((uart >= UART_COUNT) || (data == 0)) {
+        return;
+    }
+
+    serialReference(uart, data, length, 1, done);
+}
+
+uint8_t serialReferenceDone(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return 0;
+    }
+
+    // The length is 16bit, the interrupt could change it in between
+    uint8_t sreg = SREG;
+    cli();
+    uint8_t done = (txRefLength[uart] == 0);
+    SREG = sreg;
+    return done;
+}
+#endif // SERIALREFERENCE
+
+#ifdef SERIALSTDIO
+#ifndef SERIALSTREAMOPEN
+// avr-libc stream hooks, the UART number is kept as user data
+static int serialStdioPut(char c, FILE *stream) {
+    return serialStreamPut((uint8_t)(uintptr_t)fdev_get_udata(stream), c);
+}
+
+static int serialStdioGet(FILE *stream) {
+    return serialStreamGet((uint8_t)(uintptr_t)fdev_get_udata(stream));
+}
+#endif // SERIALSTREAMOPEN
+
+FILE *serialStream(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return 0;
+    }
+
+#ifdef SERIALSTREAMOPEN
+    return SERIALSTREAMOPEN(uart, serialStreamPut, serialStreamGet);
+#else
+    return &serialStreams[uart];
+#endif
+}
+
+void serialStreamFlush(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+#if SERIALSTDIOBUFFER > 0
+    if (streamCount[uart] > 0) {
+        serialWriteBuffer(uart, (const uint8_t *)streamBuffer[uart], streamCount[uart]);
+        streamCount[uart] = 0;
+    }
+#endif
+}
+#endif // SERIALSTDIO
+
+#ifdef SERIALSTATS
+void serialGetStats(uint8_t uart, SerialStats *data) {
+    if ((uart >= UART_COUNT) || (data == 0)) {
+        return;
+    }
+
+#ifdef SERIAL_DMA
+    if (dmaRx[uart] != 0) {
+        // Counted when looking at the transfer counter
+        serialRxUsed(uart);
+    }
+#endif // SERIAL_DMA
+
+    // Copied in one piece, the interrupts update them at any time
+    uint8_t sreg = SREG;
+    cli();
+    memcpy(data, (const SerialStats *)&stats[uart], sizeof(SerialStats));
+    SREG = sreg;
+}
+
+void serialClearStats(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+    uint8_t sreg = SREG;
+    cli();
+    memset((SerialStats *)&stats[uart], 0, sizeof(SerialStats));
+    SREG = sreg;
+}
+#endif // SERIALSTATS
+
+uint8_t serialTxBufferFull(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return 0;
+    }
+
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        return TXREADY(uart) ? 0 : 1;
+    }
+#endif // SERIAL_POLLED
+
+    return (serialTxUsed(uart) == (txMask[uart] + 1));
+}
+
+uint16_t serialTxBufferFree(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return 0;
+    }
+
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        return TXREADY(uart) ? 1 : 0;
+    }
+#endif // SERIAL_POLLED
+
+    return (txMask[uart] + 1) - serialTxUsed(uart);
+}
+
+uint8_t serialTxBufferEmpty(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return 0;
+    }
+
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        return TXREADY(uart) ? 1 : 0;
+    }
+#endif // SERIAL_POLLED
+
+#ifdef SERIALREFERENCE
+    if (!serialReferenceDone(uart)) {
+        return 0;
+    }
+#endif // SERIALREFERENCE
+
+    if (serialTxUsed(uart) != 0) {
+        return 0;
+    } else {
+        return 1;
+    }
+}
+
+#ifdef SERIALPENDING
+uint8_t serialPendingMask(void) {
+    // Polled and DMA ports are not marked by an interrupt, always check them
+    uint8_t check = rxPending
+            | ((SERIAL_POLLED_MASK | SERIAL_DMA_RX_MASK) & ((1 << UART_COUNT) - 1));
+    uint8_t mask = 0;
+    for (uint8_t uart = 0; check != 0; uart++, check >>= 1) {
+        if (!(check & 0x01)) {
+            continue;
+        }
+
+#ifdef SERIAL_POLLED
+        if (POLLED(uart)) {
+            if (RXREADY(uart)) {
+                mask |= (1 << uart);
+            }
+            continue;
+        }
+#endif // SERIAL_POLLED
+
+        // Nothing can be received between the check and clearing the bit
+        uint8_t sreg = SREG;
+        cli();
+        if (serialRxUsed(uart) != 0) {
+            mask |= (1 << uart);
+        } else {
+            rxPending &= ~(1 << uart);
+        }
+        SREG = sreg;
+    }
+    return mask;
+}
+#endif // SERIALPENDING
+
+uint8_t serialTxSpaceMask(void) {
+    uint8_t mask = 0;
+    for (uint8_t uart = 0; uart < UART_COUNT; uart++) {
+#ifdef SERIAL_POLLED
+        if (POLLED(uart)) {
+            if (TXREADY(uart)) {
+                mask |= (1 << uart);
+            }
+            continue;
+        }
+#endif // SERIAL_POLLED
+
+        if (serialTxUsed(uart) <= txMask[uart]) {
+            mask |= (1 << uart);
+        }
+    }
+    return mask;
+}
+
+#ifdef SERIAL_RTSCTS
+void serialCtsChanged(uint8_t uart) {
+    if (uart >= UART_COUNT) {
+        return;
+    }
+
+    // The transmit interrupt checks CTS again and stops if it is not ready
+    if (!serialTxBufferEmpty(uart)) {
+        serialStartTransmission(uart);
+    }
+}
+#endif // SERIAL_RTSCTS
+
+// ----------------------
+// |      Internal      |
+// ----------------------
+
+SERIALINLINE uint16_t serialRxUsed(uint8_t uart) {
+#ifdef SERIAL_DMA
+    if (dmaRx[uart] != 0) {
+        serialDmaRxWrite(uart);
+    }
+#endif // SERIAL_DMA
+    return (SerialIndex)(INDEXREAD(serialRxWrite[uart]) - serialRxRead[uart]);
+}
+
+SERIALINLINE uint16_t serialTxUsed(uint8_t uart) {
+    return (SerialIndex)(serialTxWrite[uart] - INDEXREAD(serialTxRead[uart]));
+}
+
+static uint16_t serialTickCount(void) {
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t ticks = serialTicks;
+    SREG = sreg;
+    return ticks;
+}
+
+#ifdef SERIALIDLE
+static void serialIdleTick(uint8_t uart) {
+    // serialTick() may run at a lower interrupt level than the receiver
+    uint8_t sreg = SREG;
+    cli();
+    if ((idleCount[uart] == 0) || (--idleCount[uart] != 0)) {
+        SREG = sreg;
+        return;
+    }
+    uint16_t length = idleBytes[uart];
+    idleFrame[uart] = length;
+    SerialFrameCallback done = idleDone[uart];
+    SREG = sreg;
+
+    if (done != 0) {
+        done(uart, length);
+    }
+}
+#endif // SERIALIDLE
+
+#ifdef SERIALSLEEP
+static uint8_t serialRxWakes(uint8_t uart) {
+    // Polled and DMA reception have no interrupt per received byte
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        return 0;
+    }
+#endif // SERIAL_POLLED
+#ifdef SERIAL_DMA
+    if (dmaRx[uart] != 0) {
+        return 0;
+    }
+#endif // SERIAL_DMA
+    return 1;
+}
+#endif // SERIALSLEEP
+
+SERIALINLINE void serialStartTransmissionInline(uint8_t uart) {
+#ifdef SERIAL_POLLED
+    // Polled UARTs never enable their interrupts
+    if (POLLED(uart)) {
+        return;
+    }
+#endif // SERIAL_POLLED
+
+    if (serialShouldStart[uart]) {
+        serialShouldStart[uart] = 0;
+
+#ifdef SERIAL_RS485
+        serialDriverEnable(uart);
+#endif // SERIAL_RS485
+
+#ifndef UART_XMEGA
+        // Enable Interrupt
+        *SERIALDEVICE(uart)->b |= (1 << SERIALUDRIE);
+
+        // Trigger Interrupt
+        *SERIALDEVICE(uart)->a |= (1 << SERIALUDRE);
+#else // UART_XMEGA
+#ifdef SERIAL_DMA
+        if (dmaTx[uart] != 0) {
+            serialDmaTransmit(uart);
+            return;
+        }
+#endif // SERIAL_DMA
+
+        // Enable Interrupt, fires right away as the data register is empty
+        SERIALDEVICE(uart)->usart->CTRLA |= UART_INTERRUPT_LEVEL_TX << 0; // DREINTLVL
+#endif // UART_XMEGA
+    }
+}
+
+static void serialStartTransmission(uint8_t uart) {
+    serialStartTransmissionInline(uart);
+}
+
+// Start functions for a fixed UART, called by the inline functions of
+// serial.h. Registers are accessed with the module known.
+#define SERIAL_PORT_START(n) \
+    void serial ## n ## Start(void) { \
+        serialStartTransmissionInline(n); \
+    }
+
+SERIAL_PORT_START(0)
+#if UART_COUNT > 1
+SERIAL_PORT_START(1)
+#endif
+#if UART_COUNT > 2
+SERIAL_PORT_START(2)
+#endif
+#if UART_COUNT > 3
+SERIAL_PORT_START(3)
+#endif
+#if UART_COUNT > 4
+SERIAL_PORT_START(4)
+#endif
+#if UART_COUNT > 5
+SERIAL_PORT_START(5)
+#endif
+#if UART_COUNT > 6
+SERIAL_PORT_START(6)
+#endif
+#if UART_COUNT > 7
+SERIAL_PORT_START(7)
+#endif
+
+// Copy count bytes between a ring buffer, starting at index, and data. At
+// most two chunks, up to the end of the buffer and from its start.
+static void serialRingCopy(uint8_t volatile *ring, uint16_t mask, uint16_t index,
+        uint8_t *data, uint16_t count, uint8_t intoRing) {
+    index &= mask;
+    uint16_t chunk = (mask + 1) - index;
+    if (chunk > count) {
+        chunk = count;
+    }
+    if (intoRing) {
+        memcpy((uint8_t *)&ring[index], data, chunk);
+        if (chunk < count) {
+            memcpy((uint8_t *)&ring[0], data + chunk, count - chunk);
+        }
+    } else {
+        memcpy(data, (uint8_t *)&ring[index], chunk);
+        if (chunk < count) {
+            memcpy(data + chunk, (uint8_t *)&ring[0], count - chunk);
+        }
+    }
+}
+
+// Copy count bytes, starting offset bytes after serialRxRead, then hand consumed
+// bytes back to the receive interrupt
+static void serialRxCopyOut(uint8_t uart, uint8_t *data, uint16_t offset,
+        uint16_t count, uint16_t consumed) {
+    serialRingCopy(rxBuffer[uart], rxMask[uart], (SerialIndex)(serialRxRead[uart] + offset),
+            data, count, 0);
+
+    // Make sure the copy is done before handing the space back to the ISR
+    __asm__ __volatile__ ("" ::: "memory");
+    INDEXADD(serialRxRead[uart], consumed);
+}
+
+#ifndef SERIALINJECTCR
+// Copy count bytes behind serialTxWrite, then hand them to the transmit interrupt
+static void serialTxCopyIn(uint8_t uart, const uint8_t *data, uint16_t count) {
+    serialRingCopy(txBuffer[uart], txMask[uart], serialTxWrite[uart], (uint8_t *)data, count, 1);
+
+    // Make sure the copy is done before handing the data to the ISR
+    __asm__ __volatile__ ("" ::: "memory");
+    INDEXADD(serialTxWrite[uart], count);
+}
+#endif // SERIALINJECTCR
+
+#ifdef FLOWCONTROL
+static void serialRxConsumed(uint8_t uart) {
+    if ((flow[uart] == 0) && (serialRxUsed(uart) <= FLOWMARK)) {
+        WAITUNTIL(sendThisNext[uart] == 0, 1);
+
+        // The receive interrupt may want to send XOFF in between
+        uint8_t sreg = SREG;
+        cli();
+        if ((flow[uart] == 0) && (sendThisNext[uart] == 0)) {
+            sendThisNext[uart] = XON;
+            flow[uart] = 1;
+            serialStartTransmission(uart);
+        }
+        SREG = sreg;
+    }
+}
+#endif // FLOWCONTROL
+
+#ifdef SERIAL_RTSCTS
+static void serialRtsCheck(uint8_t uart) {
+    if (serialRtsPins[uart].port == 0) {
         return;
     }
 
-#ifndef UART_XMEGA
-
+    // Ready again once half of the buffer is free. With interrupts off,
+    // so the receive interrupt can not stop it in between.
     uint8_t sreg = SREG;
-    sei();
-    while (!serialTxBufferEmpty(uart));
-
-    // Wait while Transmit Interrupt is on
-    while (*serialRegisters[uart][SERIALB] & (1 << serialBits[uart][SERIALUDRIE]));
-
     cli();
-    *serialRegisters[uart][SERIALB] = 0;
-    *serialRegisters[uart][SERIALC] = 0;
+    if (serialRxUsed(uart) <= ((rxMask[uart] + 1) / 2)) {
+        RTSREADY(serialRtsPins[uart]);
+    }
     SREG = sreg;
-
-#else // UART_XMEGA
-
-    // TODO enable interrupts, wait for completion
-    sei();
-    while(!serialTxBufferEmpty(uart));
-
-    // TODO Wait while Transmit Interrupt is turned on
-
-    cli();
-    serialRegisters[uart]->CTRLA = 0;
-    serialRegisters[uart]->CTRLB = 0;
-    serialRegisters[uart]->CTRLC = 0;
-
-    // TODO restore interrupt state
-
-#endif // UART_XMEGA
 }
+#endif // SERIAL_RTSCTS
 
-#ifdef FLOWCONTROL
-void setFlow(uint8_t uart, uint8_t on) {
-    if (uart >= UART_COUNT) {
+#ifdef SERIAL_RS485
+static void serialDriverEnable(uint8_t uart) {
+    if (serialDePins[uart].port == 0) {
         return;
     }
 
-    if (flow[uart] != on) {
-        if (on == 1) {
-            // Send XON
-            while (sendThisNext[uart] != 0);
-            sendThisNext[uart] = XON;
-            flow[uart] = 1;
-            if (shouldStartTransmission[uart]) {
-                shouldStartTransmission[uart] = 0;
-
+    // Released by the transmit complete interrupt after the last stop bit.
+    // A stale transmit complete flag fires right away, but is ignored, as
+    // the transmission is not idle any more.
+    DEON(serialDePins[uart]);
 #ifndef UART_XMEGA
-                // Enable Interrupt
-                *serialRegisters[uart][SERIALB] |= (1 << serialBits[uart][SERIALUDRIE]);
-
-                // Trigger Interrupt
-                *serialRegisters[uart][SERIALA] |= (1 << serialBits[uart][SERIALUDRE]);
+    *SERIALDEVICE(uart)->b |= (1 << SERIALTXCIE);
 #else // UART_XMEGA
-                // Enable Interrupt
-                serialRegisters[uart]->CTRLA |= UART_INTERRUPT_LEVEL_TX << 2; // TXCINTLVL
-
-                // Trigger Interrupt
-                serialTransmitInterrupt(uart);
+    SERIALDEVICE(uart)->usart->CTRLA |= UART_INTERRUPT_LEVEL_TX << 2; // TXCINTLVL
 #endif // UART_XMEGA
-            }
-        } else {
-            // Send XOFF
-            sendThisNext[uart] = XOFF;
-            flow[uart] = 0;
-            if (shouldStartTransmission[uart]) {
-                shouldStartTransmission[uart] = 0;
+}
 
-#ifndef UART_XMEGA
-                // Enable Interrupt
-                *serialRegisters[uart][SERIALB] |= (1 << serialBits[uart][SERIALUDRIE]);
+static void serialTxCompleteInterrupt(uint8_t uart, SerialDeviceRef dev) {
+    // Still sending, the shift register just ran empty between two writes
+    if (!serialShouldStart[uart]) {
+        return;
+    }
 
-                // Trigger Interrupt
-                *serialRegisters[uart][SERIALA] |= (1 << serialBits[uart][SERIALUDRE]);
+    DEOFF(serialDePins[uart]);
+#ifndef UART_XMEGA
+    *dev->b &= ~(1 << SERIALTXCIE);
 #else // UART_XMEGA
-                // Enable Interrupt
-                serialRegisters[uart]->CTRLA |= UART_INTERRUPT_LEVEL_TX << 2; // TXCINTLVL
-
-                // Trigger Interrupt
-                serialTransmitInterrupt(uart);
+    dev->usart->CTRLA &= ~(UART_INTERRUPT_MASK << 2); // TXCINTLVL
 #endif // UART_XMEGA
+}
+#endif // SERIAL_RS485
+
+#ifdef SERIAL_PACKETS
+static void serialPacketReset(uint8_t uart) {
+    packetLength[uart] = 0;
+    packetCrc[uart] = 0xFFFF;
+    packetBlock[uart] = 0;
+    packetCode[uart] = 0xFF; // No zero in front of the first block
+    packetState[uart] = 0;
+}
+
+static void serialPacketReceive(uint8_t uart, uint8_t c) {
+    if (c == 0) {
+        // Delimiter. The last block has to be complete, and running the
+        // CRC over the data and the CRC itself has to give 0.
+        uint16_t length = packetLength[uart];
+        if (!(packetState[uart] & PACKETDROP) && (packetBlock[uart] == 0)
+                && (length >= 2) && (packetCrc[uart] == 0)) {
+            length -= 2;
+            SerialIndex start = serialRxWrite[uart];
+            rxBuffer[uart][start & rxMask[uart]] = length;
+            rxBuffer[uart][(SerialIndex)(start + 1) & rxMask[uart]] = length >> 8;
+            serialRxWrite[uart] = start + PACKETHEADER + length;
+            RXPENDING(uart);
+#ifdef SERIALSTATS
+            SerialIndex used = serialRxWrite[uart] - serialRxRead[uart];
+            if (used > stats[uart].maxRxUsed) {
+                stats[uart].maxRxUsed = used;
             }
+        } else if (packetState[uart] & PACKETBUSY) {
+            stats[uart].packetErrors++;
+#endif // SERIALSTATS
         }
+        serialPacketReset(uart);
+        return;
+    }
 
-        // Wait until it's transmitted / while transmit interrupt is turned on
-#ifndef UART_XMEGA
-        while (*serialRegisters[uart][SERIALB] & (1 << serialBits[uart][SERIALUDRIE]));
-#else // UART_XMEGA
-        // TODO Wait while transmit interrupt is turned on
-#endif
+    packetState[uart] |= PACKETBUSY;
+    if (packetBlock[uart] == 0) {
+        // Code byte. Blocks shorter than 254 bytes were followed by a zero.
+        if (packetCode[uart] != 0xFF) {
+            serialPacketStore(uart, 0);
+        }
+        packetCode[uart] = c;
+        packetBlock[uart] = c - 1;
+    } else {
+        serialPacketStore(uart, c);
+        packetBlock[uart]--;
     }
 }
-#endif // FLOWCONTROL
-
-// ---------------------
-// |     Reception     |
-// ---------------------
 
-uint8_t serialHasChar(uint8_t uart) {
-    if (uart >= UART_COUNT) {
-        return 0;
+static void serialPacketStore(uint8_t uart, uint8_t c) {
+    if (packetState[uart] & PACKETDROP) {
+        return;
     }
 
-    if (rxRead[uart] != rxWrite[uart]) {
-        // True if char available
-        return 1;
-    } else {
-        return 0;
+    // Length, packet so far and the new byte have to fit
+    uint16_t used = (SerialIndex)(serialRxWrite[uart] - serialRxRead[uart]);
+    if ((used + PACKETHEADER + packetLength[uart]) >= (rxMask[uart] + 1)) {
+        packetState[uart] |= PACKETDROP;
+        return;
     }
+
+    SerialIndex write = serialRxWrite[uart] + PACKETHEADER + packetLength[uart];
+    rxBuffer[uart][write & rxMask[uart]] = c;
+    packetLength[uart]++;
+    packetCrc[uart] = _crc_ccitt_update(packetCrc[uart], c);
 }
 
-uint8_t serialGetBlocking(uint8_t uart) {
-    if (uart >= UART_COUNT) {
-        return 0;
+static void serialPacketPut(uint8_t uart, uint8_t c) {
+#ifdef SERIAL_POLLED
+    if (POLLED(uart)) {
+        WAITUNTIL(TXREADY(uart), 0);
+        SERIALPUTDATA(uart, SERIALDEVICE(uart), c);
+#ifdef SERIALSTATS
+        stats[uart].transmitted++;
+#endif // SERIALSTATS
+        return;
     }
+#endif // SERIAL_POLLED
 
-    while(!serialHasChar(uart));
-    return serialGet(uart);
+    // Packets larger than the buffer are sent while they are encoded
+    if (serialTxUsed(uart) == (txMask[uart] + 1)) {
+        serialStartTransmission(uart);
+        WAITUNTIL(serialTxUsed(uart) != (txMask[uart] + 1), 1);
+    }
+    txBuffer[uart][serialTxWrite[uart] & txMask[uart]] = c;
+    INDEXADD(serialTxWrite[uart], 1);
 }
+#endif // SERIAL_PACKETS
 
-uint8_t serialGet(uint8_t uart) {
-    if (uart >= UART_COUNT) {
-        return 0;
+#ifdef SERIALSTATS
+static void serialRxStats(uint8_t uart, SerialDeviceRef dev) {
+    // The error flags belong to the byte in the data register,
+    // they have to be read before it
+#ifndef UART_XMEGA
+    uint8_t status = *dev->a;
+    if (status & (1 << SERIALFE)) {
+        stats[uart].frameErrors++;
     }
+    if (status & (1 << SERIALDOR)) {
+        stats[uart].overruns++;
+    }
+    if (status & (1 << SERIALUPE)) {
+        stats[uart].parityErrors++;
+    }
+#else // UART_XMEGA
+    uint8_t status = dev->usart->STATUS;
+    if (status & USART_FERR_bm) {
+        stats[uart].frameErrors++;
+    }
+    if (status & USART_BUFOVF_bm) {
+        stats[uart].overruns++;
+    }
+    if (status & USART_PERR_bm) {
+        stats[uart].parityErrors++;
+    }
+#endif // UART_XMEGA
+    stats[uart].received++;
+}
+#endif // SERIALSTATS
 
-    uint8_t c;
-
-    if (rxRead[uart] != rxWrite[uart]) {
-#ifdef FLOWCONTROL
-        // This should not underflow as long as the receive buffer is not empty
-        rxBufferElements[uart]--;
-
-        if ((flow[uart] == 0) && (rxBufferElements[uart] <= FLOWMARK)) {
-            while (sendThisNext[uart] != 0);
-            sendThisNext[uart] = XON;
-            flow[uart] = 1;
-            if (shouldStartTransmission[uart]) {
-                shouldStartTransmission[uart] = 0;
-
+#ifdef SERIALMULTIDROP
+static void serialMpcm(uint8_t uart, SerialDeviceRef dev, uint8_t on) {
 #ifndef UART_XMEGA
-                // Enable Interrupt
-                *serialRegisters[uart][SERIALB] |= (1 << serialBits[uart][SERIALUDRIE]);
-
-                // Trigger Interrupt
-                *serialRegisters[uart][SERIALA] |= (1 << serialBits[uart][SERIALUDRE]);
+    // Only U2X and MPCM are written, a one would clear TXC
+    uint8_t a = *dev->a & (1 << SERIALU2X);
+    if (on) {
+        a |= (1 << SERIALMPCM);
+    }
+    *dev->a = a;
 #else // UART_XMEGA
-                // Enable Interrupt
-                serialRegisters[uart]->CTRLA |= UART_INTERRUPT_LEVEL_TX << 2; // TXCINTLVL
-
-                // Trigger Interrupt
-                serialTransmitInterrupt(uart);
-#endif // UART_XMEGA
-            }
-        }
-#endif // FLOWCONTROL
-        c = rxBuffer[uart][rxRead[uart]];
-        rxBuffer[uart][rxRead[uart]] = 0;
-        if (rxRead[uart] < (RX_BUFFER_SIZE - 1)) {
-            rxRead[uart]++;
-        } else {
-            rxRead[uart] = 0;
-        }
-        return c;
+    if (on) {
+        dev->usart->CTRLB |= USART_MPCM_bm;
     } else {
-        return 0;
+        dev->usart->CTRLB &= ~USART_MPCM_bm;
     }
+#endif // UART_XMEGA
 }
 
-uint8_t serialRxBufferFull(uint8_t uart) {
-    if (uart >= UART_COUNT) {
+static uint8_t serialRxAddress(uint8_t uart, SerialDeviceRef dev) {
+    // The 9th bit belongs to the byte in the data register, read it first
+#ifndef UART_XMEGA
+    uint8_t address = *dev->b & (1 << SERIALRXB8);
+#else // UART_XMEGA
+    uint8_t address = dev->usart->STATUS & USART_RXB8_bm;
+#endif // UART_XMEGA
+    if (!address) {
         return 0;
     }
 
-    return (((rxWrite[uart] + 1) == rxRead[uart])
-            || ((rxRead[uart] == 0) && ((rxWrite[uart] + 1) == RX_BUFFER_SIZE)));
+    // Receive the following data if it is for us, ignore it otherwise
+    serialMpcm(uart, dev, SERIALGETDATA(uart, dev) != rxAddress[uart]);
+    return 1;
 }
-
-uint8_t serialRxBufferEmpty(uint8_t uart) {
-    if (uart >= UART_COUNT) {
-        return 0;
-    }
-
-    if (rxRead[uart] != rxWrite[uart]) {
-        return 0;
-    } else {
-        return 1;
+#endif // SERIALMULTIDROP
+
+#ifdef SERIAL_POLLED
+static uint8_t serialPolledGet(uint8_t uart) {
+#ifdef SERIALSTATS
+    serialRxStats(uart, SERIALDEVICE(uart));
+#endif // SERIALSTATS
+    return SERIALGETDATA(uart, SERIALDEVICE(uart));
+}
+#endif // SERIAL_POLLED
+
+#ifdef SERIALLINES
+static void serialLinesConsumed(uint8_t uart, uint8_t count) {
+    // The ISR may have missed terminators while saturated
+    uint8_t pending = linesIn[uart] - linesOut[uart];
+    if (count > pending) {
+        count = pending;
     }
+    linesOut[uart] += count;
 }
 
-// ----------------------
-// |    Transmission    |
-// ----------------------
-
-void serialWrite(uint8_t uart, uint8_t data) {
-    if (uart >= UART_COUNT) {
-        return;
+static uint16_t serialRxFind(uint8_t uart, uint8_t c, uint16_t count) {
+    // Search at most two chunks, up to the end of the buffer and from its start
+    uint16_t read = serialRxRead[uart] & rxMask[uart];
+    uint16_t chunk = (rxMask[uart] + 1) - read;
+    if (chunk > count) {
+        chunk = count;
     }
-
-#ifdef SERIALINJECTCR
-    if (data == '\n') {
-        serialWrite(uart, '\r');
+    uint8_t *p = memchr((uint8_t *)&rxBuffer[uart][read], c, chunk);
+    if (p != 0) {
+        return p - (uint8_t *)&rxBuffer[uart][read];
+    }
+    if (chunk < count) {
+        p = memchr((uint8_t *)&rxBuffer[uart][0], c, count - chunk);
+        if (p != 0) {
+            return chunk + (p - (uint8_t *)&rxBuffer[uart][0]);
+        }
     }
+    return count;
+}
+#endif // SERIALLINES
+
+#ifdef SERIALSTDIO
+static int serialStreamPut(uint8_t uart, char c) {
+#if SERIALSTDIOBUFFER > 0
+    // One copy into the transmit buffer per line instead of per character
+    streamBuffer[uart][streamCount[uart]++] = c;
+    if ((c == '\n') || (streamCount[uart] >= SERIALSTDIOBUFFER)) {
+        serialStreamFlush(uart);
+    }
+#else
+    serialWrite(uart, c);
 #endif
-    while (serialTxBufferFull(uart));
+    return 0;
+}
 
-    txBuffer[uart][txWrite[uart]] = data;
-    if (txWrite[uart] < (TX_BUFFER_SIZE - 1)) {
-        txWrite[uart]++;
-    } else {
-        txWrite[uart] = 0;
+static int serialStreamGet(uint8_t uart) {
+    // Show a pending prompt before waiting for the answer
+    serialStreamFlush(uart);
+    return serialGetBlocking(uart);
+}
+#endif // SERIALSTDIO
+
+#ifdef SERIAL_DMA
+static void serialDmaInit(uint8_t uart) {
+    DMA.CTRL |= DMA_ENABLE_bm;
+
+    DMA_CH_t *channel = dmaRx[uart];
+    if (channel != 0) {
+        // Endless ring: one byte per received character, back to the
+        // start of the buffer after every block, repeated forever
+        channel->CTRLA = 0;
+        channel->ADDRCTRL = DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_FIXED_gc
+                | DMA_CH_DESTRELOAD_BLOCK_gc | DMA_CH_DESTDIR_INC_gc;
+        channel->TRIGSRC = SERIALDEVICE(uart)->dmaTrigger;
+        channel->TRFCNT = rxMask[uart] + 1;
+        channel->REPCNT = 0;
+        SERIALDMASOURCE(channel, &SERIALDEVICE(uart)->usart->DATA);
+        SERIALDMADESTINATION(channel, rxBuffer[uart]);
+        channel->CTRLB = 0;
+        channel->CTRLA = DMA_CH_ENABLE_bm | DMA_CH_REPEAT_bm
+                | DMA_CH_SINGLE_bm | DMA_CH_BURSTLEN_1BYTE_gc;
     }
-    if (shouldStartTransmission[uart]) {
-        shouldStartTransmission[uart] = 0;
 
-#ifndef UART_XMEGA
-        // Enable Interrupt
-        *serialRegisters[uart][SERIALB] |= (1 << serialBits[uart][SERIALUDRIE]);
+    channel = dmaTx[uart];
+    if (channel != 0) {
+        // One block per contiguous span of the transmit buffer
+        channel->CTRLA = 0;
+        channel->ADDRCTRL = DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_INC_gc
+                | DMA_CH_DESTRELOAD_NONE_gc | DMA_CH_DESTDIR_FIXED_gc;
+        channel->TRIGSRC = SERIALDEVICE(uart)->dmaTrigger + 1; // DRE follows RXC
+        SERIALDMADESTINATION(channel, &SERIALDEVICE(uart)->usart->DATA);
+        channel->CTRLB = UART_INTERRUPT_LEVEL_TX; // TRNINTLVL
+    }
+}
 
-        // Trigger Interrupt
-        *serialRegisters[uart][SERIALA] |= (1 << serialBits[uart][SERIALUDRE]);
-#else // UART_XMEGA
-        // Enable Interrupt
-        serialRegisters[uart]->CTRLA |= UART_INTERRUPT_LEVEL_TX << 2; // TXCINTLVL
+static void serialDmaRxWrite(uint8_t uart) {
+    // The 16bit counter is read through the TEMP register shared by all channels
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t count = dmaRx[uart]->TRFCNT;
+    SREG = sreg;
 
-        // Trigger Interrupt
-        serialTransmitInterrupt(uart);
-#endif // UART_XMEGA
+    // The counter runs down towards the end of the buffer. DMA can not stop
+    // at a full buffer, so a completely filled one looks empty and further
+    // bytes overwrite the oldest ones. Read often enough!
+    uint16_t write = ((rxMask[uart] + 1) - count) & rxMask[uart];
+    SerialIndex used = (write - serialRxRead[uart]) & rxMask[uart];
+#ifdef SERIALSTATS
+    // Bytes are only seen here, errors and lost bytes not at all
+    stats[uart].received += (SerialIndex)(serialRxRead[uart] + used - serialRxWrite[uart]);
+    if (used > stats[uart].maxRxUsed) {
+        stats[uart].maxRxUsed = used;
     }
+#endif // SERIALSTATS
+    serialRxWrite[uart] = serialRxRead[uart] + used;
 }
 
-void serialWriteString(uint8_t uart, const char *data) {
-    if (uart >= UART_COUNT) {
+static void serialDmaTransmit(uint8_t uart) {
+    uint16_t count = serialTxUsed(uart);
+#ifdef SERIAL_RTSCTS
+    // Checked between blocks only, a started block is sent completely
+    if ((serialCtsPins[uart].port != 0) && !CTSREADY(serialCtsPins[uart])) {
+        count = 0;
+    }
+#endif // SERIAL_RTSCTS
+    if (count == 0) {
+        // Nothing in flight, a late interrupt must not move the index again.
+        // The channel disabled itself at the end of the block, so there is
+        // nothing left to switch off before handing the transmitter back.
+        dmaTxCount[uart] = 0;
+        serialShouldStart[uart] = 1;
         return;
     }
 
-    if (data == 0) {
-        serialWriteString(uart, "NULL");
-    } else {
-        while (*data != '\0') {
-            serialWrite(uart, *data++);
-        }
+    // Send up to the end of the buffer, the rest follows in the next block
+    uint16_t read = serialTxRead[uart] & txMask[uart];
+    if (count > ((txMask[uart] + 1) - read)) {
+        count = (txMask[uart] + 1) - read;
     }
+    dmaTxCount[uart] = count;
+
+    DMA_CH_t *channel = dmaTx[uart];
+    uint8_t sreg = SREG;
+    cli();
+    channel->TRFCNT = count;
+    SREG = sreg;
+    SERIALDMASOURCE(channel, &txBuffer[uart][read]);
+    channel->CTRLA = DMA_CH_ENABLE_bm | DMA_CH_SINGLE_bm | DMA_CH_BURSTLEN_1BYTE_gc;
 }
 
-uint8_t serialTxBufferFull(uint8_t uart) {
-    if (uart >= UART_COUNT) {
-        return 0;
+static void serialDmaTransmitInterrupt(uint8_t uart) {
+    // Entering the vector does not clear the flag, writing a one does
+    dmaTx[uart]->CTRLB = DMA_CH_TRNIF_bm | UART_INTERRUPT_LEVEL_TX; // TRNINTLVL
+
+    serialTxRead[uart] += dmaTxCount[uart];
+#ifdef SERIALSTATS
+    stats[uart].transmitted += dmaTxCount[uart];
+#endif // SERIALSTATS
+    serialDmaTransmit(uart);
+}
+#endif // SERIAL_DMA
+
+// Stop the remote end with RTS or XOFF shortly before the receive buffer
+// is full, used is the number of bytes taking up space in it
+SERIALINLINE void serialRxFlowStop(uint8_t uart, uint16_t used) {
+#ifdef SERIAL_RTSCTS
+    if ((serialRtsPins[uart].port != 0)
+            && (used >= ((rxMask[uart] + 1) - FLOWMARK))) {
+        RTSSTOP(serialRtsPins[uart]);
     }
+#endif // SERIAL_RTSCTS
 
-    return (((txWrite[uart] + 1) == txRead[uart])
-            || ((txRead[uart] == 0) && ((txWrite[uart] + 1) == TX_BUFFER_SIZE)));
+#ifdef FLOWCONTROL
+    if ((flow[uart] == 1) && (used >= ((rxMask[uart] + 1) - FLOWMARK))) {
+        sendThisNext[uart] = XOFF;
+        flow[uart] = 0;
+#ifdef SERIALSTATS
+        stats[uart].xoffs++;
+#endif // SERIALSTATS
+        serialStartTransmission(uart);
+    }
+#endif // FLOWCONTROL
 }
 
-uint8_t serialTxBufferEmpty(uint8_t uart) {
-    if (uart >= UART_COUNT) {
-        return 0;
+SERIALISR void serialReceiveInterrupt(uint8_t uart, SerialDeviceRef dev) {
+#ifdef SERIALSTATS
+    serialRxStats(uart, dev);
+#endif // SERIALSTATS
+
+#ifdef SERIALIDLE
+    // Any byte on the line, even one filtered out, continues the frame
+    if (idleCount[uart] == 0) {
+        idleBytes[uart] = 0;
+    }
+    idleCount[uart] = idleTimeout[uart];
+    if (idleBytes[uart] < 0xFFFF) {
+        idleBytes[uart]++;
     }
+#endif // SERIALIDLE
 
-    if (txRead[uart] != txWrite[uart]) {
-        return 0;
-    } else {
-        return 1;
+#ifdef SERIALMULTIDROP
+    if (rxAddressOn[uart] && serialRxAddress(uart, dev)) {
+        return;
     }
-}
+#endif // SERIALMULTIDROP
 
-// ----------------------
-// |      Internal      |
-// ----------------------
+    uint8_t c = SERIALGETDATA(uart, dev);
 
-static void serialReceiveInterrupt(uint8_t uart) {
-#ifndef UART_XMEGA
-    rxBuffer[uart][rxWrite[uart]] = *serialRegisters[uart][SERIALDATA];
-#else // UART_XMEGA
-    rxBuffer[uart][rxWrite[uart]] = serialRegisters[uart]->DATA;
-#endif // UART_XMEGA
+#ifdef SERIAL_PACKETS
+    if (PACKETS(uart)) {
+        serialPacketReceive(uart, c);
 
-    // Simply skip increasing the write pointer if the receive buffer is overflowing
-    if (!serialRxBufferFull(uart)) {
-        if (rxWrite[uart] < (RX_BUFFER_SIZE - 1)) {
-            rxWrite[uart]++;
-        } else {
-            rxWrite[uart] = 0;
+        // The packet being decoded takes up space as well. Only stop the
+        // remote end if reading a complete packet can free some again.
+        if (serialRxWrite[uart] != serialRxRead[uart]) {
+            serialRxFlowStop(uart, (SerialIndex)(serialRxWrite[uart] - serialRxRead[uart])
+                    + PACKETHEADER + packetLength[uart]);
         }
+        return;
     }
+#endif // SERIAL_PACKETS
 
-#ifdef FLOWCONTROL
-    if (rxBufferElements[uart] < 0xFFFF) {
-        rxBufferElements[uart]++;
+#ifdef SERIALCALLBACKS
+    // The application may take the byte instead of the buffer
+    SerialByteCallback hook = rxByteHook[uart];
+    if ((hook != 0) && hook(uart, c)) {
+        return;
     }
+#endif // SERIALCALLBACKS
+
+    // Simply drop the byte if the receive buffer is overflowing
+    SerialIndex used = serialRxWrite[uart] - serialRxRead[uart];
+    if (used < (rxMask[uart] + 1)) {
+        rxBuffer[uart][serialRxWrite[uart] & rxMask[uart]] = c;
+        serialRxWrite[uart]++;
+        used++;
+        RXPENDING(uart);
+
+#ifdef SERIALCALLBACKS
+        // Only noted here, main takes it with serialRxLevelMask()
+        if ((rxLevel[uart] != 0) && (used >= rxLevel[uart])) {
+            rxLevelReached |= (1 << uart);
+        }
+#endif // SERIALCALLBACKS
 
-    if ((flow[uart] == 1) && (rxBufferElements[uart] >= (RX_BUFFER_SIZE - FLOWMARK))) {
-        sendThisNext[uart] = XOFF;
-        flow[uart] = 0;
-        if (shouldStartTransmission[uart]) {
-            shouldStartTransmission[uart] = 0;
-
-#ifndef UART_XMEGA
-            // Enable Interrupt
-            *serialRegisters[uart][SERIALB] |= (1 << serialBits[uart][SERIALUDRIE]);
-
-            // Trigger Interrupt
-            *serialRegisters[uart][SERIALA] |= (1 << serialBits[uart][SERIALUDRE]);
-#else // UART_XMEGA
-            // Enable Interrupt
-            serialRegisters[uart]->CTRLA |= UART_INTERRUPT_LEVEL_TX << 2; // TXCINTLVL
+#ifdef SERIALSTATS
+        if (used > stats[uart].maxRxUsed) {
+            stats[uart].maxRxUsed = used;
+        }
+#endif // SERIALSTATS
 
-            // Trigger Interrupt
-            serialTransmitInterrupt(uart);
-#endif // UART_XMEGA
+#ifdef SERIALLINES
+        if ((c == SERIALLINEEND) && ((uint8_t)(linesIn[uart] - linesOut[uart]) < 0xFF)) {
+            linesIn[uart]++;
         }
+#endif // SERIALLINES
+#ifdef SERIALSTATS
+    } else {
+        stats[uart].overflows++;
+#endif // SERIALSTATS
     }
-#endif // FLOWCONTROL
+
+    serialRxFlowStop(uart, used);
 }
 
-static void serialTransmitInterrupt(uint8_t uart) {
-#ifdef FLOWCONTROL
-    if (sendThisNext[uart]) {
+SERIALISR void serialTransmitInterrupt(uint8_t uart, SerialDeviceRef dev) {
+#ifdef SERIAL_RTSCTS
+    // Pause until serialCtsChanged() or the next write starts it again
+    if ((serialCtsPins[uart].port != 0) && !CTSREADY(serialCtsPins[uart])) {
 #ifndef UART_XMEGA
-        *serialRegisters[uart][SERIALDATA] = sendThisNext[uart];
+        *dev->b &= ~(1 << SERIALUDRIE);
 #else // UART_XMEGA
-        serialRegisters[uart]->DATA = sendThisNext[uart];
+        dev->usart->CTRLA &= ~(UART_INTERRUPT_MASK << 0); // DREINTLVL
 #endif // UART_XMEGA
+        serialShouldStart[uart] = 1;
+        return;
+    }
+#endif // SERIAL_RTSCTS
+
+#ifdef FLOWCONTROL
+    if (sendThisNext[uart]) {
+        SERIALPUTDATA(uart, dev, sendThisNext[uart]);
         sendThisNext[uart] = 0;
+#ifdef SERIALSTATS
+        stats[uart].transmitted++;
+#endif // SERIALSTATS
     } else {
 #endif // FLOWCONTROL
-        if (txRead[uart] != txWrite[uart]) {
-#ifndef UART_XMEGA
-            *serialRegisters[uart][SERIALDATA] = txBuffer[uart][txRead[uart]];
-#else // UART_XMEGA
-            serialRegisters[uart]->DATA = txBuffer[uart][txRead[uart]];
-#endif // UART_XMEGA
-            if (txRead[uart] < (TX_BUFFER_SIZE -1)) {
-                txRead[uart]++;
-            } else {
-                txRead[uart] = 0;
+#ifdef SERIALREFERENCE
+        if (txRefLength[uart] != 0) {
+            const uint8_t *data = txRef[uart];
+            SERIALPUTDATA(uart, dev, txRefFlash[uart] ? pgm_read_byte(data) : *data);
+            txRef[uart] = data + 1;
+#ifdef SERIALSTATS
+            stats[uart].transmitted++;
+#endif // SERIALSTATS
+            if ((--txRefLength[uart] == 0) && (txRefDone[uart] != 0)) {
+                txRefDone[uart](uart);
             }
+            return;
+        }
+#endif // SERIALREFERENCE
+        if (serialTxRead[uart] != serialTxWrite[uart]) {
+            SERIALPUTDATA(uart, dev, txBuffer[uart][serialTxRead[uart] & txMask[uart]]);
+            serialTxRead[uart]++;
+#ifdef SERIALSTATS
+            stats[uart].transmitted++;
+#endif // SERIALSTATS
         } else {
-            shouldStartTransmission[uart] = 1;
-
-            // Disable Interrupt
+            // Disable Interrupt before handing the transmitter back, a
+            // nested interrupt starting it again must find it off
 #ifndef UART_XMEGA
-            *serialRegisters[uart][SERIALB] &= ~(1 << serialBits[uart][SERIALUDRIE]);
+            *dev->b &= ~(1 << SERIALUDRIE);
 #else // UART_XMEGA
-            serialRegisters[uart]->CTRLA &= ~(UART_INTERRUPT_MASK << 2); // TXCINTLVL
+            dev->usart->CTRLA &= ~(UART_INTERRUPT_MASK << 0); // DREINTLVL
 #endif // UART_XMEGA
+            serialShouldStart[uart] = 1;
         }
 #ifdef FLOWCONTROL
     }
@@ -576,13 +2969,13 @@ static void serialTransmitInterrupt(uint8_t uart) {
 // Receive complete
 #define ISR_RX(n) \
     ISR(SERIALRECIEVEINTERRUPT ## n) { \
-        serialReceiveInterrupt(n); \
+        serialReceiveInterrupt(n, SERIALDEVICE(n)); \
     }
 
 // Data register empty
 #define ISR_TX(n) \
     ISR(SERIALTRANSMITINTERRUPT ## n) { \
-        serialTransmitInterrupt(n); \
+        serialTransmitInterrupt(n, SERIALDEVICE(n)); \
     }
 
 ISR_RX(0)
@@ -623,5 +3016,92 @@ ISR_RX(7)
 ISR_TX(7)
 #endif
 
+#ifdef SERIAL_RS485
+
+// Transmit complete, only taken for RS-485 ports
+#define ISR_TXC(n) \
+    ISR(SERIALTXCOMPLETEINTERRUPT ## n) { \
+        serialTxCompleteInterrupt(n, SERIALDEVICE(n)); \
+    }
+
+#ifdef SERIAL_DE_PORT_0
+ISR_TXC(0)
+#endif
+
+#ifdef SERIAL_DE_PORT_1
+ISR_TXC(1)
+#endif
+
+#ifdef SERIAL_DE_PORT_2
+ISR_TXC(2)
+#endif
+
+#ifdef SERIAL_DE_PORT_3
+ISR_TXC(3)
+#endif
+
+#ifdef SERIAL_DE_PORT_4
+ISR_TXC(4)
+#endif
+
+#ifdef SERIAL_DE_PORT_5
+ISR_TXC(5)
+#endif
+
+#ifdef SERIAL_DE_PORT_6
+ISR_TXC(6)
+#endif
+
+#ifdef SERIAL_DE_PORT_7
+ISR_TXC(7)
+#endif
+
+#endif // SERIAL_RS485
+
+#ifdef SERIAL_DMA
+
+#define DMAVECT(c) DMA_CH ## c ## _vect
+#define DMAVECTOR(c) DMAVECT(c)
+
+// DMA transmit block complete
+#define ISR_DMA(n) \
+    ISR(DMAVECTOR(SERIAL_DMA_TX_ ## n)) { \
+        serialDmaTransmitInterrupt(n); \
+    }
+
+#if SERIAL_DMA_TX_0 >= 0
+ISR_DMA(0)
+#endif
+
+#if (UART_COUNT > 1) && (SERIAL_DMA_TX_1 >= 0)
+ISR_DMA(1)
+#endif
+
+#if (UART_COUNT > 2) && (SERIAL_DMA_TX_2 >= 0)
+ISR_DMA(2)
+#endif
+
+#if (UART_COUNT > 3) && (SERIAL_DMA_TX_3 >= 0)
+ISR_DMA(3)
+#endif
+
+#if (UART_COUNT > 4) && (SERIAL_DMA_TX_4 >= 0)
+ISR_DMA(4)
+#endif
+
+#if (UART_COUNT > 5) && (SERIAL_DMA_TX_5 >= 0)
+ISR_DMA(5)
+#endif
+
+#if (UART_COUNT > 6) && (SERIAL_DMA_TX_6 >= 0)
+ISR_DMA(6)
+#endif
+
+#if (UART_COUNT > 7) && (SERIAL_DMA_TX_7 >= 0)
+ISR_DMA(7)
+#endif
+
+#endif // SERIAL_DMA
+
 /** @} */
 
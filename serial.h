@@ -41,8 +41,250 @@
  *  UART Library Header File
  */
 
-/** Calculate Baudrate Register Value */
-#define BAUD(baudRate,xtalCpu) ((xtalCpu) / ((baudRate) * 16l) - 1)
+#include <stdint.h>
+#include <stdio.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+/** If you define this, a '\\r' (CR) will be put in front of a '\\n' (LF) when sending a byte.
+ *  Binary Communication will then be impossible!
+ */
+// #define SERIALINJECTCR
+
+/** Defining this enables incoming XON XOFF (sends XOFF if rx buff is full) */
+//#define FLOWCONTROL
+
+/** Defining this counts complete lines in the receive interrupt,
+ *  for serialHasLine() and serialReadLine()
+ */
+//#define SERIALLINES
+
+// The three switches above change how received and sent bytes are handled,
+// so the inline functions of SERIAL_PORT_INLINE() have to know them too.
+
+#if !(defined(__AVR_ARCH__) && (__AVR_ARCH__ >= 100)) && !defined(SERIAL_HOST_SIM_XMEGA)
+
+#ifndef RX_BUFFER_SIZE
+#define RX_BUFFER_SIZE 32 /**< RX Buffer Size in Bytes (Power of 2) */
+#endif // RX_BUFFER_SIZE
+
+#ifndef TX_BUFFER_SIZE
+#define TX_BUFFER_SIZE 16 /**< TX Buffer Size in Bytes (Power of 2) */
+#endif // TX_BUFFER_SIZE
+
+#else // XMega
+
+#ifndef RX_BUFFER_SIZE
+#define RX_BUFFER_SIZE 128 /**< RX Buffer Size in Bytes (Power of 2) */
+#endif // RX_BUFFER_SIZE
+
+#ifndef TX_BUFFER_SIZE
+#define TX_BUFFER_SIZE 128 /**< TX Buffer Size in Bytes (Power of 2) */
+#endif // TX_BUFFER_SIZE
+
+#endif // XMega
+
+// Per-port buffer sizes, falling back to the defaults above.
+// Define RX_BUFFER_SIZE_n / TX_BUFFER_SIZE_n to size UART n differently.
+
+#ifndef RX_BUFFER_SIZE_0
+#define RX_BUFFER_SIZE_0 RX_BUFFER_SIZE /**< RX Buffer Size of UART 0 */
+#endif
+#ifndef TX_BUFFER_SIZE_0
+#define TX_BUFFER_SIZE_0 TX_BUFFER_SIZE /**< TX Buffer Size of UART 0 */
+#endif
+#ifndef RX_BUFFER_SIZE_1
+#define RX_BUFFER_SIZE_1 RX_BUFFER_SIZE /**< RX Buffer Size of UART 1 */
+#endif
+#ifndef TX_BUFFER_SIZE_1
+#define TX_BUFFER_SIZE_1 TX_BUFFER_SIZE /**< TX Buffer Size of UART 1 */
+#endif
+#ifndef RX_BUFFER_SIZE_2
+#define RX_BUFFER_SIZE_2 RX_BUFFER_SIZE /**< RX Buffer Size of UART 2 */
+#endif
+#ifndef TX_BUFFER_SIZE_2
+#define TX_BUFFER_SIZE_2 TX_BUFFER_SIZE /**< TX Buffer Size of UART 2 */
+#endif
+#ifndef RX_BUFFER_SIZE_3
+#define RX_BUFFER_SIZE_3 RX_BUFFER_SIZE /**< RX Buffer Size of UART 3 */
+#endif
+#ifndef TX_BUFFER_SIZE_3
+#define TX_BUFFER_SIZE_3 TX_BUFFER_SIZE /**< TX Buffer Size of UART 3 */
+#endif
+#ifndef RX_BUFFER_SIZE_4
+#define RX_BUFFER_SIZE_4 RX_BUFFER_SIZE /**< RX Buffer Size of UART 4 */
+#endif
+#ifndef TX_BUFFER_SIZE_4
+#define TX_BUFFER_SIZE_4 TX_BUFFER_SIZE /**< TX Buffer Size of UART 4 */
+#endif
+#ifndef RX_BUFFER_SIZE_5
+#define RX_BUFFER_SIZE_5 RX_BUFFER_SIZE /**< RX Buffer Size of UART 5 */
+#endif
+#ifndef TX_BUFFER_SIZE_5
+#define TX_BUFFER_SIZE_5 TX_BUFFER_SIZE /**< TX Buffer Size of UART 5 */
+#endif
+#ifndef RX_BUFFER_SIZE_6
+#define RX_BUFFER_SIZE_6 RX_BUFFER_SIZE /**< RX Buffer Size of UART 6 */
+#endif
+#ifndef TX_BUFFER_SIZE_6
+#define TX_BUFFER_SIZE_6 TX_BUFFER_SIZE /**< TX Buffer Size of UART 6 */
+#endif
+#ifndef RX_BUFFER_SIZE_7
+#define RX_BUFFER_SIZE_7 RX_BUFFER_SIZE /**< RX Buffer Size of UART 7 */
+#endif
+#ifndef TX_BUFFER_SIZE_7
+#define TX_BUFFER_SIZE_7 TX_BUFFER_SIZE /**< TX Buffer Size of UART 7 */
+#endif
+
+/** Largest accepted baudrate error in per mille, checked by BAUD() */
+#ifndef BAUD_TOLERANCE
+#define BAUD_TOLERANCE 20
+#endif
+
+/** Calculate Baudrate Register Value.
+ *  With compile-time constant arguments, picks the double speed mode and,
+ *  on XMegas, the fractional baudrate generator setting with the smallest
+ *  error. Compilation then fails with a negative array size if the error
+ *  is larger than BAUD_TOLERANCE. Values only known at runtime get the
+ *  plain normal speed setting, without any check.
+ */
+#define BAUD(baudRate, xtalCpu) __builtin_choose_expr( \
+        BAUD_CONSTANT((baudRate) * 1ul * (xtalCpu)), \
+        BAUD_CHECKED(baudRate, xtalCpu), BAUD_PLAIN(baudRate, xtalCpu))
+
+// 1 if x is an integer constant expression: only then (x) * 0 is a null
+// pointer constant, and the conditional has the type int * instead of void *
+#define BAUD_CONSTANT(x) \
+    (sizeof(int) == sizeof(*(8 ? ((void *)((long)(x) * 0l)) : (int *)8)))
+
+// The array size is only evaluated for constants, never as a VLA
+#define BAUD_CHECKED(b, f) (BAUD_SETTING(b, f) \
+        + 0 * sizeof(char[(BAUD_ERROR(b, f) <= BAUD_TOLERANCE) ? 1 : -1]))
+
+// Normal speed, BSCALE 0 on XMegas
+#define BAUD_PLAIN(b, f) ((f) / ((b) * 16l) - 1)
+
+// Absolute difference, in unsigned long arithmetic
+#define BAUD_DIFF(a, b) (((a) > (b)) ? ((a) - (b)) : ((b) - (a)))
+
+// CPU clock times 2^s, unsigned to fit up to 32MHz times 128
+#define BAUD_F(f, s) ((1ul * (f)) << (s))
+
+#if (defined(__AVR_ARCH__) && (__AVR_ARCH__ >= 100)) || defined(SERIAL_HOST_SIM_XMEGA)
+
+// XMega: BAUDCTRLB:BAUDCTRLA as 16bit value, BSCALE in the upper 4 bits.
+// Normal speed uses the finest BSCALE that still fits BSEL. Double speed
+// is only used when normal speed can not reach the baudrate. Its BSEL is
+// below 128 with BSCALE -7, so BSEL bit 11 flags it (BAUD_CLK2X).
+
+#define BAUD_CLK2X 0x9800 /**< BSCALE -7 with BSEL bit 11, CLK2X flag */
+
+// Integer part of the normal speed divisor
+#define BAUD_Q(b, f) ((f) / (16ul * (b)))
+
+// Negative BSCALE -s, BSEL = (f / (16 b) - 1) * 2^s
+#define BAUD_NFITS(b, f, s, max) ((BAUD_Q(b, f) << (s)) <= (max))
+#define BAUD_NBSEL(b, f, s) \
+    ((BAUD_F(f, s) + 8ul * (b)) / (16ul * (b)) - (1ul << (s)))
+#define BAUD_NSET(b, f, s) \
+    ((((16ul - (s)) & 0x0F) << 12) | BAUD_NBSEL(b, f, s))
+#define BAUD_NDIV(b, f, s) (16ul * (b) * ((1ul << (s)) + BAUD_NBSEL(b, f, s)))
+#define BAUD_NERR(b, f, s) \
+    (BAUD_DIFF(BAUD_F(f, s), BAUD_NDIV(b, f, s)) / (BAUD_NDIV(b, f, s) / 1000))
+
+// Positive BSCALE p, BSEL = f / (2^p 16 b) - 1
+#define BAUD_PFITS(b, f, p) ((BAUD_Q(b, f) >> (p)) <= 4095)
+#define BAUD_PBSEL(b, f, p) \
+    ((BAUD_F(f, 0) + (8ul << (p)) * (b)) / ((16ul << (p)) * (b)) - 1)
+#define BAUD_PSET(b, f, p) ((1ul * (p) << 12) | BAUD_PBSEL(b, f, p))
+#define BAUD_PDIV(b, f, p) ((16ul << (p)) * (b) * (BAUD_PBSEL(b, f, p) + 1))
+#define BAUD_PERR(b, f, p) \
+    (BAUD_DIFF(BAUD_F(f, 0), BAUD_PDIV(b, f, p)) / (BAUD_PDIV(b, f, p) / 1000))
+
+// Double speed, BSCALE -7, BSEL = (f / (8 b) - 1) * 128
+#define BAUD_DBSEL(b, f) ((BAUD_F(f, 7) + 4ul * (b)) / (8ul * (b)) - 128)
+#define BAUD_DDIV(b, f) (8ul * (b) * (128 + BAUD_DBSEL(b, f)))
+#define BAUD_DERR(b, f) \
+    (BAUD_DIFF(BAUD_F(f, 7), BAUD_DDIV(b, f)) / (BAUD_DDIV(b, f) / 1000))
+
+// Walk all settings from double speed to the coarsest BSCALE
+#define BAUD_SELECT(b, f, D, N, P, NONE) ( \
+    (BAUD_Q(b, f) == 0) ? (((f) >= 8ul * (b)) ? D(b, f) : (NONE)) : \
+    BAUD_NFITS(b, f, 7, 2047) ? N(b, f, 7) : \
+    BAUD_NFITS(b, f, 6, 4095) ? N(b, f, 6) : \
+    BAUD_NFITS(b, f, 5, 4095) ? N(b, f, 5) : \
+    BAUD_NFITS(b, f, 4, 4095) ? N(b, f, 4) : \
+    BAUD_NFITS(b, f, 3, 4095) ? N(b, f, 3) : \
+    BAUD_NFITS(b, f, 2, 4095) ? N(b, f, 2) : \
+    BAUD_NFITS(b, f, 1, 4095) ? N(b, f, 1) : \
+    BAUD_NFITS(b, f, 0, 4095) ? N(b, f, 0) : \
+    BAUD_PFITS(b, f, 1) ? P(b, f, 1) : \
+    BAUD_PFITS(b, f, 2) ? P(b, f, 2) : \
+    BAUD_PFITS(b, f, 3) ? P(b, f, 3) : \
+    BAUD_PFITS(b, f, 4) ? P(b, f, 4) : \
+    BAUD_PFITS(b, f, 5) ? P(b, f, 5) : \
+    BAUD_PFITS(b, f, 6) ? P(b, f, 6) : \
+    BAUD_PFITS(b, f, 7) ? P(b, f, 7) : (NONE))
+
+#define BAUD_DSET(b, f) (BAUD_CLK2X | BAUD_DBSEL(b, f))
+
+/** Register value of the best setting, see BAUD() */
+#define BAUD_SETTING(b, f) \
+    BAUD_SELECT(b, f, BAUD_DSET, BAUD_NSET, BAUD_PSET, 0)
+
+/** Baudrate error of BAUD_SETTING() in per mille, may be used in \#if */
+#define BAUD_ERROR(b, f) \
+    BAUD_SELECT(b, f, BAUD_DERR, BAUD_NERR, BAUD_PERR, 1000)
+
+#else // XMega
+
+// Classic AVR: UBRR in bits 0 to 11, bit 15 selects double speed (U2X).
+// Double speed is only used when it is more accurate.
+
+#define BAUD_U2X 0x8000 /**< Double speed flag */
+
+// UBRR + 1, rounded and limited to the 12bit register
+#define BAUD_RDIV(b, f, d) ((BAUD_F(f, 0) + ((d) / 2) * (b)) / ((d) * (b)))
+#define BAUD_CDIV(b, f, d) ((BAUD_RDIV(b, f, d) < 1) ? 1ul \
+        : ((BAUD_RDIV(b, f, d) > 4096) ? 4096ul : BAUD_RDIV(b, f, d)))
+#define BAUD_ERR(b, f, d) (BAUD_DIFF(BAUD_F(f, 0), (d) * (b) * BAUD_CDIV(b, f, d)) \
+        / (((d) * (b) * BAUD_CDIV(b, f, d)) / 1000))
+
+#define BAUD_DOUBLE(b, f) (BAUD_ERR(b, f, 8ul) < BAUD_ERR(b, f, 16ul))
+
+/** Register value of the best setting, see BAUD() */
+#define BAUD_SETTING(b, f) (BAUD_DOUBLE(b, f) \
+        ? (BAUD_U2X | (BAUD_CDIV(b, f, 8ul) - 1)) : (BAUD_CDIV(b, f, 16ul) - 1))
+
+/** Baudrate error of BAUD_SETTING() in per mille, may be used in \#if */
+#define BAUD_ERROR(b, f) (BAUD_DOUBLE(b, f) \
+        ? BAUD_ERR(b, f, 8ul) : BAUD_ERR(b, f, 16ul))
+
+#endif // XMega
+
+/** \name Frame formats for serialInitFrame()
+ *  Combine one data size, one parity and one stop bit setting.
+ *  The values match the CTRLC register of XMegas.
+ *  @{
+ */
+#define SERIAL_DATA_5 0x00 /**< 5 data bits */
+#define SERIAL_DATA_6 0x01 /**< 6 data bits */
+#define SERIAL_DATA_7 0x02 /**< 7 data bits */
+#define SERIAL_DATA_8 0x03 /**< 8 data bits */
+#define SERIAL_DATA_9 0x07 /**< 9 data bits, the 9th marks addresses */
+#define SERIAL_PARITY_NONE 0x00 /**< No parity bit */
+#define SERIAL_PARITY_EVEN 0x20 /**< Even parity */
+#define SERIAL_PARITY_ODD 0x30 /**< Odd parity */
+#define SERIAL_STOP_1 0x00 /**< 1 stop bit */
+#define SERIAL_STOP_2 0x08 /**< 2 stop bits */
+
+#define SERIAL_8N1 (SERIAL_DATA_8 | SERIAL_PARITY_NONE | SERIAL_STOP_1) /**< Default */
+#define SERIAL_8N2 (SERIAL_DATA_8 | SERIAL_PARITY_NONE | SERIAL_STOP_2) /**< 8N2 */
+#define SERIAL_8E1 (SERIAL_DATA_8 | SERIAL_PARITY_EVEN | SERIAL_STOP_1) /**< 8E1 */
+#define SERIAL_8O1 (SERIAL_DATA_8 | SERIAL_PARITY_ODD | SERIAL_STOP_1) /**< 8O1 */
+#define SERIAL_7E1 (SERIAL_DATA_7 | SERIAL_PARITY_EVEN | SERIAL_STOP_1) /**< 7E1 */
+#define SERIAL_9N1 (SERIAL_DATA_9 | SERIAL_PARITY_NONE | SERIAL_STOP_1) /**< 9N1, for addressing */
+/** @} */
 
 /** Get number of available UART modules.
  *  \returns number of modules
@@ -51,22 +293,42 @@ uint8_t serialAvailable(void);
 
 /** Initialize the UART Hardware.
  *  \param uart UART Module to initialize
- *  \param baud Baudrate. Use the BAUD() macro!
+ *  \param baud Baudrate setting. Use the BAUD() macro!
  */
 void serialInit(uint8_t uart, uint16_t baud);
 
+/** Initialize the UART Hardware with a frame format other than 8N1.
+ *  \param uart UART Module to initialize
+ *  \param baud Baudrate setting. Use the BAUD() macro!
+ *  \param frame Frame format, like SERIAL_7E1 or SERIAL_9N1
+ */
+void serialInitFrame(uint8_t uart, uint16_t baud, uint8_t frame);
+
 /** Stop the UART Hardware.
  *  \param uart UART Module to stop
  */
 void serialClose(uint8_t uart);
 
 /** Manually change the flow control.
+ *  Polled UARTs write XON or XOFF directly, without interrupts.
  *  Flow Control has to be compiled into the library!
  *  \param uart UART Module to operate on
  *  \param on 1 of on, 0 if off
  */
 void setFlow(uint8_t uart, uint8_t on);
 
+/** Only receive data sent to an address (multi-processor communication mode).
+ *  Needs 9 data bits (SERIAL_9N1). Until an address frame with this address
+ *  arrives, the hardware ignores all data frames without an interrupt. Data
+ *  following the address is received, up to the next address frame for
+ *  another node. Address frames are not stored in the receive buffer.
+ *  Addressing (SERIALMULTIDROP) has to be compiled into the library!
+ *  \param uart UART Module to configure
+ *  \param address Address of this node
+ *  \param on 1 to filter by address, 0 to receive everything again
+ */
+void serialSetAddress(uint8_t uart, uint8_t address, uint8_t on);
+
 /** Check if a byte was received.
  *  \param uart UART Module to check
  *  \returns 1 if a byte was received, 0 if not
@@ -80,17 +342,117 @@ uint8_t serialHasChar(uint8_t uart);
 uint8_t serialGet(uint8_t uart);
 
 /** Wait until a character is received.
+ *  With SERIALSLEEP the CPU sleeps in idle mode until the next interrupt.
  *  \param uart UART Module to read from
  *  \returns Received byte
  */
 uint8_t serialGetBlocking(uint8_t uart);
 
+/** Wait a limited time for a received byte.
+ *  Time is counted in calls of serialTick().
+ *  \param uart UART Module to read from
+ *  \param data Storage for the received byte
+ *  \param ticks Number of serialTick() calls to wait at most
+ *  \returns 1 if a byte was received, 0 on timeout
+ */
+uint8_t serialGetTimeout(uint8_t uart, uint8_t *data, uint16_t ticks);
+
+/** Advance the time base of serialGetTimeout().
+ *  Call this from a periodic timer interrupt, which also wakes up
+ *  the CPU when it is waiting in sleep mode (SERIALSLEEP).
+ */
+void serialTick(void);
+
+/** Called when a frame was received and the line went idle.
+ *  Runs in serialTick(), usually in a timer interrupt.
+ *  \param uart UART Module that received the frame
+ *  \param length Number of bytes in the frame
+ */
+typedef void (*SerialFrameCallback)(uint8_t uart, uint16_t length);
+
+/** Detect the end of received frames by an idle line.
+ *  There is no hardware timer per port. The receive interrupt reloads a
+ *  counter with ticks on every byte, and serialTick() counts it down, so
+ *  the time base is whatever timer the application calls serialTick() from.
+ *  As that timer is not synchronized to the line, a frame ends when the
+ *  line has been idle for between ticks - 1 and ticks tick periods, and is
+ *  reported up to one tick period late. Use at least 2 ticks, with 1 the
+ *  next tick may split a frame between two bytes. For the 3.5 characters
+ *  of Modbus RTU, call serialTick() every half character and use 8 ticks,
+ *  which ends a frame after 3.5 to 4 idle characters. Finer ticks give a
+ *  tighter window, at the cost of more timer interrupts.
+ *  serialInit() turns it off again. Only works for interrupt driven UARTs.
+ *  Idle line detection (SERIALIDLE) has to be compiled into the library!
+ *  \param uart UART Module to watch
+ *  \param ticks Number of serialTick() calls without reception, 0 turns it off
+ *  \param done Callback for every complete frame, or 0
+ */
+void serialSetIdleTimeout(uint8_t uart, uint8_t ticks, SerialFrameCallback done);
+
+/** Check if a frame ended with an idle line since the last call.
+ *  Idle line detection (SERIALIDLE) has to be compiled into the library!
+ *  \param uart UART Module to check
+ *  \returns Number of bytes in the last complete frame, 0 if there is none
+ */
+uint16_t serialFrameComplete(uint8_t uart);
+
+/** Read as many received bytes as available, up to a limit.
+ *  Copies whole spans out of the receive buffer instead of single bytes.
+ *  \param uart UART Module to read from
+ *  \param data Buffer for the received bytes
+ *  \param length Maximum number of bytes to read
+ *  \returns Number of bytes read, may be 0
+ */
+uint16_t serialReadBuffer(uint8_t uart, uint8_t *data, uint16_t length);
+
+/** Check if a complete line was received.
+ *  Line counting (SERIALLINES) has to be compiled into the library!
+ *  \param uart UART Module to check
+ *  \returns 1 if a line, or a full receive buffer without terminator, is waiting
+ */
+uint8_t serialHasLine(uint8_t uart);
+
+/** Read a received line.
+ *  The terminator (SERIALLINEEND) is removed, the line is null-terminated.
+ *  Lines that do not fit are split, the rest is returned by the next call.
+ *  Line counting (SERIALLINES) has to be compiled into the library!
+ *  \param uart UART Module to read from
+ *  \param data Buffer for the line
+ *  \param length Buffer size, including the null-termination
+ *  \returns Bytes taken from the receive buffer, including the terminator. 0 if no line was waiting
+ */
+uint16_t serialReadLine(uint8_t uart, char *data, uint16_t length);
+
+/** Check if a complete packet was received.
+ *  Only works for UARTs with packet decoding (SERIAL_PACKETS_n)!
+ *  \param uart UART Module to check
+ *  \returns 1 if a packet with a correct CRC is waiting, 0 if not
+ */
+uint8_t serialHasPacket(uint8_t uart);
+
+/** Read a received packet.
+ *  The COBS encoding and the CRC are already removed. Packets that do not
+ *  fit are cut off, the rest is dropped.
+ *  Only works for UARTs with packet decoding (SERIAL_PACKETS_n)!
+ *  \param uart UART Module to read from
+ *  \param data Buffer for the packet
+ *  \param length Buffer size
+ *  \returns Length of the packet, may be 0 for an empty packet. 0 if no packet was waiting
+ */
+uint16_t serialReadPacket(uint8_t uart, uint8_t *data, uint16_t length);
+
 /** Check if the receive buffer is full.
  *  \param uart UART Module to check
  *  \returns 1 if buffer is full, 0 if not
  */
 uint8_t serialRxBufferFull(uint8_t uart);
 
+/** Get the number of bytes in the receive buffer.
+ *  \param uart UART Module to check
+ *  \returns Number of received bytes not yet read
+ */
+uint16_t serialRxBufferUsed(uint8_t uart);
+
 /** Check if the receive buffer is empty.
  *  \param uart UART Module to check
  *  \returns 1 if buffer is empty, 0 if not.
@@ -103,30 +465,485 @@ uint8_t serialRxBufferEmpty(uint8_t uart);
  */
 void serialWrite(uint8_t uart, uint8_t data);
 
+/** Send an address frame, with the 9th data bit set.
+ *  Waits until everything written before is sent, as the address has to
+ *  bypass the transmit buffer. Needs 9 data bits (SERIAL_9N1).
+ *  \param uart UART Module to write to
+ *  \param address Address of the receiving node
+ */
+void serialWriteAddress(uint8_t uart, uint8_t address);
+
+/** Send a buffer.
+ *  Copies whole spans into the transmit buffer instead of single bytes.
+ *  Waits for free space if the transmit buffer is full.
+ *  \param uart UART Module to write to
+ *  \param data Bytes to send
+ *  \param length Number of bytes to send
+ */
+void serialWriteBuffer(uint8_t uart, const uint8_t *data, uint16_t length);
+
+/** Send a packet.
+ *  A CRC-16 (CCITT) is appended, low byte first, and everything is COBS
+ *  encoded into the transmit buffer on the fly, ending with a zero byte.
+ *  Waits for free space if the transmit buffer is full.
+ *  Packet decoding (SERIAL_PACKETS_n) has to be enabled for at least one UART!
+ *  \param uart UART Module to write to
+ *  \param data Packet to send
+ *  \param length Packet length
+ */
+void serialSendPacket(uint8_t uart, const uint8_t *data, uint16_t length);
+
 /** Send a string.
  *  \param uart UART Module to write to
  *  \param data Null-Terminated String
  */
 void serialWriteString(uint8_t uart, const char *data);
 
+/** Send a string from program memory.
+ *  \param uart UART Module to write to
+ *  \param data Null-Terminated String in flash (PROGMEM)
+ */
+void serialWriteString_P(uint8_t uart, const char *data);
+
+/** Called when a buffer sent by reference was handed to the hardware.
+ *  Runs in the transmit interrupt.
+ *  \param uart UART Module that finished
+ */
+typedef void (*SerialCallback)(uint8_t uart);
+
+/** Called by the receive interrupt for every received byte.
+ *  Runs before the byte is stored, so it should return quickly.
+ *  \param uart UART Module that received the byte
+ *  \param data Received byte
+ *  \returns 1 if the byte was handled, 0 to store it in the receive buffer
+ */
+typedef uint8_t (*SerialByteCallback)(uint8_t uart, uint8_t data);
+
+/** Hand every received byte to a callback, before the receive buffer.
+ *  serialInit() removes it again. Only works for interrupt driven UARTs,
+ *  and not for UARTs with packet decoding.
+ *  Receive callbacks (SERIALCALLBACKS) have to be compiled into the library!
+ *  \param uart UART Module to watch
+ *  \param callback Called in the receive interrupt, or 0 to remove it
+ */
+void serialSetByteCallback(uint8_t uart, SerialByteCallback callback);
+
+/** Watch the receive buffer for a fill level, see serialRxLevelMask().
+ *  For example half the buffer size, to read a whole block at once.
+ *  serialInit() removes it again. Not used for polled UARTs.
+ *  Receive callbacks (SERIALCALLBACKS) have to be compiled into the library!
+ *  \param uart UART Module to watch
+ *  \param level Number of stored bytes, 1 to the receive buffer size, 0 to stop
+ */
+void serialSetRxLevel(uint8_t uart, uint16_t level);
+
+/** Find the UARTs whose receive buffers reached their level.
+ *  The receive interrupt only notes it, the application is told here,
+ *  outside of the interrupt. A reported bit is cleared, and set again by
+ *  the next received byte while the buffer still holds the level. Bits of
+ *  buffers read below their level in the meantime are not reported.
+ *  Receive callbacks (SERIALCALLBACKS) have to be compiled into the library!
+ *  \returns Bit n set if UART n holds at least the serialSetRxLevel() level
+ */
+uint8_t serialRxLevelMask(void);
+
+/** Send a buffer by reference, without copying it.
+ *  The transmit interrupt takes the bytes directly from the buffer, after
+ *  everything written before. It has to stay unchanged until
+ *  serialReferenceDone() returns 1 or the callback was called.
+ *  Waits until the transmit buffer and a previous reference are sent.
+ *  Reference transmission (SERIALREFERENCE) has to be compiled into the library!
+ *  \param uart UART Module to write to
+ *  \param data Bytes to send, in RAM
+ *  \param length Number of bytes to send
+ *  \param done Callback when finished, or 0
+ */
+void serialWriteReference(uint8_t uart, const uint8_t *data, uint16_t length,
+        SerialCallback done);
+
+/** Send a buffer from program memory by reference.
+ *  Like serialWriteReference(), for data in flash (PROGMEM).
+ *  Reference transmission (SERIALREFERENCE) has to be compiled into the library!
+ *  \param uart UART Module to write to
+ *  \param data Bytes to send, in flash
+ *  \param length Number of bytes to send
+ *  \param done Callback when finished, or 0
+ */
+void serialWriteReference_P(uint8_t uart, const uint8_t *data, uint16_t length,
+        SerialCallback done);
+
+/** Check if a buffer sent by reference may be reused.
+ *  Reference transmission (SERIALREFERENCE) has to be compiled into the library!
+ *  \param uart UART Module to check
+ *  \returns 1 if no reference is waiting to be sent, 0 if it is still in use
+ */
+uint8_t serialReferenceDone(uint8_t uart);
+
 /** Send a 16bit integer.
  *  \param uart UART Module to write to
  *  \param num Unsigned integer to send as decimal ASCII
  */
 void serialWriteInt16(uint8_t uart, uint16_t num);
 
+/** Send a 32bit integer.
+ *  \param uart UART Module to write to
+ *  \param num Unsigned integer to send as decimal ASCII
+ */
+void serialWriteUInt32(uint8_t uart, uint32_t num);
+
+/** Send a signed 32bit integer.
+ *  \param uart UART Module to write to
+ *  \param num Signed integer to send as decimal ASCII, with '-' if negative
+ */
+void serialWriteInt32(uint8_t uart, int32_t num);
+
+/** Send a fixed-point number.
+ *  For example 1234 with 2 decimals is sent as 12.34, -5 as -0.05.
+ *  \param uart UART Module to write to
+ *  \param num Value, scaled by 10 to the power of decimals
+ *  \param decimals Number of digits after the point, 9 at most
+ */
+void serialWriteFixed(uint8_t uart, int32_t num, uint8_t decimals);
+
+/** Send an integer as hexadecimal ASCII, with upper case letters.
+ *  \param uart UART Module to write to
+ *  \param num Integer to send
+ *  \param digits Number of digits with leading zeros (1 to 8), 0 for as many as needed
+ */
+void serialWriteHex(uint8_t uart, uint32_t num, uint8_t digits);
+
+/** Send an integer as binary ASCII.
+ *  \param uart UART Module to write to
+ *  \param num Integer to send
+ *  \param bits Number of digits with leading zeros (1 to 32), 0 for as many as needed
+ */
+void serialWriteBinary(uint8_t uart, uint32_t num, uint8_t bits);
+
+/** Get a stdio stream for a UART, for use with fprintf(), fgetc() and friends.
+ *  Output is staged per stream (SERIALSTDIOBUFFER) and copied into the
+ *  transmit buffer on a newline, when the staging buffer is full, or before
+ *  reading. Reading waits for a received byte.
+ *  stdio streams (SERIALSTDIO) have to be compiled into the library!
+ *  \param uart UART Module of the stream, has to be initialized
+ *  \returns Stream, or 0 if the UART does not exist
+ */
+FILE *serialStream(uint8_t uart);
+
+/** Send output staged by the stdio stream of a UART.
+ *  Use this instead of fflush(), which does nothing on AVRs.
+ *  stdio streams (SERIALSTDIO) have to be compiled into the library!
+ *  \param uart UART Module to flush
+ */
+void serialStreamFlush(uint8_t uart);
+
 /** Check if the transmit buffer is full.
  *  \param uart UART Module to check
  *  \returns 1 if buffer is full, 0 if not
  */
 uint8_t serialTxBufferFull(uint8_t uart);
 
+/** Get the free space in the transmit buffer.
+ *  \param uart UART Module to check
+ *  \returns Number of bytes that can be written without waiting
+ */
+uint16_t serialTxBufferFree(uint8_t uart);
+
 /** Check if the transmit buffer is empty.
+ *  Includes a buffer sent by reference.
  *  \param uart UART Module to check
  *  \returns 1 if buffer is empty, 0 if not.
  */
 uint8_t serialTxBufferEmpty(uint8_t uart);
 
+/** Statistics of a UART Module, see serialGetStats().
+ *  All counters wrap around.
+ */
+typedef struct {
+    uint32_t received; /**< Bytes read from the receiver, including dropped ones */
+    uint32_t transmitted; /**< Bytes handed to the transmitter, including XON/XOFF */
+    uint16_t overflows; /**< Bytes dropped because the receive buffer was full */
+    uint16_t overruns; /**< Hardware data overruns, bytes lost before the interrupt ran */
+    uint16_t frameErrors; /**< Bytes received with a missing stop bit */
+    uint16_t parityErrors; /**< Bytes received with a wrong parity bit */
+    uint16_t xoffs; /**< XOFF sent by flow control */
+    uint16_t maxRxUsed; /**< Highest receive buffer usage seen */
+    uint16_t packetErrors; /**< Received packets dropped, with a wrong CRC or no room left */
+} SerialStats;
+
+/** Get the statistics of a UART Module.
+ *  Bytes with errors are still stored in the receive buffer.
+ *  DMA reception only counts received bytes and the buffer usage.
+ *  Statistics (SERIALSTATS) have to be compiled into the library!
+ *  \param uart UART Module to check
+ *  \param data Storage for a copy of the counters
+ */
+void serialGetStats(uint8_t uart, SerialStats *data);
+
+/** Reset the statistics of a UART Module.
+ *  serialInit() does this as well.
+ *  Statistics (SERIALSTATS) have to be compiled into the library!
+ *  \param uart UART Module to reset
+ */
+void serialClearStats(uint8_t uart);
+
+/** Find the UARTs with received data, without asking each one.
+ *  The receive interrupt marks UARTs when it stores data, so only marked
+ *  ones and polled or DMA ones are checked. Bit n is set for UART n if
+ *  serialHasChar(n) would return 1.
+ *  Pending masks (SERIALPENDING) have to be compiled into the library!
+ *  \returns Bit mask of the UARTs with received data
+ */
+uint8_t serialPendingMask(void);
+
+/** Find the UARTs with room in the transmit buffer.
+ *  Bit n is set for UART n if serialWrite(n) would not have to wait.
+ *  \returns Bit mask of the UARTs with transmit buffer space
+ */
+uint8_t serialTxSpaceMask(void);
+
+/** Resume transmission after the CTS input changed.
+ *  The transmit interrupt checks CTS before every byte. While it is high,
+ *  the interrupt switches itself off, so nothing wakes it up when CTS goes
+ *  low again. The application has to install a pin change or external
+ *  interrupt on the CTS pin and call this from it. Without that hook,
+ *  transmission paused by CTS only resumes with the next write.
+ *  Up to two bytes may still leave after CTS went high, the one in the
+ *  shift register and the one in the data register. DMA ports only check
+ *  CTS between blocks.
+ *  RTS/CTS pins have to be configured in serial_device.h!
+ *  \param uart UART Module whose CTS pin changed
+ */
+void serialCtsChanged(uint8_t uart);
+
+// Index width of the ring buffers. 8bit indices can be accessed
+// atomically, so they are used if every buffer holds at most 128 bytes.
+#if (RX_BUFFER_SIZE_0 > 128) || (TX_BUFFER_SIZE_0 > 128) \
+        || (RX_BUFFER_SIZE_1 > 128) || (TX_BUFFER_SIZE_1 > 128) \
+        || (RX_BUFFER_SIZE_2 > 128) || (TX_BUFFER_SIZE_2 > 128) \
+        || (RX_BUFFER_SIZE_3 > 128) || (TX_BUFFER_SIZE_3 > 128) \
+        || (RX_BUFFER_SIZE_4 > 128) || (TX_BUFFER_SIZE_4 > 128) \
+        || (RX_BUFFER_SIZE_5 > 128) || (TX_BUFFER_SIZE_5 > 128) \
+        || (RX_BUFFER_SIZE_6 > 128) || (TX_BUFFER_SIZE_6 > 128) \
+        || (RX_BUFFER_SIZE_7 > 128) || (TX_BUFFER_SIZE_7 > 128)
+#define SERIAL_INDEX_16BIT
+typedef uint16_t SerialIndex;
+#else
+typedef uint8_t SerialIndex;
+#endif
+
+// Ports whose buffers the inline functions below may use directly.
+// Receiving needs the library for polling, packets, DMA and the bookkeeping
+// of XON/XOFF, RTS and line mode, transmitting for polling and CR injection.
+#if SERIAL_POLLED_0 || SERIAL_PACKETS_0 || defined(SERIAL_RTS_PORT_0) \
+        || (defined(SERIAL_DMA_RX_0) && (SERIAL_DMA_RX_0 >= 0)) \
+        || defined(FLOWCONTROL) || defined(SERIALLINES)
+#define SERIAL_DIRECT_RX_0 0
+#else
+#define SERIAL_DIRECT_RX_0 1
+#endif
+#if SERIAL_POLLED_0 || defined(SERIALINJECTCR)
+#define SERIAL_DIRECT_TX_0 0
+#else
+#define SERIAL_DIRECT_TX_0 1
+#endif
+#if SERIAL_POLLED_1 || SERIAL_PACKETS_1 || defined(SERIAL_RTS_PORT_1) \
+        || (defined(SERIAL_DMA_RX_1) && (SERIAL_DMA_RX_1 >= 0)) \
+        || defined(FLOWCONTROL) || defined(SERIALLINES)
+#define SERIAL_DIRECT_RX_1 0
+#else
+#define SERIAL_DIRECT_RX_1 1
+#endif
+#if SERIAL_POLLED_1 || defined(SERIALINJECTCR)
+#define SERIAL_DIRECT_TX_1 0
+#else
+#define SERIAL_DIRECT_TX_1 1
+#endif
+#if SERIAL_POLLED_2 || SERIAL_PACKETS_2 || defined(SERIAL_RTS_PORT_2) \
+        || (defined(SERIAL_DMA_RX_2) && (SERIAL_DMA_RX_2 >= 0)) \
+        || defined(FLOWCONTROL) || defined(SERIALLINES)
+#define SERIAL_DIRECT_RX_2 0
+#else
+#define SERIAL_DIRECT_RX_2 1
+#endif
+#if SERIAL_POLLED_2 || defined(SERIALINJECTCR)
+#define SERIAL_DIRECT_TX_2 0
+#else
+#define SERIAL_DIRECT_TX_2 1
+#endif
+#if SERIAL_POLLED_3 || SERIAL_PACKETS_3 || defined(SERIAL_RTS_PORT_3) \
+        || (defined(SERIAL_DMA_RX_3) && (SERIAL_DMA_RX_3 >= 0)) \
+        || defined(FLOWCONTROL) || defined(SERIALLINES)
+#define SERIAL_DIRECT_RX_3 0
+#else
+#define SERIAL_DIRECT_RX_3 1
+#endif
+#if SERIAL_POLLED_3 || defined(SERIALINJECTCR)
+#define SERIAL_DIRECT_TX_3 0
+#else
+#define SERIAL_DIRECT_TX_3 1
+#endif
+#if SERIAL_POLLED_4 || SERIAL_PACKETS_4 || defined(SERIAL_RTS_PORT_4) \
+        || (defined(SERIAL_DMA_RX_4) && (SERIAL_DMA_RX_4 >= 0)) \
+        || defined(FLOWCONTROL) || defined(SERIALLINES)
+#define SERIAL_DIRECT_RX_4 0
+#else
+#define SERIAL_DIRECT_RX_4 1
+#endif
+#if SERIAL_POLLED_4 || defined(SERIALINJECTCR)
+#define SERIAL_DIRECT_TX_4 0
+#else
+#define SERIAL_DIRECT_TX_4 1
+#endif
+#if SERIAL_POLLED_5 || SERIAL_PACKETS_5 || defined(SERIAL_RTS_PORT_5) \
+        || (defined(SERIAL_DMA_RX_5) && (SERIAL_DMA_RX_5 >= 0)) \
+        || defined(FLOWCONTROL) || defined(SERIALLINES)
+#define SERIAL_DIRECT_RX_5 0
+#else
+#define SERIAL_DIRECT_RX_5 1
+#endif
+#if SERIAL_POLLED_5 || defined(SERIALINJECTCR)
+#define SERIAL_DIRECT_TX_5 0
+#else
+#define SERIAL_DIRECT_TX_5 1
+#endif
+#if SERIAL_POLLED_6 || SERIAL_PACKETS_6 || defined(SERIAL_RTS_PORT_6) \
+        || (defined(SERIAL_DMA_RX_6) && (SERIAL_DMA_RX_6 >= 0)) \
+        || defined(FLOWCONTROL) || defined(SERIALLINES)
+#define SERIAL_DIRECT_RX_6 0
+#else
+#define SERIAL_DIRECT_RX_6 1
+#endif
+#if SERIAL_POLLED_6 || defined(SERIALINJECTCR)
+#define SERIAL_DIRECT_TX_6 0
+#else
+#define SERIAL_DIRECT_TX_6 1
+#endif
+#if SERIAL_POLLED_7 || SERIAL_PACKETS_7 || defined(SERIAL_RTS_PORT_7) \
+        || (defined(SERIAL_DMA_RX_7) && (SERIAL_DMA_RX_7 >= 0)) \
+        || defined(FLOWCONTROL) || defined(SERIALLINES)
+#define SERIAL_DIRECT_RX_7 0
+#else
+#define SERIAL_DIRECT_RX_7 1
+#endif
+#if SERIAL_POLLED_7 || defined(SERIALINJECTCR)
+#define SERIAL_DIRECT_TX_7 0
+#else
+#define SERIAL_DIRECT_TX_7 1
+#endif
+
+// serial.c defines the buffer indices under names carrying the buffer
+// sizes and direct ports. A file compiled with other sizes or port modes
+// than serial.c uses another index width, mask or buffer handling, so it
+// has to fail to link instead. The sizes have to be plain numbers.
+#define SERIAL_CONFIGURED(name) SERIAL_CONFIG_NAME(name, \
+        RX_BUFFER_SIZE_0, TX_BUFFER_SIZE_0, SERIAL_DIRECT_RX_0, SERIAL_DIRECT_TX_0, \
+        RX_BUFFER_SIZE_1, TX_BUFFER_SIZE_1, SERIAL_DIRECT_RX_1, SERIAL_DIRECT_TX_1, \
+        RX_BUFFER_SIZE_2, TX_BUFFER_SIZE_2, SERIAL_DIRECT_RX_2, SERIAL_DIRECT_TX_2, \
+        RX_BUFFER_SIZE_3, TX_BUFFER_SIZE_3, SERIAL_DIRECT_RX_3, SERIAL_DIRECT_TX_3, \
+        RX_BUFFER_SIZE_4, TX_BUFFER_SIZE_4, SERIAL_DIRECT_RX_4, SERIAL_DIRECT_TX_4, \
+        RX_BUFFER_SIZE_5, TX_BUFFER_SIZE_5, SERIAL_DIRECT_RX_5, SERIAL_DIRECT_TX_5, \
+        RX_BUFFER_SIZE_6, TX_BUFFER_SIZE_6, SERIAL_DIRECT_RX_6, SERIAL_DIRECT_TX_6, \
+        RX_BUFFER_SIZE_7, TX_BUFFER_SIZE_7, SERIAL_DIRECT_RX_7, SERIAL_DIRECT_TX_7)
+#define SERIAL_CONFIG_NAME(...) SERIAL_CONFIG_PASTE(__VA_ARGS__)
+#define SERIAL_CONFIG_PASTE(name, r0, t0, dr0, dt0, r1, t1, dr1, dt1, r2, t2, dr2, dt2, r3, t3, dr3, dt3, r4, t4, dr4, dt4, r5, t5, dr5, dt5, r6, t6, dr6, dt6, r7, t7, dr7, dt7) \
+    name ## _ ## r0 ## _ ## t0 ## _ ## dr0 ## dt0 ## _ ## r1 ## _ ## t1 ## _ ## dr1 ## dt1 ## _ ## r2 ## _ ## t2 ## _ ## dr2 ## dt2 ## _ ## r3 ## _ ## t3 ## _ ## dr3 ## dt3 ## _ ## r4 ## _ ## t4 ## _ ## dr4 ## dt4 ## _ ## r5 ## _ ## t5 ## _ ## dr5 ## dt5 ## _ ## r6 ## _ ## t6 ## _ ## dr6 ## dt6 ## _ ## r7 ## _ ## t7 ## _ ## dr7 ## dt7
+
+#define serialRxRead SERIAL_CONFIGURED(serialRxRead)
+#define serialRxWrite SERIAL_CONFIGURED(serialRxWrite)
+#define serialTxRead SERIAL_CONFIGURED(serialTxRead)
+#define serialTxWrite SERIAL_CONFIGURED(serialTxWrite)
+
+// Buffer state of serial.c, used by the inline functions below
+extern SerialIndex volatile serialRxRead[];
+extern SerialIndex volatile serialRxWrite[];
+extern SerialIndex volatile serialTxRead[];
+extern SerialIndex volatile serialTxWrite[];
+extern uint8_t volatile serialShouldStart[];
+
+// An index owned by the interrupts, read without seeing it half-updated
+static inline SerialIndex serialPortIndexRead(SerialIndex volatile *index) {
+#ifdef SERIAL_INDEX_16BIT
+    uint8_t sreg = SREG;
+    cli();
+    SerialIndex value = *index;
+    SREG = sreg;
+    return value;
+#else
+    return *index;
+#endif
+}
+
+// An index owned by the main context, advanced atomically
+static inline void serialPortIndexAdd(SerialIndex volatile *index) {
+#ifdef SERIAL_INDEX_16BIT
+    uint8_t sreg = SREG;
+    cli();
+    (*index)++;
+    SREG = sreg;
+#else
+    (*index)++;
+#endif
+}
+
+/** Defines inline functions for a fixed UART Module n.
+ *  serialnHasChar(), serialnGet() and serialnWrite() work like serialHasChar(),
+ *  serialGet() and serialWrite(), but are inlined with the module known.
+ *  Buffers, indices and buffer sizes are then constants at the call site,
+ *  without range check and table lookups. Only starting a transmission
+ *  calls serialnStart(). Ports that need more than the buffers (polled,
+ *  packets, DMA, XON/XOFF, RTS, line mode or CR injection) call the library
+ *  instead, decided at compile time.
+ *  Using a module the MCU does not have fails to link.
+ *  \param n UART Module number
+ */
+#define SERIAL_PORT_INLINE(n) \
+    extern uint8_t volatile serialRxBuffer ## n[]; \
+    extern uint8_t volatile serialTxBuffer ## n[]; \
+    void serial ## n ## Start(void); \
+    \
+    static inline uint8_t serial ## n ## HasChar(void) { \
+        if (!SERIAL_DIRECT_RX_ ## n) { \
+            return serialHasChar(n); \
+        } \
+        return serialPortIndexRead(&serialRxWrite[n]) != serialRxRead[n]; \
+    } \
+    \
+    static inline uint8_t serial ## n ## Get(void) { \
+        if (!SERIAL_DIRECT_RX_ ## n) { \
+            return serialGet(n); \
+        } \
+        SerialIndex read = serialRxRead[n]; \
+        if (read == serialPortIndexRead(&serialRxWrite[n])) { \
+            return 0; \
+        } \
+        uint8_t c = serialRxBuffer ## n[read & (RX_BUFFER_SIZE_ ## n - 1)]; \
+        serialPortIndexAdd(&serialRxRead[n]); \
+        return c; \
+    } \
+    \
+    static inline void serial ## n ## Write(uint8_t data) { \
+        SerialIndex write = serialTxWrite[n]; \
+        if (!SERIAL_DIRECT_TX_ ## n || ((SerialIndex)(write \
+                - serialPortIndexRead(&serialTxRead[n])) == TX_BUFFER_SIZE_ ## n)) { \
+            serialWrite(n, data); \
+            return; \
+        } \
+        serialTxBuffer ## n[write & (TX_BUFFER_SIZE_ ## n - 1)] = data; \
+        serialPortIndexAdd(&serialTxWrite[n]); \
+        if (serialShouldStart[n]) { \
+            serial ## n ## Start(); \
+        } \
+    }
+
+SERIAL_PORT_INLINE(0)
+SERIAL_PORT_INLINE(1)
+SERIAL_PORT_INLINE(2)
+SERIAL_PORT_INLINE(3)
+SERIAL_PORT_INLINE(4)
+SERIAL_PORT_INLINE(5)
+SERIAL_PORT_INLINE(6)
+SERIAL_PORT_INLINE(7)
+
 #endif // _serial_h
 /** @} */
 
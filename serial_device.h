@@ -42,33 +42,48 @@
  *  Contains Register and Bit Positions for different AVR devices.
  */
 
+// SERIAL_DEVICES and the pin lists below only describe the device. The
+// tables are built from them once, in serial.c, and kept in flash instead
+// of having them copied to SRAM at startup. Bit positions are constants.
+#ifndef SERIAL_HOST_SIM
+#define SERIALFLASH __flash
+#else
+#define SERIALFLASH
+#endif
+
 #if  defined(__AVR_ATmega8__) || defined(__AVR_ATmega16__) \
     || defined(__AVR_ATmega32__) || defined(__AVR_ATmega8515__) \
     || defined(__AVR_ATmega8535__) || defined(__AVR_ATmega323__)
 
 #define UART_COUNT 1
-#define UART_REGISTERS 6
-#define UART_BITS 7
-volatile uint8_t * const serialRegisters[UART_COUNT][UART_REGISTERS] = {{
-    &UDR,
-    &UCSRB,
-    &UCSRC,
-    &UCSRA,
-    &UBRRH,
-    &UBRRL
-}};
+// Data, B, C and A registers, then the baud rate register(s)
+#define SERIAL_DEVICES { \
+    { &UDR, &UCSRB, &UCSRC, &UCSRA, &UBRRH, &UBRRL } \
+}
 #define SERIALBAUDBIT 8
-uint8_t const serialBits[UART_COUNT][UART_BITS] = {{
-    UCSZ0,
-    UCSZ1,
-    RXCIE,
-    RXEN,
-    TXEN,
-    UDRIE,
-    UDRE
-}};
+// Bit positions, the same in every USART of the device
+#define SERIALUCSZ0 UCSZ0
+#define SERIALUCSZ1 UCSZ1
+#define SERIALRXCIE RXCIE
+#define SERIALRXEN  RXEN
+#define SERIALTXEN  TXEN
+#define SERIALUDRIE UDRIE
+#define SERIALUDRE  UDRE
+#define SERIALU2X   U2X
+#define SERIALRXC   RXC
+#define SERIALFE    FE
+#define SERIALDOR   DOR
+#define SERIALUPE   PE
+#define SERIALUPM0  UPM0
+#define SERIALUSBS  USBS
+#define SERIALUCSZ2 UCSZ2
+#define SERIALMPCM  MPCM
+#define SERIALTXB8  TXB8
+#define SERIALRXB8  RXB8
+#define SERIALTXCIE TXCIE
 #define SERIALRECIEVEINTERRUPT0 USART_RXC_vect
 #define SERIALTRANSMITINTERRUPT0 USART_UDRE_vect
+#define SERIALTXCOMPLETEINTERRUPT0 USART_TXC_vect
 
 #elif defined(__AVR_ATmega168__) || defined(__AVR_ATmega328__) \
     || defined(__AVR_ATmega48__) || defined(__AVR_ATmega88__) \
@@ -76,189 +91,150 @@ uint8_t const serialBits[UART_COUNT][UART_BITS] = {{
     || defined(__AVR_ATmega48P__) || defined(__AVR_ATmega88P__)
 
 #define UART_COUNT 1
-#define UART_REGISTERS 5
-#define UART_BITS 7
-volatile uint8_t * const serialRegisters[UART_COUNT][UART_REGISTERS] = {{
-    &UDR0,
-    &UCSR0B,
-    &UCSR0C,
-    &UCSR0A
-}};
 #define SERIALBAUDBIT 16
-volatile uint16_t * const serialBaudRegisters[UART_COUNT] = {
-    &UBRR0
-};
-uint8_t const const serialBits[UART_COUNT][UART_BITS] = {{
-    UCSZ00,
-    UCSZ01,
-    RXCIE0,
-    RXEN0,
-    TXEN0,
-    UDRIE0,
-    UDRE0
-}};
+// Data, B, C and A registers, then the baud rate register(s)
+#define SERIAL_DEVICES { \
+    { &UDR0, &UCSR0B, &UCSR0C, &UCSR0A, &UBRR0 } \
+}
+// Bit positions, the same in every USART of the device
+#define SERIALUCSZ0 UCSZ00
+#define SERIALUCSZ1 UCSZ01
+#define SERIALRXCIE RXCIE0
+#define SERIALRXEN  RXEN0
+#define SERIALTXEN  TXEN0
+#define SERIALUDRIE UDRIE0
+#define SERIALUDRE  UDRE0
+#define SERIALU2X   U2X0
+#define SERIALRXC   RXC0
+#define SERIALFE    FE0
+#define SERIALDOR   DOR0
+#define SERIALUPE   UPE0
+#define SERIALUPM0  UPM00
+#define SERIALUSBS  USBS0
+#define SERIALUCSZ2 UCSZ02
+#define SERIALMPCM  MPCM0
+#define SERIALTXB8  TXB80
+#define SERIALRXB8  RXB80
+#define SERIALTXCIE TXCIE0
 #define SERIALRECIEVEINTERRUPT0 USART_RX_vect
 #define SERIALTRANSMITINTERRUPT0 USART_UDRE_vect
+#define SERIALTXCOMPLETEINTERRUPT0 USART_TX_vect
 
 #elif defined(__AVR_ATmega2561__) || defined(__AVR_ATmega1281__) \
     || defined(__AVR_ATmega1284P__)
 
 #define UART_COUNT 2
-#define UART_REGISTERS 4
-#define UART_BITS 7
-volatile uint8_t * const serialRegisters[UART_COUNT][UART_REGISTERS] = {
-    {
-        &UDR0,
-        &UCSR0B,
-        &UCSR0C,
-        &UCSR0A
-    },
-    {
-        &UDR1,
-        &UCSR1B,
-        &UCSR1C,
-        &UCSR1A
-    }
-};
 #define SERIALBAUDBIT 16
-volatile uint16_t * const serialBaudRegisters[UART_COUNT] = {
-    &UBRR0, &UBRR1
-};
-uint8_t const serialBits[UART_COUNT][UART_BITS] = {
-    {
-        UCSZ00,
-        UCSZ01,
-        RXCIE0,
-        RXEN0,
-        TXEN0,
-        UDRIE0,
-        UDRE0
-    },
-    {
-        UCSZ10,
-        UCSZ11,
-        RXCIE1,
-        RXEN1,
-        TXEN1,
-        UDRIE1,
-        UDRE1
-    }
-};
+// Data, B, C and A registers, then the baud rate register(s)
+#define SERIAL_DEVICES { \
+    { &UDR0, &UCSR0B, &UCSR0C, &UCSR0A, &UBRR0 }, \
+    { &UDR1, &UCSR1B, &UCSR1C, &UCSR1A, &UBRR1 } \
+}
+// Bit positions, the same in every USART of the device
+#define SERIALUCSZ0 UCSZ00
+#define SERIALUCSZ1 UCSZ01
+#define SERIALRXCIE RXCIE0
+#define SERIALRXEN  RXEN0
+#define SERIALTXEN  TXEN0
+#define SERIALUDRIE UDRIE0
+#define SERIALUDRE  UDRE0
+#define SERIALU2X   U2X0
+#define SERIALRXC   RXC0
+#define SERIALFE    FE0
+#define SERIALDOR   DOR0
+#define SERIALUPE   UPE0
+#define SERIALUPM0  UPM00
+#define SERIALUSBS  USBS0
+#define SERIALUCSZ2 UCSZ02
+#define SERIALMPCM  MPCM0
+#define SERIALTXB8  TXB80
+#define SERIALRXB8  RXB80
+#define SERIALTXCIE TXCIE0
 #define SERIALRECIEVEINTERRUPT0   USART0_RX_vect
 #define SERIALTRANSMITINTERRUPT0  USART0_UDRE_vect
+#define SERIALTXCOMPLETEINTERRUPT0 USART0_TX_vect
 #define SERIALRECIEVEINTERRUPT1  USART1_RX_vect
 #define SERIALTRANSMITINTERRUPT1 USART1_UDRE_vect
+#define SERIALTXCOMPLETEINTERRUPT1 USART1_TX_vect
 
 
 #elif defined(__AVR_ATmega2560__) || defined(__AVR_ATmega1280__) \
     || defined(__AVR_ATmega640__)
 
 #define UART_COUNT 4
-#define UART_REGISTERS 4
-#define UART_BITS 7
-volatile uint8_t * const serialRegisters[UART_COUNT][UART_REGISTERS] = {
-    {
-        &UDR0,
-        &UCSR0B,
-        &UCSR0C,
-        &UCSR0A
-    },
-    {
-        &UDR1,
-        &UCSR1B,
-        &UCSR1C,
-        &UCSR1A
-    },
-    {
-        &UDR2,
-        &UCSR2B,
-        &UCSR2C,
-        &UCSR2A
-    },
-    {
-        &UDR3,
-        &UCSR3B,
-        &UCSR3C,
-        &UCSR3A
-    }
-};
 #define SERIALBAUDBIT 16
-volatile uint16_t * const serialBaudRegisters[UART_COUNT] = {
-    &UBRR0, &UBRR1, &UBRR2, &UBRR3
-};
-uint8_t const serialBits[UART_COUNT][UART_BITS] = {
-    {
-        UCSZ00,
-        UCSZ01,
-        RXCIE0,
-        RXEN0,
-        TXEN0,
-        UDRIE0,
-        UDRE0
-    },
-    {
-        UCSZ10,
-        UCSZ11,
-        RXCIE1,
-        RXEN1,
-        TXEN1,
-        UDRIE1,
-        UDRE1
-    },
-    {
-        UCSZ20,
-        UCSZ21,
-        RXCIE2,
-        RXEN2,
-        TXEN2,
-        UDRIE2,
-        UDRE2
-    },
-    {
-        UCSZ30,
-        UCSZ31,
-        RXCIE3,
-        RXEN3,
-        TXEN3,
-        UDRIE3,
-        UDRE3
-    }
-};
+// Data, B, C and A registers, then the baud rate register(s)
+#define SERIAL_DEVICES { \
+    { &UDR0, &UCSR0B, &UCSR0C, &UCSR0A, &UBRR0 }, \
+    { &UDR1, &UCSR1B, &UCSR1C, &UCSR1A, &UBRR1 }, \
+    { &UDR2, &UCSR2B, &UCSR2C, &UCSR2A, &UBRR2 }, \
+    { &UDR3, &UCSR3B, &UCSR3C, &UCSR3A, &UBRR3 } \
+}
+// Bit positions, the same in every USART of the device
+#define SERIALUCSZ0 UCSZ00
+#define SERIALUCSZ1 UCSZ01
+#define SERIALRXCIE RXCIE0
+#define SERIALRXEN  RXEN0
+#define SERIALTXEN  TXEN0
+#define SERIALUDRIE UDRIE0
+#define SERIALUDRE  UDRE0
+#define SERIALU2X   U2X0
+#define SERIALRXC   RXC0
+#define SERIALFE    FE0
+#define SERIALDOR   DOR0
+#define SERIALUPE   UPE0
+#define SERIALUPM0  UPM00
+#define SERIALUSBS  USBS0
+#define SERIALUCSZ2 UCSZ02
+#define SERIALMPCM  MPCM0
+#define SERIALTXB8  TXB80
+#define SERIALRXB8  RXB80
+#define SERIALTXCIE TXCIE0
 #define SERIALRECIEVEINTERRUPT0   USART0_RX_vect
 #define SERIALTRANSMITINTERRUPT0  USART0_UDRE_vect
+#define SERIALTXCOMPLETEINTERRUPT0 USART0_TX_vect
 #define SERIALRECIEVEINTERRUPT1  USART1_RX_vect
 #define SERIALTRANSMITINTERRUPT1 USART1_UDRE_vect
+#define SERIALTXCOMPLETEINTERRUPT1 USART1_TX_vect
 #define SERIALRECIEVEINTERRUPT2  USART2_RX_vect
 #define SERIALTRANSMITINTERRUPT2 USART2_UDRE_vect
+#define SERIALTXCOMPLETEINTERRUPT2 USART2_TX_vect
 #define SERIALRECIEVEINTERRUPT3  USART3_RX_vect
 #define SERIALTRANSMITINTERRUPT3 USART3_UDRE_vect
+#define SERIALTXCOMPLETEINTERRUPT3 USART3_TX_vect
 
 #elif  defined(__AVR_ATtiny2313__) || defined(__AVR_ATtiny2313A__) \
     || defined(__AVR_ATtiny4313__)
 
 #define UART_COUNT 1
-#define UART_REGISTERS 6
-#define UART_BITS 7
-volatile uint8_t * const  serialRegisters[UART_COUNT][UART_REGISTERS] = {{
-    &UDR,
-    &UCSRB,
-    &UCSRC,
-    &UCSRA,
-    &UBRRH,
-    &UBRRL
-}};
+// Data, B, C and A registers, then the baud rate register(s)
+#define SERIAL_DEVICES { \
+    { &UDR, &UCSRB, &UCSRC, &UCSRA, &UBRRH, &UBRRL } \
+}
 #define SERIALBAUDBIT 8
-uint8_t const serialBits[UART_COUNT][UART_BITS] = {{
-    UCSZ0,
-    UCSZ1,
-    RXCIE,
-    RXEN,
-    TXEN,
-    UDRIE,
-    UDRE
-}};
+// Bit positions, the same in every USART of the device
+#define SERIALUCSZ0 UCSZ0
+#define SERIALUCSZ1 UCSZ1
+#define SERIALRXCIE RXCIE
+#define SERIALRXEN  RXEN
+#define SERIALTXEN  TXEN
+#define SERIALUDRIE UDRIE
+#define SERIALUDRE  UDRE
+#define SERIALU2X   U2X
+#define SERIALRXC   RXC
+#define SERIALFE    FE
+#define SERIALDOR   DOR
+#define SERIALUPE   UPE
+#define SERIALUPM0  UPM0
+#define SERIALUSBS  USBS
+#define SERIALUCSZ2 UCSZ2
+#define SERIALMPCM  MPCM
+#define SERIALTXB8  TXB8
+#define SERIALRXB8  RXB8
+#define SERIALTXCIE TXCIE
 #define SERIALRECIEVEINTERRUPT0 USART_RX_vect
 #define SERIALTRANSMITINTERRUPT0 USART_UDRE_vect
+#define SERIALTXCOMPLETEINTERRUPT0 USART_TX_vect
 
 #elif __AVR_ARCH__ >= 100
 
@@ -273,42 +249,337 @@ uint8_t const serialBits[UART_COUNT][UART_BITS] = {{
 #if defined(__AVR_ATxmega128A1__)
 
 #define UART_COUNT 8
-volatile USART_t * const serialRegisters[UART_COUNT] = {
-    &USARTC0,
-    &USARTC1,
-    &USARTD0,
-    &USARTD1,
-    &USARTE0,
-    &USARTE1,
-    &USARTF0,
-    &USARTF1
-};
+// USART module and DMA trigger of its receive complete event
+#define SERIAL_DEVICES { \
+    { &USARTC0, DMA_CH_TRIGSRC_USARTC0_RXC_gc }, \
+    { &USARTC1, DMA_CH_TRIGSRC_USARTC1_RXC_gc }, \
+    { &USARTD0, DMA_CH_TRIGSRC_USARTD0_RXC_gc }, \
+    { &USARTD1, DMA_CH_TRIGSRC_USARTD1_RXC_gc }, \
+    { &USARTE0, DMA_CH_TRIGSRC_USARTE0_RXC_gc }, \
+    { &USARTE1, DMA_CH_TRIGSRC_USARTE1_RXC_gc }, \
+    { &USARTF0, DMA_CH_TRIGSRC_USARTF0_RXC_gc }, \
+    { &USARTF1, DMA_CH_TRIGSRC_USARTF1_RXC_gc } \
+}
 
 #define SERIALRECIEVEINTERRUPT0   USARTC0_RXC_vect
-#define SERIALTRANSMITINTERRUPT0  USARTC0_TXC_vect
+#define SERIALTRANSMITINTERRUPT0  USARTC0_DRE_vect
+#define SERIALTXCOMPLETEINTERRUPT0 USARTC0_TXC_vect
 #define SERIALRECIEVEINTERRUPT1   USARTC1_RXC_vect
-#define SERIALTRANSMITINTERRUPT1  USARTC1_TXC_vect
+#define SERIALTRANSMITINTERRUPT1  USARTC1_DRE_vect
+#define SERIALTXCOMPLETEINTERRUPT1 USARTC1_TXC_vect
 #define SERIALRECIEVEINTERRUPT2   USARTD0_RXC_vect
-#define SERIALTRANSMITINTERRUPT2  USARTD0_TXC_vect
+#define SERIALTRANSMITINTERRUPT2  USARTD0_DRE_vect
+#define SERIALTXCOMPLETEINTERRUPT2 USARTD0_TXC_vect
 #define SERIALRECIEVEINTERRUPT3   USARTD1_RXC_vect
-#define SERIALTRANSMITINTERRUPT3  USARTD1_TXC_vect
+#define SERIALTRANSMITINTERRUPT3  USARTD1_DRE_vect
+#define SERIALTXCOMPLETEINTERRUPT3 USARTD1_TXC_vect
 #define SERIALRECIEVEINTERRUPT4   USARTE0_RXC_vect
-#define SERIALTRANSMITINTERRUPT4  USARTE0_TXC_vect
+#define SERIALTRANSMITINTERRUPT4  USARTE0_DRE_vect
+#define SERIALTXCOMPLETEINTERRUPT4 USARTE0_TXC_vect
 #define SERIALRECIEVEINTERRUPT5   USARTE1_RXC_vect
-#define SERIALTRANSMITINTERRUPT5  USARTE1_TXC_vect
+#define SERIALTRANSMITINTERRUPT5  USARTE1_DRE_vect
+#define SERIALTXCOMPLETEINTERRUPT5 USARTE1_TXC_vect
 #define SERIALRECIEVEINTERRUPT6   USARTF0_RXC_vect
-#define SERIALTRANSMITINTERRUPT6  USARTF0_TXC_vect
+#define SERIALTRANSMITINTERRUPT6  USARTF0_DRE_vect
+#define SERIALTXCOMPLETEINTERRUPT6 USARTF0_TXC_vect
 #define SERIALRECIEVEINTERRUPT7   USARTF1_RXC_vect
-#define SERIALTRANSMITINTERRUPT7  USARTF1_TXC_vect
+#define SERIALTRANSMITINTERRUPT7  USARTF1_DRE_vect
+#define SERIALTXCOMPLETEINTERRUPT7 USARTF1_TXC_vect
 
 #else
 #error "AvrSerialLibrary has not been adapted to your XMega device!"
 #endif
 
+#elif defined(SERIAL_HOST_SIM)
+
+// Simulated registers for host builds, see host/sim.c
+#include "sim.h"
+
+#ifndef SERIAL_HOST_SIM_XMEGA
+
+#define UART_COUNT 4
+#define SERIALBAUDBIT 16
+// Data, B, C and A registers, then the baud rate register(s)
+#define SERIAL_DEVICES { \
+    { &UDR0, &UCSR0B, &UCSR0C, &UCSR0A, &UBRR0 }, \
+    { &UDR1, &UCSR1B, &UCSR1C, &UCSR1A, &UBRR1 }, \
+    { &UDR2, &UCSR2B, &UCSR2C, &UCSR2A, &UBRR2 }, \
+    { &UDR3, &UCSR3B, &UCSR3C, &UCSR3A, &UBRR3 } \
+}
+// Bit positions, the same in every USART of the device
+#define SERIALUCSZ0 UCSZ0
+#define SERIALUCSZ1 UCSZ1
+#define SERIALRXCIE RXCIE
+#define SERIALRXEN  RXEN
+#define SERIALTXEN  TXEN
+#define SERIALUDRIE UDRIE
+#define SERIALUDRE  UDRE
+#define SERIALU2X   U2X
+#define SERIALRXC   RXC
+#define SERIALFE    FE
+#define SERIALDOR   DOR
+#define SERIALUPE   UPE
+#define SERIALUPM0  UPM0
+#define SERIALUSBS  USBS
+#define SERIALUCSZ2 UCSZ2
+#define SERIALMPCM  MPCM
+#define SERIALTXB8  TXB8
+#define SERIALRXB8  RXB8
+#define SERIALTXCIE TXCIE
+#define SERIALRECIEVEINTERRUPT0  simRxcVector0
+#define SERIALTRANSMITINTERRUPT0 simDreVector0
+#define SERIALTXCOMPLETEINTERRUPT0 simTxcVector0
+#define SERIALRECIEVEINTERRUPT1  simRxcVector1
+#define SERIALTRANSMITINTERRUPT1 simDreVector1
+#define SERIALTXCOMPLETEINTERRUPT1 simTxcVector1
+#define SERIALRECIEVEINTERRUPT2  simRxcVector2
+#define SERIALTRANSMITINTERRUPT2 simDreVector2
+#define SERIALTXCOMPLETEINTERRUPT2 simTxcVector2
+#define SERIALRECIEVEINTERRUPT3  simRxcVector3
+#define SERIALTRANSMITINTERRUPT3 simDreVector3
+#define SERIALTXCOMPLETEINTERRUPT3 simTxcVector3
+
+#else // SERIAL_HOST_SIM_XMEGA
+
+#define UART_XMEGA
+
+#define UART_INTERRUPT_LEVEL_TX 0x01
+#define UART_INTERRUPT_LEVEL_RX 0x02
+#define UART_INTERRUPT_MASK 0x03
+
+#define UART_COUNT 8
+// USART module and DMA trigger of its receive complete event
+#define SERIAL_DEVICES { \
+    { &USARTC0, DMA_CH_TRIGSRC_USARTC0_RXC_gc }, \
+    { &USARTC1, DMA_CH_TRIGSRC_USARTC1_RXC_gc }, \
+    { &USARTD0, DMA_CH_TRIGSRC_USARTD0_RXC_gc }, \
+    { &USARTD1, DMA_CH_TRIGSRC_USARTD1_RXC_gc }, \
+    { &USARTE0, DMA_CH_TRIGSRC_USARTE0_RXC_gc }, \
+    { &USARTE1, DMA_CH_TRIGSRC_USARTE1_RXC_gc }, \
+    { &USARTF0, DMA_CH_TRIGSRC_USARTF0_RXC_gc }, \
+    { &USARTF1, DMA_CH_TRIGSRC_USARTF1_RXC_gc } \
+}
+
+#define SERIALRECIEVEINTERRUPT0   simRxcVector0
+#define SERIALTRANSMITINTERRUPT0  simDreVector0
+#define SERIALTXCOMPLETEINTERRUPT0 simTxcVector0
+#define SERIALRECIEVEINTERRUPT1   simRxcVector1
+#define SERIALTRANSMITINTERRUPT1  simDreVector1
+#define SERIALTXCOMPLETEINTERRUPT1 simTxcVector1
+#define SERIALRECIEVEINTERRUPT2   simRxcVector2
+#define SERIALTRANSMITINTERRUPT2  simDreVector2
+#define SERIALTXCOMPLETEINTERRUPT2 simTxcVector2
+#define SERIALRECIEVEINTERRUPT3   simRxcVector3
+#define SERIALTRANSMITINTERRUPT3  simDreVector3
+#define SERIALTXCOMPLETEINTERRUPT3 simTxcVector3
+#define SERIALRECIEVEINTERRUPT4   simRxcVector4
+#define SERIALTRANSMITINTERRUPT4  simDreVector4
+#define SERIALTXCOMPLETEINTERRUPT4 simTxcVector4
+#define SERIALRECIEVEINTERRUPT5   simRxcVector5
+#define SERIALTRANSMITINTERRUPT5  simDreVector5
+#define SERIALTXCOMPLETEINTERRUPT5 simTxcVector5
+#define SERIALRECIEVEINTERRUPT6   simRxcVector6
+#define SERIALTRANSMITINTERRUPT6  simDreVector6
+#define SERIALTXCOMPLETEINTERRUPT6 simTxcVector6
+#define SERIALRECIEVEINTERRUPT7   simRxcVector7
+#define SERIALTRANSMITINTERRUPT7  simDreVector7
+#define SERIALTXCOMPLETEINTERRUPT7 simTxcVector7
+
+// Host pointers instead of 24bit DMA addresses
+#define SERIALDMASOURCE(channel, address) \
+    ((channel)->SRCADDR = (volatile uint8_t *)(address))
+#define SERIALDMADESTINATION(channel, address) \
+    ((channel)->DESTADDR = (volatile uint8_t *)(address))
+
+#endif // SERIAL_HOST_SIM_XMEGA
+
+// The simulator has to see every access of the data register
+#define SERIALPUTDATA(uart, dev, data) simPutData(uart, data)
+#define SERIALGETDATA(uart, dev) simGetData(uart)
+
+// Let virtual time pass while the library waits on a status flag
+#define SERIALWAIT() simRun(SIM_STEP)
+
+// There is no fdev_setup_stream() in the host C library
+#define SERIALSTREAMOPEN(uart, put, get) simStreamOpen(uart, put, get)
+
 #else
 #error "AvrSerialLibrary not compatible with your MCU!"
 #endif
 
+// Optional RTS/CTS flow control pins. Define SERIAL_RTS_PORT_n and
+// SERIAL_RTS_PIN_n, and / or SERIAL_CTS_PORT_n and SERIAL_CTS_PIN_n, for
+// UART module n. PORT is the PORTx register on classic AVRs, where PINx
+// and DDRx are found right below it, or the PORTx module on XMegas.
+// Both signals are active low.
+
+#if defined(SERIAL_RTS_PORT_0) || defined(SERIAL_RTS_PORT_1) \
+    || defined(SERIAL_RTS_PORT_2) || defined(SERIAL_RTS_PORT_3) \
+    || defined(SERIAL_RTS_PORT_4) || defined(SERIAL_RTS_PORT_5) \
+    || defined(SERIAL_RTS_PORT_6) || defined(SERIAL_RTS_PORT_7) \
+    || defined(SERIAL_CTS_PORT_0) || defined(SERIAL_CTS_PORT_1) \
+    || defined(SERIAL_CTS_PORT_2) || defined(SERIAL_CTS_PORT_3) \
+    || defined(SERIAL_CTS_PORT_4) || defined(SERIAL_CTS_PORT_5) \
+    || defined(SERIAL_CTS_PORT_6) || defined(SERIAL_CTS_PORT_7)
+#define SERIAL_RTSCTS
+#endif
+
+// Optional RS-485 driver enable pins. Define SERIAL_DE_PORT_n and
+// SERIAL_DE_PIN_n for UART module n, like the RTS/CTS pins. DE is active
+// high, it can also drive the inverted receiver enable of the transceiver.
+
+#if defined(SERIAL_DE_PORT_0) || defined(SERIAL_DE_PORT_1) \
+    || defined(SERIAL_DE_PORT_2) || defined(SERIAL_DE_PORT_3) \
+    || defined(SERIAL_DE_PORT_4) || defined(SERIAL_DE_PORT_5) \
+    || defined(SERIAL_DE_PORT_6) || defined(SERIAL_DE_PORT_7)
+#define SERIAL_RS485
+#endif
+
+#if defined(SERIAL_RTSCTS) || defined(SERIAL_RS485)
+
+#ifndef UART_XMEGA
+typedef volatile uint8_t * SerialPort;
+#else
+typedef PORT_t * SerialPort;
+#endif
+
+typedef struct {
+    SerialPort port;
+    uint8_t mask;
+} SerialPin;
+
+#endif // SERIAL_RTSCTS || SERIAL_RS485
+
+#ifdef SERIAL_RTSCTS
+
+#ifdef SERIAL_RTS_PORT_0
+#define SERIAL_RTS_0 { &SERIAL_RTS_PORT_0, (1 << SERIAL_RTS_PIN_0) }
+#else
+#define SERIAL_RTS_0 { 0, 0 }
+#endif
+#ifdef SERIAL_RTS_PORT_1
+#define SERIAL_RTS_1 { &SERIAL_RTS_PORT_1, (1 << SERIAL_RTS_PIN_1) }
+#else
+#define SERIAL_RTS_1 { 0, 0 }
+#endif
+#ifdef SERIAL_RTS_PORT_2
+#define SERIAL_RTS_2 { &SERIAL_RTS_PORT_2, (1 << SERIAL_RTS_PIN_2) }
+#else
+#define SERIAL_RTS_2 { 0, 0 }
+#endif
+#ifdef SERIAL_RTS_PORT_3
+#define SERIAL_RTS_3 { &SERIAL_RTS_PORT_3, (1 << SERIAL_RTS_PIN_3) }
+#else
+#define SERIAL_RTS_3 { 0, 0 }
+#endif
+#ifdef SERIAL_RTS_PORT_4
+#define SERIAL_RTS_4 { &SERIAL_RTS_PORT_4, (1 << SERIAL_RTS_PIN_4) }
+#else
+#define SERIAL_RTS_4 { 0, 0 }
+#endif
+#ifdef SERIAL_RTS_PORT_5
+#define SERIAL_RTS_5 { &SERIAL_RTS_PORT_5, (1 << SERIAL_RTS_PIN_5) }
+#else
+#define SERIAL_RTS_5 { 0, 0 }
+#endif
+#ifdef SERIAL_RTS_PORT_6
+#define SERIAL_RTS_6 { &SERIAL_RTS_PORT_6, (1 << SERIAL_RTS_PIN_6) }
+#else
+#define SERIAL_RTS_6 { 0, 0 }
+#endif
+#ifdef SERIAL_RTS_PORT_7
+#define SERIAL_RTS_7 { &SERIAL_RTS_PORT_7, (1 << SERIAL_RTS_PIN_7) }
+#else
+#define SERIAL_RTS_7 { 0, 0 }
+#endif
+#ifdef SERIAL_CTS_PORT_0
+#define SERIAL_CTS_0 { &SERIAL_CTS_PORT_0, (1 << SERIAL_CTS_PIN_0) }
+#else
+#define SERIAL_CTS_0 { 0, 0 }
+#endif
+#ifdef SERIAL_CTS_PORT_1
+#define SERIAL_CTS_1 { &SERIAL_CTS_PORT_1, (1 << SERIAL_CTS_PIN_1) }
+#else
+#define SERIAL_CTS_1 { 0, 0 }
+#endif
+#ifdef SERIAL_CTS_PORT_2
+#define SERIAL_CTS_2 { &SERIAL_CTS_PORT_2, (1 << SERIAL_CTS_PIN_2) }
+#else
+#define SERIAL_CTS_2 { 0, 0 }
+#endif
+#ifdef SERIAL_CTS_PORT_3
+#define SERIAL_CTS_3 { &SERIAL_CTS_PORT_3, (1 << SERIAL_CTS_PIN_3) }
+#else
+#define SERIAL_CTS_3 { 0, 0 }
+#endif
+#ifdef SERIAL_CTS_PORT_4
+#define SERIAL_CTS_4 { &SERIAL_CTS_PORT_4, (1 << SERIAL_CTS_PIN_4) }
+#else
+#define SERIAL_CTS_4 { 0, 0 }
+#endif
+#ifdef SERIAL_CTS_PORT_5
+#define SERIAL_CTS_5 { &SERIAL_CTS_PORT_5, (1 << SERIAL_CTS_PIN_5) }
+#else
+#define SERIAL_CTS_5 { 0, 0 }
+#endif
+#ifdef SERIAL_CTS_PORT_6
+#define SERIAL_CTS_6 { &SERIAL_CTS_PORT_6, (1 << SERIAL_CTS_PIN_6) }
+#else
+#define SERIAL_CTS_6 { 0, 0 }
+#endif
+#ifdef SERIAL_CTS_PORT_7
+#define SERIAL_CTS_7 { &SERIAL_CTS_PORT_7, (1 << SERIAL_CTS_PIN_7) }
+#else
+#define SERIAL_CTS_7 { 0, 0 }
+#endif
+
+#endif // SERIAL_RTSCTS
+
+#ifdef SERIAL_RS485
+
+#ifdef SERIAL_DE_PORT_0
+#define SERIAL_DE_0 { &SERIAL_DE_PORT_0, (1 << SERIAL_DE_PIN_0) }
+#else
+#define SERIAL_DE_0 { 0, 0 }
+#endif
+#ifdef SERIAL_DE_PORT_1
+#define SERIAL_DE_1 { &SERIAL_DE_PORT_1, (1 << SERIAL_DE_PIN_1) }
+#else
+#define SERIAL_DE_1 { 0, 0 }
+#endif
+#ifdef SERIAL_DE_PORT_2
+#define SERIAL_DE_2 { &SERIAL_DE_PORT_2, (1 << SERIAL_DE_PIN_2) }
+#else
+#define SERIAL_DE_2 { 0, 0 }
+#endif
+#ifdef SERIAL_DE_PORT_3
+#define SERIAL_DE_3 { &SERIAL_DE_PORT_3, (1 << SERIAL_DE_PIN_3) }
+#else
+#define SERIAL_DE_3 { 0, 0 }
+#endif
+#ifdef SERIAL_DE_PORT_4
+#define SERIAL_DE_4 { &SERIAL_DE_PORT_4, (1 << SERIAL_DE_PIN_4) }
+#else
+#define SERIAL_DE_4 { 0, 0 }
+#endif
+#ifdef SERIAL_DE_PORT_5
+#define SERIAL_DE_5 { &SERIAL_DE_PORT_5, (1 << SERIAL_DE_PIN_5) }
+#else
+#define SERIAL_DE_5 { 0, 0 }
+#endif
+#ifdef SERIAL_DE_PORT_6
+#define SERIAL_DE_6 { &SERIAL_DE_PORT_6, (1 << SERIAL_DE_PIN_6) }
+#else
+#define SERIAL_DE_6 { 0, 0 }
+#endif
+#ifdef SERIAL_DE_PORT_7
+#define SERIAL_DE_7 { &SERIAL_DE_PORT_7, (1 << SERIAL_DE_PIN_7) }
+#else
+#define SERIAL_DE_7 { 0, 0 }
+#endif
+
+#endif // SERIAL_RS485
+
 #endif // _serial_device_h
 /** @} */
 